@@ -99,7 +99,13 @@ KqueueImpl::change_events_locked(PosixTransport *transport, TransportFlags flags
   int nchanges = 0;
   struct kevent changes[2];
 
-  int extra = (flags & kTransportET) ? EV_CLEAR : 0;
+  // |flags| may only have events, so take the mode from the transport too.
+  TransportFlags mode = flags | transport->flags();
+  int extra = 0;
+  if (mode & kTransportET)
+    extra |= EV_CLEAR;
+  if (mode & kTransportOneShot)
+    extra |= EV_ONESHOT;
 
   if ((flags & kTransportReading) != (transport->flags() & kTransportReading)) {
     if (flags & kTransportReading)
@@ -124,6 +130,20 @@ KqueueImpl::change_events_locked(PosixTransport *transport, TransportFlags flags
   return nullptr;
 }
 
+// The kernel deleted the filter that fired, since it was added with
+// EV_ONESHOT. Delete the other filter, if any, so the whole transport is
+// disarmed. Returns false if the transport was detached.
+bool
+KqueueImpl::disarm_locked(PosixTransport *transport, TransportFlags fired)
+{
+  transport->flags() &= ~fired;
+  if (Ref<IOError> error = change_events_locked(transport, kTransportNoFlags)) {
+    reportError_locked(transport, error);
+    return false;
+  }
+  return true;
+}
+
 PassRef<StatusListener>
 KqueueImpl::detach_locked(PosixTransport *transport)
 {
@@ -142,17 +162,12 @@ KqueueImpl::detach_locked(PosixTransport *transport)
 }
 
 PassRef<IOError>
-KqueueImpl::Poll(int timeoutMs)
+KqueueImpl::PollNs(int64_t timeoutNs)
 {
   AutoMaybeLock poll_lock(poll_lock_);
 
   struct timespec timeout;
-  struct timespec *timeoutp = nullptr;
-  if (timeoutMs >= 0) {
-    timeout.tv_sec = timeoutMs / 1000;
-    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
-    timeoutp = &timeout;
-  }
+  struct timespec *timeoutp = TimeoutToTimespec(timeoutNs, &timeout);
 
   int nevents = kevent(kq_, nullptr, 0, event_buffer_.get(), event_buffer_.length(), timeoutp);
   if (nevents == -1) {
@@ -169,9 +184,15 @@ KqueueImpl::Poll(int timeoutMs)
     size_t slot = (size_t)ev.udata;
     if (isFdChanged(slot))
       continue;
+    eventDispatched();
 
+    // EOF on the read filter is only a half close. A transport that is still
+    // writing gets it as a read event, so the listener sees the end of the
+    // stream and can keep flushing output.
     PollData &data = listeners_[slot];
-    if (ev.flags & EV_EOF) {
+    if ((ev.flags & EV_EOF) &&
+        (ev.filter != EVFILT_READ || !(data.transport->flags() & kTransportWriting)))
+    {
       reportHup_locked(data.transport);
       continue;
     }
@@ -186,6 +207,8 @@ KqueueImpl::Poll(int timeoutMs)
         Ref<PosixTransport> transport = data.transport;
         if (!(transport->flags() & kTransportReading))
           continue;
+        if ((transport->flags() & kTransportOneShot) && !disarm_locked(transport, kTransportReading))
+          continue;
 
         Ref<StatusListener> listener = transport->listener();
 
@@ -199,6 +222,8 @@ KqueueImpl::Poll(int timeoutMs)
         Ref<PosixTransport> transport = data.transport;
         if (!(transport->flags() & kTransportWriting))
           continue;
+        if ((transport->flags() & kTransportOneShot) && !disarm_locked(transport, kTransportWriting))
+          continue;
 
         Ref<StatusListener> listener = transport->listener();
 
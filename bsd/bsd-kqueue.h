@@ -29,7 +29,7 @@ class KqueueImpl : public PosixPoller
   ~KqueueImpl();
 
   PassRef<IOError> Initialize(size_t absoluteMaxEvents);
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return true;
@@ -47,6 +47,8 @@ class KqueueImpl : public PosixPoller
     return listeners_[slot].modified == generation_;
   }
 
+  bool disarm_locked(PosixTransport *transport, TransportFlags fired);
+
  private:
   struct PollData {
     Ref<PosixTransport> transport;
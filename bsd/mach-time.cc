@@ -50,3 +50,16 @@ HighResolutionTimer::Counter()
 
   return (now * sTimerInfo.numer) / int64_t(sTimerInfo.denom);
 }
+
+// mach_absolute_time() is already a cheap, user-space read.
+int64_t
+HighResolutionTimer::FastCounter()
+{
+  return Counter();
+}
+
+bool
+HighResolutionTimer::HasFastCounter()
+{
+  return false;
+}
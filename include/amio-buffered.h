@@ -0,0 +1,128 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_buffered_h_
+#define _include_amio_buffered_h_
+
+#include <amio.h>
+
+namespace amio {
+
+// Options for creating a BufferedTransport.
+struct AMIO_LINK BufferedTransportOptions
+{
+  // The size of the input ring buffer, in bytes.
+  size_t inputCapacity;
+
+  // Reading from the transport pauses once this many unconsumed bytes are
+  // buffered, and resumes once the listener consumes enough input to get
+  // down to |lowWatermark|. If |highWatermark| is 0, it is the same as
+  // |inputCapacity|.
+  size_t highWatermark;
+  size_t lowWatermark;
+
+  // Queued output is stored in a chain of blocks of at least this size.
+  size_t outputBlockSize;
+
+  BufferedTransportOptions()
+   : inputCapacity(64 * 1024),
+     highWatermark(0),
+     lowWatermark(16 * 1024),
+     outputBlockSize(16 * 1024)
+  {}
+};
+
+// Receives notifications from a BufferedTransport. All callbacks are invoked
+// on the polling thread.
+class AMIO_LINK BufferedListener : public ke::IRefcounted
+{
+ public:
+  virtual ~BufferedListener()
+  {}
+
+  // Called when more input has been buffered. Input that is not consumed
+  // stays buffered for the next call.
+  virtual void OnData()
+  {}
+
+  // Called when all queued output has been written to the transport.
+  virtual void OnDrained()
+  {}
+
+  // Called once, when the peer closes the stream (|error| is null) or the
+  // stream fails. Input that was already buffered can still be read. If the
+  // peer only stopped sending, queued output is flushed first, and this is
+  // called once it has all been written; if the stream failed, queued output
+  // is discarded.
+  virtual void OnClosed(ke::Ref<IOError> error)
+  {}
+};
+
+// A BufferedTransport wraps a stream transport so callers don't have to deal
+// with partial reads and writes.
+//
+// Output is written straight to the transport when possible. Anything the
+// transport won't take right away is copied into a chain of blocks, which is
+// flushed with vectored writes as the transport becomes writable. The
+// transport only listens for write events while output is queued.
+//
+// Input is read into a ring buffer. If the listener falls behind and the
+// buffer reaches the high watermark, reading pauses until the listener
+// consumes input down to the low watermark, so a slow consumer pushes back
+// on its peer rather than buffering without limit.
+//
+// BufferedTransports are not thread-safe, and must only be used on the
+// thread polling the dispatcher.
+class AMIO_LINK BufferedTransport : public ke::IRefcounted
+{
+ public:
+  // Wrap |transport| and attach it to |dispatcher|. The transport must not
+  // already be attached. The BufferedTransport holds a reference to
+  // |listener| until it is closed.
+  static PassRef<IOError> Create(Ref<BufferedTransport> *outp,
+                                 Ref<IODispatcher> dispatcher,
+                                 Ref<Transport> transport,
+                                 Ref<BufferedListener> listener,
+                                 const BufferedTransportOptions &options = BufferedTransportOptions());
+
+  virtual ~BufferedTransport()
+  {}
+
+  // Write |length| bytes, queueing whatever can't be written immediately.
+  // Returns an error if the transport is closed, or if writing failed (in
+  // which case the transport is closed).
+  virtual PassRef<IOError> Write(const void *data, size_t length) = 0;
+
+  // Returns the number of bytes queued but not yet written.
+  virtual size_t PendingOutput() = 0;
+
+  // Returns the number of buffered input bytes.
+  virtual size_t Available() = 0;
+
+  // Copy up to |maxlength| bytes of buffered input into |buffer|, without
+  // consuming them. Returns the number of bytes copied.
+  virtual size_t Peek(void *buffer, size_t maxlength) = 0;
+
+  // Discard up to |length| bytes of buffered input.
+  virtual void Consume(size_t length) = 0;
+
+  // Same as Peek() followed by Consume().
+  virtual size_t Read(void *buffer, size_t maxlength) = 0;
+
+  // Close the transport. Queued output is discarded, and the listener is
+  // released without being notified. Buffered input can still be read.
+  virtual void Close() = 0;
+
+  // Returns true if the transport has been closed, by either side.
+  virtual bool Closed() = 0;
+};
+
+} // namespace amio
+
+#endif // _include_amio_buffered_h_
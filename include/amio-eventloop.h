@@ -11,6 +11,10 @@
 #define _include_amio_message_loop_h_
 
 #include <amio.h>
+#include <amio-time.h>
+#include <am-utility.h>
+#include <new>
+#include <type_traits>
 #include <time.h>
 
 namespace amio {
@@ -18,7 +22,13 @@ namespace amio {
 // Implement this to post tasks to a TaskQueue.
 class AMIO_LINK Task
 {
+  friend class TaskQueueImpl;
+
  public:
+  Task()
+   : next_task_(nullptr)
+  {}
+
   // Tasks are freed with |delete|.
   virtual ~Task()
   {}
@@ -35,10 +45,130 @@ class AMIO_LINK Task
   virtual void DeleteMe() {
     delete this;
   }
+
+ private:
+  // Link used while the task is sitting in a TaskQueue, so posting a task
+  // does not allocate.
+  Task *next_task_;
+};
+
+// Fixed-size blocks of memory for small tasks, so posting them doesn't have
+// to go through malloc. Each thread keeps its own cache of free slots, and
+// full batches of slots move between threads through a shared depot. This
+// means a slot can be allocated on one thread and freed on another, which is
+// the common case for tasks.
+class AMIO_LINK TaskPool
+{
+ public:
+  static const size_t kSlotSize = 64;
+  static const size_t kSlotAlignment = sizeof(void *) * 2;
+
+  // Allocate a slot of kSlotSize bytes. Returns null on out-of-memory.
+  static void *AllocateSlot();
+
+  // Return a slot from AllocateSlot(). This can be called from any thread.
+  static void FreeSlot(void *slot);
+};
+
+// A task that runs a callable, such as a lambda. Use NewTask() to create
+// one. If the task fits in a TaskPool slot, it is stored there instead of
+// being allocated with |new|.
+template <typename Fn>
+class FunctionTask : public Task
+{
+  // FunctionTask is incomplete until the closing brace, so measure a class
+  // with the same layout instead.
+  struct Layout : public Task {
+    Fn fn;
+  };
+
+ public:
+  static const bool kPooled =
+    sizeof(Layout) <= TaskPool::kSlotSize &&
+    alignof(Layout) <= TaskPool::kSlotAlignment;
+
+  static FunctionTask *New(Fn fn) {
+    static_assert(!kPooled || sizeof(FunctionTask) <= TaskPool::kSlotSize,
+                  "pooled tasks must fit in a TaskPool slot");
+    if (!kPooled)
+      return new FunctionTask(ke::Move(fn));
+    void *mem = TaskPool::AllocateSlot();
+    if (!mem)
+      return nullptr;
+    return new (mem) FunctionTask(ke::Move(fn));
+  }
+
+  void Run() override {
+    fn_();
+  }
+  void DeleteMe() override {
+    if (!kPooled) {
+      delete this;
+      return;
+    }
+    this->~FunctionTask();
+    TaskPool::FreeSlot(this);
+  }
+
+ private:
+  explicit FunctionTask(Fn fn)
+   : fn_(ke::Move(fn))
+  {}
+
+ private:
+  Fn fn_;
+};
+
+// Wrap a callable in a task.
+template <typename Fn>
+static inline Task *
+NewTask(Fn fn)
+{
+  return FunctionTask<Fn>::New(ke::Move(fn));
+}
+
+// Tasks of a higher priority always run before tasks of a lower priority.
+// Tasks of the same priority run in the order they were posted.
+enum class TaskPriority
+{
+  // Runs ahead of any backlog of normal tasks. This is meant for control
+  // messages, such as shutting down or rebalancing.
+  Urgent,
+
+  // The default priority.
+  Normal,
+
+  // Runs only when there is nothing else to do. Event loops also wait until
+  // polling finds no I/O events. This is meant for housekeeping, such as
+  // flushing statistics or pruning caches.
+  Idle
+};
+
+// Monitoring information for a task queue.
+struct AMIO_LINK TaskQueueStats
+{
+  // The number of tasks waiting to run, of any priority.
+  size_t depth;
+
+  // The largest |depth| has ever been.
+  size_t highWaterMark;
+
+  // The capacity enforced by TryPostTask(), or 0 if the queue is unbounded.
+  size_t capacity;
+
+  TaskQueueStats()
+   : depth(0),
+     highWaterMark(0),
+     capacity(0)
+  {}
 };
 
 // A TaskQueue is a fast container for managing tasks that are processed from
 // an event loop. Any thread may post tasks to the queue.
+//
+// A queue may have a capacity. PostTask() always succeeds, but TryPostTask()
+// fails once the queue holds |capacity| tasks, so producers can shed load or
+// back off instead of growing the queue without limit.
 class AMIO_LINK TaskQueue
 {
  public:
@@ -55,8 +185,9 @@ class AMIO_LINK TaskQueue
 
   // Create a new TaskQueue. The delegate is not owned by the queue. The
   // delegate may be null; if so, the queue does not have a backing
-  // mutex and may not be used on other threads.
-  static TaskQueue *Create(Delegate *delegate = nullptr);
+  // mutex and may not be used on other threads. If |capacity| is 0, the
+  // queue is unbounded.
+  static TaskQueue *Create(Delegate *delegate = nullptr, size_t capacity = 0);
 
   // TaskQueues should be freed with |delete|.
   virtual ~TaskQueue()
@@ -65,13 +196,31 @@ class AMIO_LINK TaskQueue
   // Post a task to the task queue. This can be called from any thread.
   // Ownership of the task pointer is transferred to the queue.
   virtual void PostTask(Task *task) = 0;
+  virtual void PostTask(Task *task, TaskPriority priority) = 0;
+
+  // Post a callable to the task queue, as if it were wrapped with NewTask().
+  template <typename Fn>
+  typename std::enable_if<!std::is_convertible<Fn, Task *>::value>::type
+  PostTask(Fn fn, TaskPriority priority = TaskPriority::Normal) {
+    if (Task *task = NewTask(ke::Move(fn)))
+      PostTask(task, priority);
+  }
+
+  // Post a task if the queue is below capacity. If the queue is full, this
+  // returns false, and ownership of the task stays with the caller. This can
+  // be called from any thread.
+  virtual bool TryPostTask(Task *task, TaskPriority priority = TaskPriority::Normal) = 0;
+
+  // Get the queue's depth and high-water mark. This can be called from any
+  // thread.
+  virtual void GetStats(TaskQueueStats *stats) = 0;
 
   // Post a special quit message. This tells the task queue to stop processing
   // tasks.
   virtual void PostQuit() = 0;
 
-  // Run at most one task if any tasks are available. Returns whether or not a
-  // task was run.
+  // Run at most one task if any tasks are available, choosing the one with
+  // the highest priority. Returns whether or not a task was run.
   virtual bool ProcessNextTask() = 0;
 
   // Run tasks for up to the given amount of time. If the task queue becomes
@@ -96,6 +245,20 @@ class AMIO_LINK TaskQueue
   virtual void Break() = 0;
 };
 
+// A handle to a task posted with EventLoop::PostDelayedTask(). Handles may
+// be used from any thread, and may outlive the event loop.
+class AMIO_LINK Timer : public ke::IRefcounted
+{
+ public:
+  // Cancel the timer. If its task has not started running, the task is freed
+  // with DeleteMe() and this returns true. Otherwise, the task has already
+  // run, is running, or was discarded, and this returns false.
+  virtual bool Cancel() = 0;
+
+  // Returns true if the task is still waiting to run.
+  virtual bool IsPending() = 0;
+};
+
 // An event loop encapsulates a TaskQueue and optionally other polling systems.
 class AMIO_LINK EventLoop
 {
@@ -107,11 +270,45 @@ class AMIO_LINK EventLoop
   // Post a task to the event loop. This can be done from any thread. Ownership
   // of the task is transferred to the event loop.
   virtual void PostTask(Task *task) = 0;
+  virtual void PostTask(Task *task, TaskPriority priority) = 0;
+
+  // Post a callable to the event loop, as if it were wrapped with NewTask().
+  template <typename Fn>
+  typename std::enable_if<!std::is_convertible<Fn, Task *>::value>::type
+  PostTask(Fn fn, TaskPriority priority = TaskPriority::Normal) {
+    if (Task *task = NewTask(ke::Move(fn)))
+      PostTask(task, priority);
+  }
+
+  // Post a task if the loop's task queue is below capacity; see
+  // TaskQueue::TryPostTask(). If this returns false, the caller still owns
+  // the task.
+  virtual bool TryPostTask(Task *task, TaskPriority priority = TaskPriority::Normal) = 0;
+
+  // Get statistics for the loop's task queue. This can be called from any
+  // thread.
+  virtual void GetTaskQueueStats(TaskQueueStats *stats) = 0;
+
+  // Post a task to run once at least |delayNs| nanoseconds have elapsed. This
+  // can be done from any thread. Ownership of the task is transferred to the
+  // event loop. Delayed tasks run from Loop(), and are discarded if the loop
+  // is shut down first.
+  //
+  // Returns a handle that can be used to cancel the task, or null if the
+  // event loop has been shut down (in which case the task is freed).
+  virtual PassRef<Timer> PostDelayedTask(Task *task, int64_t delayNs) = 0;
 
   // Post a special message that indicates the event loop should stop
   // immediately.
   virtual void PostQuit() = 0;
 
+  // Returns the time, in nanoseconds, as of the loop's last wakeup. The loop
+  // reads HighResolutionTimer::Counter() once per iteration, so tasks and
+  // listeners that only need a rough timestamp can use this instead of
+  // reading the clock themselves. This must only be called on the thread
+  // running the loop.
+  virtual int64_t Now() = 0;
+
   // Returns whether the event loop received a PostQuit().
   virtual bool ShouldQuit() = 0;
 
@@ -162,8 +359,97 @@ class EventQueue : public IODispatcher
 };
 #endif
 
+// What happened during one iteration of EventLoopForIO::Loop().
+struct AMIO_LINK LoopIterationStats
+{
+  // Tasks run from PostTask().
+  size_t tasks;
+
+  // Delayed tasks run from PostDelayedTask().
+  size_t timers;
+
+  // Idle tasks run.
+  size_t idle;
+
+  // I/O events dispatched to listeners. This is always 0 on Windows.
+  size_t events;
+
+  // Whether the loop was allowed to block waiting for I/O. This is false if
+  // tasks were still waiting after the batch, in which case the loop only
+  // checked for I/O without sleeping.
+  bool waited;
+
+  LoopIterationStats()
+   : tasks(0),
+     timers(0),
+     idle(0),
+     events(0),
+     waited(false)
+  {}
+};
+
+// Receives per-iteration statistics from an event loop, for tuning its
+// EventLoopOptions. Observers are called on the loop's thread.
+class AMIO_LINK LoopObserver
+{
+ public:
+  virtual void OnLoopIteration(const LoopIterationStats &stats) = 0;
+};
+
+// Scheduling options for EventLoopForIO. Each iteration of the loop runs a
+// batch of tasks, then checks for I/O. If tasks are still waiting after the
+// batch, the I/O check does not block, so neither tasks nor transports can
+// starve the other.
+struct AMIO_LINK EventLoopOptions
+{
+  // The maximum number of tasks (including delayed tasks) to run per
+  // iteration, or 0 for no limit. Idle tasks have a separate batch with the
+  // same limits.
+  size_t maxTasksPerIteration;
+
+  // The maximum time to spend running tasks per iteration, in nanoseconds,
+  // or 0 for no limit. The limit is checked between tasks.
+  int64_t maxTaskTimeNs;
+
+  // If non-null, this is called at the end of every iteration. It is not
+  // owned by the loop.
+  LoopObserver *observer;
+
+  // The capacity of the loop's task queue, or 0 for unbounded. Only
+  // TryPostTask() respects the limit.
+  size_t taskQueueCapacity;
+
+  // By default, a POSIX loop attaches transports through an EventQueue:
+  // the poller only records which transports are ready, and listeners are
+  // called after the poll returns. If this is true, transports are attached
+  // to the poller directly instead, and listeners are called from inside
+  // the poll. This saves a hop per event, but listeners run while the poller
+  // is in the middle of dispatching:
+  //
+  //  - Listeners may attach, detach, or change events for any transport,
+  //    including their own. A transport detached during a poll receives no
+  //    further events from that poll.
+  //  - Listeners may post tasks; these run in the next batch.
+  //  - Listeners must not call Loop(), or poll the loop's poller.
+  //
+  // Callers that need deferred semantics for some transports can still
+  // create their own EventQueue on GetPoller(). This is ignored on Windows,
+  // which always dispatches from inside the poller.
+  bool directDispatch;
+
+  EventLoopOptions()
+   : maxTasksPerIteration(64),
+     maxTaskTimeNs(kNanosecondsPerMillisecond),
+     observer(nullptr),
+     taskQueueCapacity(0),
+     directDispatch(false)
+  {}
+};
+
 // An event loop for I/O multiplexing. This is essentially a wrapper around
-// a Poller and a single EventQueue. Tasks are prioritized over events.
+// a Poller and a single EventQueue, unless the loop dispatches directly from
+// the poller. Tasks are run in batches between checks for I/O; see
+// EventLoopOptions.
 class AMIO_LINK EventLoopForIO
  : public EventLoop,
    public IODispatcher
@@ -171,9 +457,88 @@ class AMIO_LINK EventLoopForIO
  public:
   // Create an event loop with a Poller. Specify nullptr to create a default poller.
   static PassRef<IOError> Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller);
+  static PassRef<IOError> Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller,
+                                 const EventLoopOptions &options);
 
   // Return the underlying poller used for this event loop.
   virtual PassRef<Poller> GetPoller() = 0;
+
+#if defined(KE_POSIX)
+  // Return the number of transports attached to the event loop. This may be
+  // called from any thread, though the answer is only exact on the thread
+  // running the loop.
+  virtual size_t NumTransports() = 0;
+#endif
+};
+
+// Options for creating an EventLoopGroup.
+struct AMIO_LINK EventLoopGroupOptions
+{
+  enum class Policy
+  {
+    // Hand out loops in turn.
+    RoundRobin,
+
+    // Hand out the loop with the fewest attached transports. On Windows,
+    // transports are not tracked once attached, so this is the same as
+    // RoundRobin.
+    LeastLoaded
+  };
+
+  // The number of event loops, or 0 for one per online CPU.
+  size_t numLoops;
+
+  // If true, loop N's thread is pinned to CPU N (modulo the CPU count). This
+  // is ignored on platforms without thread affinity.
+  bool pinThreads;
+
+  Policy policy;
+
+  // Options for each loop in the group.
+  EventLoopOptions loopOptions;
+
+  EventLoopGroupOptions()
+   : numLoops(0),
+     pinThreads(false),
+     policy(Policy::RoundRobin)
+  {}
+};
+
+// A set of event loops, each running Loop() on its own thread. This is the
+// usual way to scale past one core: accept connections on one loop, and use
+// Next() to pick the loop that services each new connection.
+//
+// Each loop is only driven by its own thread, so transports should be
+// attached from that thread, for example by posting a task to the loop
+// returned by Next().
+class AMIO_LINK EventLoopGroup : public ke::IRefcounted
+{
+ public:
+  // Create a group and start its threads. Each loop gets a default poller.
+  static PassRef<IOError> Create(Ref<EventLoopGroup> *outp,
+                                 const EventLoopGroupOptions &options = EventLoopGroupOptions());
+
+  virtual ~EventLoopGroup()
+  {}
+
+  // Return the number of event loops in the group.
+  virtual size_t NumLoops() = 0;
+
+  // Return the event loop at the given index.
+  virtual PassRef<EventLoopForIO> GetLoop(size_t index) = 0;
+
+  // Pick an event loop according to the group's policy. This may be called
+  // from any thread.
+  virtual PassRef<EventLoopForIO> Next() = 0;
+
+  // Post a quit message to every loop. Their threads exit once their current
+  // task or event finishes.
+  virtual void PostQuit() = 0;
+
+  // Quit every loop, wait for their threads to exit, and shut the loops
+  // down. This must not be called from a thread in the group. It is called
+  // automatically when the group is destroyed.
+  virtual void Shutdown() = 0;
 };
 
 }
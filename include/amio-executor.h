@@ -0,0 +1,77 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_executor_h_
+#define _include_amio_executor_h_
+
+#include <amio-eventloop.h>
+
+namespace amio {
+
+// An Executor is a pool of threads for CPU-bound work that would otherwise
+// stall an event loop, such as parsing or compressing a large message.
+//
+// Each thread has its own deque of work. Work submitted from a pool thread
+// goes on that thread's deque, and is run newest-first, so nested work stays
+// cache-warm. Work submitted from any other thread is spread across the
+// deques. Idle threads steal the oldest work from a random victim.
+class AMIO_LINK Executor : public ke::IRefcounted
+{
+ public:
+  // Create an executor with the given number of threads, or one per online
+  // CPU if |numThreads| is 0.
+  static PassRef<IOError> Create(Ref<Executor> *outp, size_t numThreads = 0);
+
+  virtual ~Executor()
+  {}
+
+  // Run |work| on a pool thread. Once it has finished, |continuation| (if
+  // any) is posted to |loop|, so results can be handed back to the thread
+  // that asked for them. |loop| must stay alive until the continuation has
+  // been posted. If |continuation| is null, |loop| may be null.
+  //
+  // Ownership of both tasks is transferred to the executor. This can be
+  // called from any thread, including from within work. If the executor has
+  // been shut down, both tasks are freed without running.
+  virtual void Submit(Task *work, EventLoop *loop = nullptr, Task *continuation = nullptr) = 0;
+
+  // Submit callables, as if they were wrapped with NewTask().
+  template <typename Work>
+  typename std::enable_if<!std::is_convertible<Work, Task *>::value>::type
+  Submit(Work work) {
+    if (Task *task = NewTask(ke::Move(work)))
+      Submit(task);
+  }
+  template <typename Work, typename Continuation>
+  typename std::enable_if<!std::is_convertible<Work, Task *>::value &&
+                          !std::is_convertible<Continuation, Task *>::value>::type
+  Submit(Work work, EventLoop *loop, Continuation continuation) {
+    Task *task = NewTask(ke::Move(work));
+    if (!task)
+      return;
+    Task *done = NewTask(ke::Move(continuation));
+    if (!done) {
+      task->DeleteMe();
+      return;
+    }
+    Submit(task, loop, done);
+  }
+
+  // Return the number of threads in the pool.
+  virtual size_t NumThreads() = 0;
+
+  // Wait for running work to finish and stop every thread. Work that has not
+  // started is discarded. This must not be called from a pool thread. It is
+  // called automatically when the executor is destroyed.
+  virtual void Shutdown() = 0;
+};
+
+} // namespace amio
+
+#endif // _include_amio_executor_h_
@@ -285,6 +285,25 @@ enum class Severity {
   Fatal
 };
 
+// Options for creating a Server.
+struct AMIO_LINK ServerOptions
+{
+  // The maximum number of pending connections that can be enqueued. Use 0
+  // for the default (usually 128).
+  unsigned backlog;
+
+  // POSIX only. If the dispatcher supports EventMode::Completion, let it
+  // accept connections itself, saving a system call per connection. Since
+  // connections are then accepted as fast as they arrive, the action
+  // returned by Listener::Accept() is ignored.
+  bool acceptInDispatcher;
+
+  ServerOptions()
+   : backlog(0),
+     acceptInDispatcher(false)
+  {}
+};
+
 // A server accepts network connections on a connection-oriented port.
 class AMIO_LINK Server : public ke::IRefcounted
 {
@@ -296,7 +315,9 @@ class AMIO_LINK Server : public ke::IRefcounted
     virtual ~Listener()
     {}
 
-    // Called when a new connection is available.
+    // Called when a new connection is available. If the server was created
+    // with ServerOptions::acceptInDispatcher, the returned action may be
+    // ignored.
     virtual Action Accept(Ref<Connection> conn) {
       return Action::DeferNext;
     }
@@ -319,6 +340,20 @@ class AMIO_LINK Server : public ke::IRefcounted
     Protocol protocol,
     Ref<Server::Listener> listener,
     unsigned backlog = 0
+  ) {
+    ServerOptions options;
+    options.backlog = backlog;
+    return Create(server, dispatcher, address, protocol, listener, options);
+  }
+
+  // Same as above, with more options.
+  static PassRef<IOError> Create(
+    Ref<Server> *server,
+    Ref<IODispatcher> dispatcher,
+    Ref<Address> address,
+    Protocol protocol,
+    Ref<Server::Listener> listener,
+    const ServerOptions &options
   );
 
   // Return the address the server is listening on.
@@ -11,10 +11,12 @@
 #define _include_amio_posix_header_h_
 
 #include <am-platform.h>
+#include <sys/uio.h>
 
 namespace amio {
 
 // Forward declarations.
+class CompletionListener;
 class Poller;
 class PosixTransport;
 class StatusListener;
@@ -87,6 +89,49 @@ class AMIO_LINK Transport : public ke::IRefcounted
   // be false.
   virtual bool Write(IOResult *result, const void *buffer, size_t maxlength) = 0;
 
+  // Vectored forms of Read() and Write(), which fill or drain |count|
+  // buffers in order with a single system call. |result| reports the total
+  // number of bytes transferred, which may end partway through a buffer.
+  // Blocking, errors, and end-of-stream are reported exactly as in Read() and
+  // Write(), and the same ETS rules apply. At most IOV_MAX buffers are used
+  // per call; any beyond that are left for the caller to retry.
+  virtual bool ReadV(IOResult *result, const struct iovec *iov, size_t count) = 0;
+  virtual bool WriteV(IOResult *result, const struct iovec *iov, size_t count) = 0;
+
+  // Linux only. Enables zero-copy sends on a TCP socket (SO_ZEROCOPY). This
+  // returns an error if the transport or kernel does not support it.
+  virtual PassRef<IOError> EnableZeroCopy() = 0;
+
+  // Same as Write(), except the kernel transmits straight out of |buffer|
+  // instead of copying it (MSG_ZEROCOPY). EnableZeroCopy() must be called
+  // first. If any bytes are sent, |id| is set to a notification id, and the
+  // buffer must not be modified or freed until the listener's
+  // OnZeroCopyComplete() covers that id. Ids start at 0 and increase by one
+  // for each send that transfers any bytes.
+  //
+  // Pinning pages is not free, so this only pays off for large payloads
+  // (tens of kilobytes or more). If too many notifications are outstanding,
+  // the send fails with ENOBUFS; either wait for completions, or use Write().
+  virtual bool WriteZeroCopy(IOResult *result, const void *buffer, size_t maxlength, uint32_t *id) = 0;
+
+  // Writes up to |maxlength| bytes of the file |fd|, starting at |offset|,
+  // without copying them through user space (sendfile() on Linux; elsewhere
+  // this falls back to pread() and write()). |fd| and its file offset are
+  // not modified; advance |offset| by the number of bytes sent and call
+  // again. Partial writes and blocking are reported exactly as in Write().
+  // If |offset| is at or past the end of the file, |ended| is set.
+  virtual bool SendFile(IOResult *result, int fd, int64_t offset, size_t maxlength) = 0;
+
+  // Linux only. Moves up to |maxlength| bytes from |source| into this
+  // transport inside the kernel (splice()). Either this transport or
+  // |source| must be a pipe; to move data between two sockets, splice
+  // through a pipe. Partial writes are reported as in Write(). If the
+  // operation would block, the side that is blocked gets ReadIsBlocked() or
+  // WriteIsBlocked(), so the caller should retry on OnReadReady() for
+  // |source| or OnWriteReady() for this transport. If |source| has reached
+  // end-of-stream, |ended| is set.
+  virtual bool Splice(IOResult *result, Ref<Transport> source, size_t maxlength) = 0;
+
   // Closes the transport for further communication. This automatically
   // disconnects it from its active poller. Close() is automatically closed
   // when the transport has no more references, though if it is attached to
@@ -156,6 +201,17 @@ class AMIO_LINK StatusListener : public ke::IRefcounted
   virtual void OnHangup(ke::Ref<IOError> error)
   {}
 
+  // Called when the kernel is done with the buffers passed to WriteZeroCopy()
+  // for every id from |first| to |last|, inclusive. If |copied| is true, the
+  // kernel had to fall back to copying the data (which is always the case on
+  // loopback); if that happens consistently, Write() is cheaper. This is
+  // delivered even if no events are being listened for (except by the select
+  // poller, which needs Read or Write events). EventQueues defer it like any
+  // other event, merging everything that completed before the dispatch into
+  // a single range, which is reported as copied if any part of it was.
+  virtual void OnZeroCopyComplete(uint32_t first, uint32_t last, bool copied)
+  {}
+
   // This is only called in "proxy" mode, when the transport is detached, and
   // only when the detach is happening outside of a normal event. That is,
   // OnHangup() may be called instead of OnProxyDetach().
@@ -170,6 +226,39 @@ class AMIO_LINK StatusListener : public ke::IRefcounted
   // listened events changes.
   virtual void OnChangeEvents(Events new_events)
   {}
+
+  // Internal function to cast listeners to CompletionListener, since it can
+  // be built without RTTI. Returns null for any other listener.
+  virtual CompletionListener *toCompletionListener() {
+    return nullptr;
+  }
+};
+
+// Listener for transports attached in EventMode::Completion. OnReadReady()
+// is never called; Read events instead deliver data through OnRecv().
+// OnWriteReady() and OnHangup() behave as usual.
+class AMIO_LINK CompletionListener : public StatusListener
+{
+ public:
+  // Called when data has been received. |data| is owned by the poller and is
+  // only valid for the duration of the callback. A hangup is reported through
+  // OnHangup() rather than an empty read. Always invoked on the polling
+  // thread.
+  virtual void OnRecv(const void *data, size_t length)
+  {}
+
+  // Called when a listening socket has accepted a new connection. The
+  // listener takes ownership of |fd|. Always invoked on the polling thread.
+  virtual void OnAccept(int fd);
+
+  // Called when accepting a connection failed. The poller will keep
+  // accepting connections unless the transport is closed or detached.
+  virtual void OnAcceptError(ke::Ref<IOError> error)
+  {}
+
+  CompletionListener *toCompletionListener() override {
+    return this;
+  }
 };
 
 // An IODispatcher is responsible for dispatching IO events. This abstraction
@@ -219,6 +308,11 @@ class AMIO_LINK IODispatcher : public ke::IRefcounted
 
   // Shuts down the dispatcher such that it will stop dispatching events.
   virtual void Shutdown() = 0;
+
+  // Returns true if transports can be attached with EventMode::Completion.
+  virtual bool SupportsCompletionMode() {
+    return false;
+  }
 };
 
 // A poller is responsible for polling for events. Poller functions are
@@ -239,11 +333,20 @@ class AMIO_LINK Poller : public IODispatcher
   // An error is returned if the poll itself failed; individual read/write
   // failures are propagated through status listeners.
   //
-  // Poll() is not re-entrant. It may be called from other threads, though in
-  // all current posix implementations this will block all but one call to
-  // Poll().
+  // Poll() is not re-entrant. It may be called from other threads, though
+  // unless MaximumConcurrency() allows otherwise, this will block all but one
+  // call to Poll().
   virtual PassRef<IOError> Poll(int timeoutMs = kNoTimeout) = 0;
 
+  // Same as Poll(), except that the timeout is in nanoseconds. Any negative
+  // value blocks indefinitely. If the underlying system call has a coarser
+  // resolution, the timeout is rounded up, so Poll() does not return early.
+  //
+  // epoll uses epoll_pwait2() if available (Linux 5.11+), select() uses
+  // pselect(), and poll() uses ppoll() on Linux. Otherwise the timeout is
+  // rounded up to the nearest millisecond.
+  virtual PassRef<IOError> PollNs(int64_t timeoutNs = kNoTimeout) = 0;
+
   // Enables thread-safety on the poller. By default, pollers and attached
   // transports can only be used from one thread at a time.
   virtual void EnableThreadSafety() = 0;
@@ -255,6 +358,13 @@ class AMIO_LINK Poller : public IODispatcher
   // this returns 0, there is no limit. If it returns 1, the poller is single-
   // threaded.
   virtual size_t MaximumConcurrency() = 0;
+
+  // Returns how long the next Poll() will busy-wait before blocking, in
+  // nanoseconds, or 0 if the poller does not busy poll. See
+  // EpollOptions::spinMicroseconds.
+  virtual int64_t SpinWindowNs() {
+    return 0;
+  }
 };
 
 #if defined(KE_BSD) || defined(KE_LINUX) || defined(KE_SOLARIS)
@@ -265,6 +375,72 @@ class AMIO_LINK Poller : public IODispatcher
 class CompletionPort;
 #endif
 
+#if defined(KE_LINUX)
+// Options for epoll message pumps.
+struct AMIO_LINK EpollOptions
+{
+  // If 0, the number of events per poll is automatically sized. Otherwise,
+  // it is capped to the given value.
+  size_t maxEventsPerPoll;
+
+  // Allow any number of threads to call Poll() at once. See
+  // PollerFactory::CreateConcurrentEpollImpl().
+  bool concurrent;
+
+  // If non-zero, Poll() busy-waits for up to this many microseconds, checking
+  // for events without sleeping, before it blocks. This trades CPU time for
+  // wakeup latency. The spin window adapts to traffic: it grows while
+  // spinning finds events that would otherwise have required a sleep, and
+  // shrinks while it does not.
+  size_t spinMicroseconds;
+
+  // If non-zero, attached sockets have SO_BUSY_POLL set to this many
+  // microseconds, so that blocking reads busy poll the device queue. If
+  // preferBusyPoll is set, they also get SO_PREFER_BUSY_POLL (Linux 5.11+).
+  // These are hints: raising SO_BUSY_POLL requires CAP_NET_ADMIN, and
+  // failures are ignored.
+  size_t socketBusyPollMicroseconds;
+  bool preferBusyPoll;
+
+  EpollOptions()
+   : maxEventsPerPoll(0),
+     concurrent(false),
+     spinMicroseconds(0),
+     socketBusyPollMicroseconds(0),
+     preferBusyPoll(false)
+  {}
+};
+
+// Options for io_uring message pumps. Fields left as 0 are automatically
+// sized.
+struct AMIO_LINK IoUringOptions
+{
+  // The size of the submission queue.
+  size_t maxEventsPerPoll;
+
+  // The number of kernel-selected receive buffers shared by all transports
+  // in completion mode, and the size of each buffer. Memory for these is
+  // committed as data arrives, and buffers are returned to the pool as soon
+  // as OnRecv() returns, so the footprint scales with traffic rather than
+  // with the number of connections. The count is rounded up to a power of
+  // two.
+  size_t recvBufferCount;
+  size_t recvBufferSize;
+
+  // The number of registered file slots. Transports attached in completion
+  // mode use a registered slot if one is free, which avoids a file table
+  // lookup on every operation.
+  size_t fixedFiles;
+
+  IoUringOptions()
+   : maxEventsPerPoll(0),
+     recvBufferCount(0),
+     recvBufferSize(0),
+     fixedFiles(0)
+  {}
+};
+#endif
+
 // Creates message pumps.
 class AMIO_LINK PollerFactory
 {
@@ -292,6 +468,32 @@ class AMIO_LINK PollerFactory
   // considered the most efficient polling mechanism and has native edge-
   // triggering.
   static PassRef<IOError> CreateEpollImpl(Ref<Poller> *outp, size_t maxEventsPerPoll = 0);
+
+  // Create an epoll() message pump that allows any number of threads to call
+  // Poll() at once. Thread safety is enabled automatically. Each event is
+  // delivered to one thread, and a transport is never dispatched on more than
+  // one thread at a time. This requires an extra system call per event to
+  // re-arm the descriptor, so it is only worthwhile if callbacks are
+  // expensive enough to spread across threads.
+  static PassRef<IOError> CreateConcurrentEpollImpl(Ref<Poller> *outp, size_t maxEventsPerPoll = 0);
+
+  // Create an epoll() message pump with the given options, for example to
+  // enable busy polling.
+  static PassRef<IOError> CreateEpollImpl(Ref<Poller> *outp, const EpollOptions &options);
+
+  // Create a message pump based on io_uring poll requests. This requires
+  // Linux 5.13 or higher. If maxEventsPerPoll is 0, the submission queue is
+  // automatically sized. Otherwise, it will be sized to the given value.
+  //
+  // Unlike epoll, changing the events on a transport does not require a
+  // system call; changes are batched and submitted along with the next
+  // Poll(). This is not chosen by CreatePoller by default.
+  //
+  // On Linux 6.0 or higher, io_uring pumps also support EventMode::Completion,
+  // using multishot receives into a shared pool of provided buffers, and
+  // multishot accepts for listening sockets.
+  static PassRef<IOError> CreateIoUringImpl(Ref<Poller> *outp, size_t maxEventsPerPoll = 0);
+  static PassRef<IOError> CreateIoUringImpl(Ref<Poller> *outp, const IoUringOptions &options);
 #elif defined(KE_BSD)
   // Create a message pump based on kqueue(). If maxEventsPerPoll is 0, then
   // the events per poll will be automatically sized. Otherwise, it will be
@@ -337,10 +539,19 @@ enum AMIO_LINK TransportFlags
   kTransportLT            = 0x00000200,
   kTransportET            = 0x00000400,
   kTransportProxying      = 0x00001000,
+  kTransportCompletion    = 0x00002000,
+  kTransportOneShot       = 0x00004000,
   kTransportArmed         = 0x00010000,
+  kTransportChangePending = 0x00020000,
+  kTransportZeroCopy      = 0x00040000,
   kTransportEventMask     = kTransportReading | kTransportWriting,
   kTransportUserFlagMask  = kTransportNoAutoClose|kTransportNoCloseOnExec,
-  kTransportClearMask     = kTransportUserFlagMask,
+
+  // State that belongs to an attachment, and is cleared on detach.
+  kTransportClearMask     = kTransportEventMask | kTransportLT | kTransportET |
+                            kTransportProxying | kTransportCompletion |
+                            kTransportOneShot | kTransportArmed |
+                            kTransportChangePending,
 
   kTransportNoFlags       = 0x00000000,
   kTransportDefaultFlags  = kTransportNoFlags
@@ -104,6 +104,28 @@ enum class EventMode : uint32_t
   // mode may be or'd with other modes.
   Proxy  = 0x1000,
 
+  // In completion mode, the poller performs reads itself rather than
+  // reporting readiness. Received data is delivered to a CompletionListener
+  // in buffers owned by the poller, so no per-transport read buffer is
+  // needed. Listening sockets have connections accepted for them. Attaching
+  // any other kind of listener in this mode fails.
+  //
+  // Completion mode is only supported by some pollers; use
+  // IODispatcher::SupportsCompletionMode() to test for it. It cannot be
+  // combined with other modes.
+  Completion = 0x2000,
+
+  // In one-shot mode, the transport is disarmed as soon as an event is
+  // delivered: no further read or write events are delivered until the user
+  // re-arms it with Poller::AddEvents() or Poller::ChangeEvents(). This makes
+  // it safe to hand a ready transport off to another thread, without the
+  // poller reporting it again while that thread is still working on it.
+  //
+  // One-shot mode is native on epoll, kqueue, io_uring, and Solaris ports,
+  // and emulated elsewhere. Hangups and errors may still be reported for a
+  // disarmed transport.
+  OneShot = 0x4000,
+
   // The default mode is level-triggered.
   Default = 0
 };
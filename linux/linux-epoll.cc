@@ -10,13 +10,22 @@
 #include "posix/posix-errors.h"
 #include "linux/linux-utils.h"
 #include "linux/linux-epoll.h"
+#include <amio-time.h>
 #include <unistd.h>
-#include <sys/epoll.h>
 #include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 
 #if !defined(EPOLLRDHUP)
 # define EPOLLRDHUP 0x2000
 #endif
+#if !defined(SO_BUSY_POLL)
+# define SO_BUSY_POLL 46
+#endif
+#if !defined(SO_PREFER_BUSY_POLL)
+# define SO_PREFER_BUSY_POLL 69
+#endif
 
 using namespace ke;
 using namespace amio;
@@ -24,12 +33,23 @@ using namespace amio;
 // This is passed to the kernel, which ignores it. But it has to be non-zero.
 static const size_t kInitialEpollSize = 16;
 
-EpollImpl::EpollImpl(size_t maxEvents)
+// The busy-poll window never shrinks below this fraction of its maximum.
+static const int64_t kSpinWindowFloorDivisor = 32;
+
+// Transport flags that affect what we pass to epoll_ctl().
+static const TransportFlags kRegisteredMask =
+  kTransportEventMask | kTransportET | kTransportOneShot;
+
+EpollImpl::EpollImpl(const EpollOptions &options)
  : ep_(-1),
    can_use_rdhup_(false),
-   generation_(0),
-   max_events_(0),
-   absolute_max_events_(maxEvents)
+   can_use_pwait2_(false),
+   concurrent_(options.concurrent),
+   options_(options),
+   max_spin_(int64_t(options.spinMicroseconds) * kNanosecondsPerMicrosecond),
+   min_spin_(max_spin_ / kSpinWindowFloorDivisor),
+   spin_window_(max_spin_),
+   absolute_max_events_(options.maxEventsPerPoll)
 {
 #if defined(__linux__)
   if (IsAtLeastLinux(2, 6, 17))
@@ -43,14 +63,22 @@ EpollImpl::Initialize()
   if ((ep_ = epoll_create(kInitialEpollSize)) == -1)
     return new PosixError();
 
-  if (absolute_max_events_)
-    max_events_ = absolute_max_events_;
-  else
-    max_events_ = 32;
+#if defined(__NR_epoll_pwait2)
+  // epoll_pwait2() needs Linux 5.11. Probe for it with an empty wait.
+  struct timespec timeout = {0, 0};
+  epoll_event event;
+  if (syscall(__NR_epoll_pwait2, ep_, &event, 1, &timeout, nullptr, 0) != -1)
+    can_use_pwait2_ = true;
+#endif
 
-  event_buffer_ = new epoll_event[max_events_];
-  if (!event_buffer_)
-    return eOutOfMemory;
+  if (concurrent_) {
+    EnableThreadSafety();
+    if (!event_buffers_.init(32, absolute_max_events_))
+      return eOutOfMemory;
+  } else {
+    if (!event_buffer_.init(32, absolute_max_events_))
+      return eOutOfMemory;
+  }
 
   return nullptr;
 }
@@ -95,12 +123,16 @@ EpollImpl::attach_locked(PosixTransport *transport, StatusListener *listener, Tr
     return error;
   }
 
+  if (options_.socketBusyPollMicroseconds)
+    setBusyPollOptions(transport->fd());
+
   // Hook up the transport.
   listeners_[slot].transport = transport;
-  listeners_[slot].modified = generation_;
   transport->attach(this, listener);
   transport->setUserData(slot);
   transport->flags() |= flags;
+  if (concurrent_)
+    transport->flags() |= kTransportArmed;
   return nullptr;
 }
 
@@ -115,10 +147,15 @@ EpollImpl::detach_locked(PosixTransport *transport)
   epoll_event ep;
   ::epoll_ctl(ep_, EPOLL_CTL_DEL, fd, &ep);
 
+  cancel_change_locked(transport);
+
   listeners_[slot].transport = nullptr;
-  listeners_[slot].modified = generation_;
+  listeners_[slot].seq++;
+  listeners_[slot].dispatching = false;
+  listeners_[slot].pending = 0;
   free_slots_.append(slot);
 
+  transport->flags() &= ~kTransportArmed;
   return transport->detach();
 }
 
@@ -126,9 +163,11 @@ PassRef<IOError>
 EpollImpl::epoll_ctl(int cmd, size_t slot, int fd, TransportFlags flags)
 {
   epoll_event pe;
-  pe.data.ptr = (void *)slot;
+  pe.data.u64 = encodeEventData(slot, listeners_[slot].seq);
   pe.events = (flags & kTransportET) ? EPOLLET : 0;
-  if (can_use_rdhup_)
+  if ((flags & kTransportOneShot) || (concurrent_ && !(flags & kTransportET)))
+    pe.events |= EPOLLONESHOT;
+  if (can_use_rdhup_ && ReportsReadHangup(flags))
     pe.events |= EPOLLRDHUP;
   if (flags & kTransportReading)
     pe.events |= EPOLLIN;
@@ -138,6 +177,7 @@ EpollImpl::epoll_ctl(int cmd, size_t slot, int fd, TransportFlags flags)
   if (::epoll_ctl(ep_, cmd, fd, &pe) == -1)
     return new PosixError();
 
+  listeners_[slot].registered = flags & kRegisteredMask;
   return nullptr;
 }
 
@@ -146,14 +186,62 @@ EpollImpl::change_events_locked(PosixTransport *transport, TransportFlags flags)
 {
   size_t slot = transport->getUserData();
 
-  if (Ref<IOError> error = epoll_ctl(EPOLL_CTL_MOD, slot, transport->fd(), flags))
-    return error;
+  if (can_defer_changes()) {
+    transport->flags() &= ~kTransportEventMask;
+    transport->flags() |= flags;
+    defer_change_locked(transport);
+    return nullptr;
+  }
+
+  // If the descriptor is disarmed while another thread is dispatching it,
+  // that thread will re-arm it with the new flags once it is done. Edge-
+  // triggered descriptors are never disarmed.
+  bool deferred = concurrent_ &&
+                  listeners_[slot].dispatching &&
+                  !(transport->flags() & kTransportArmed);
+  if (!deferred) {
+    // |flags| may only have events, so keep the triggering mode.
+    TransportFlags mode = transport->flags() & (kTransportET|kTransportOneShot);
+    if (Ref<IOError> error = epoll_ctl(EPOLL_CTL_MOD, slot, transport->fd(), flags | mode))
+      return error;
+    if (concurrent_)
+      transport->flags() |= kTransportArmed;
+  }
 
   transport->flags() &= ~kTransportEventMask;
   transport->flags() |= flags;
   return nullptr;
 }
 
+PassRef<IOError>
+EpollImpl::apply_change_locked(PosixTransport *transport)
+{
+  size_t slot = transport->getUserData();
+  TransportFlags flags = transport->flags() & kRegisteredMask;
+  if (flags == listeners_[slot].registered)
+    return nullptr;
+  return epoll_ctl(EPOLL_CTL_MOD, slot, transport->fd(), flags);
+}
+
+void
+EpollImpl::rearm_locked(size_t slot)
+{
+  Ref<PosixTransport> transport = listeners_[slot].transport;
+  if (transport->flags() & kTransportArmed)
+    return;
+
+  // One-shot transports stay disarmed until the user asks for more events.
+  if ((transport->flags() & kTransportOneShot) && !(transport->flags() & kTransportEventMask))
+    return;
+
+  TransportFlags flags = transport->flags() & kRegisteredMask;
+  if (Ref<IOError> error = epoll_ctl(EPOLL_CTL_MOD, slot, transport->fd(), flags)) {
+    reportError_locked(transport, error);
+    return;
+  }
+  transport->flags() |= kTransportArmed;
+}
+
 template <TransportFlags outFlag>
 inline void
 EpollImpl::handleEvent(size_t slot)
@@ -166,6 +254,15 @@ EpollImpl::handleEvent(size_t slot)
   if ((transport->flags() & (outFlag|kTransportLT)) == kTransportLT)
     return;
 
+  // The kernel disarmed one-shot transports when it reported the event, so
+  // mirror that. Ignore events that were removed in the meantime.
+  if (transport->flags() & kTransportOneShot) {
+    listeners_[slot].registered &= ~kTransportEventMask;
+    if (!(transport->flags() & outFlag))
+      return;
+    transport->flags() &= ~kTransportEventMask;
+  }
+
   // We must hold the listener in a ref, since if the transport is detached
   // in the callback, it could be destroyed while |this| is still on the
   // stack. Similarly, we must hold the transport in a ref in case releasing
@@ -179,65 +276,207 @@ EpollImpl::handleEvent(size_t slot)
     listener->OnWriteReady();
 }
 
+void
+EpollImpl::dispatch(size_t slot, uint32_t seq, uint32_t events)
+{
+  eventDispatched();
+
+  // Handle errors first. Zero-copy completions also show up as errors.
+  if (events & EPOLLERR) {
+    if (!handleError_locked(listeners_[slot].transport) || isFdChanged(slot, seq))
+      return;
+  }
+
+  // Prioritize EPOLLIN over EPOLLHUP/EPOLLRDHUP.
+  if (events & EPOLLIN) {
+    handleEvent<kTransportReading>(slot);
+    if (isFdChanged(slot, seq))
+      return;
+  }
+
+  // Handle explicit hangup. If the read callback stopped reading, a half
+  // close is left for the listener to handle.
+  if ((events & EPOLLHUP) ||
+      ((events & EPOLLRDHUP) && ReportsReadHangup(listeners_[slot].transport->flags())))
+  {
+    reportHup_locked(listeners_[slot].transport);
+    return;
+  }
+
+  // Handle output.
+  if (events & EPOLLOUT)
+    handleEvent<kTransportWriting>(slot);
+}
+
 PassRef<IOError>
-EpollImpl::Poll(int timeoutMs)
+EpollImpl::PollNs(int64_t timeoutNs)
 {
+  if (concurrent_) {
+    // Note: no poll lock, each thread gets its own event buffer.
+    MultiPollBuffer<epoll_event>::Use use(event_buffers_);
+    if (!use.get())
+      return eOutOfMemory;
+    return poll(use.get(), timeoutNs);
+  }
+
   // We acquire a lock specifically for Poll(), to make sure it isn't called on
   // any thread or within callbacks.
   AutoMaybeLock poll_lock(poll_lock_);
 
-  int nevents = epoll_wait(ep_, event_buffer_, max_events_, timeoutMs);
+  // Note: nothing is queued if thread safety is enabled, so we don't need the
+  // transport lock here.
+  flush_changes_locked();
+
+  return poll(&event_buffer_, timeoutNs);
+}
+
+void
+EpollImpl::setBusyPollOptions(int fd)
+{
+  // These fail for anything that isn't a socket, and raising SO_BUSY_POLL
+  // needs CAP_NET_ADMIN. Either way, it's just a hint, so ignore errors.
+  int usecs = int(ke::Min(options_.socketBusyPollMicroseconds, size_t(INT_MAX)));
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+    return;
+
+  if (options_.preferBusyPoll) {
+    int prefer = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+  }
+}
+
+int64_t
+EpollImpl::SpinWindowNs()
+{
+  AutoMaybeLock lock(lock_);
+  return spin_window_;
+}
+
+int
+EpollImpl::spin(PollBuffer<epoll_event> *buffer, int64_t *timeoutNs)
+{
+  int64_t window;
+  {
+    AutoMaybeLock lock(lock_);
+    window = spin_window_;
+  }
+  if (*timeoutNs > 0)
+    window = ke::Min(window, *timeoutNs);
+
+  int64_t start = HighResolutionTimer::Counter();
+  int64_t now = start;
+  size_t attempts = 0;
+  int nevents;
+  while (true) {
+    nevents = epoll_wait(ep_, buffer->get(), buffer->length(), 0);
+    if (nevents != 0)
+      break;
+    attempts++;
+
+    now = HighResolutionTimer::Counter();
+    if (now - start >= window)
+      break;
+  }
+  if (nevents == -1)
+    return -1;
+
+  // If events were ready on the first check, we wouldn't have slept anyway,
+  // so that says nothing about whether spinning helps.
+  if (nevents == 0 || attempts > 0) {
+    AutoMaybeLock lock(lock_);
+    if (nevents > 0)
+      spin_window_ = ke::Min(ke::Max(spin_window_ * 2, min_spin_), max_spin_);
+    else
+      spin_window_ = ke::Max(spin_window_ / 2, min_spin_);
+  }
+
+  if (nevents == 0 && *timeoutNs > 0)
+    *timeoutNs = ke::Max(*timeoutNs - (now - start), int64_t(0));
+  return nevents;
+}
+
+int
+EpollImpl::wait(PollBuffer<epoll_event> *buffer, int64_t timeoutNs)
+{
+#if defined(__NR_epoll_pwait2)
+  // Whole milliseconds (which is what Poll() passes) don't need pwait2.
+  if (can_use_pwait2_ && timeoutNs > 0 && timeoutNs % kNanosecondsPerMillisecond != 0) {
+    struct timespec timeout;
+    return syscall(__NR_epoll_pwait2, ep_, buffer->get(), int(buffer->length()),
+                   TimeoutToTimespec(timeoutNs, &timeout), nullptr, 0);
+  }
+#endif
+  return epoll_wait(ep_, buffer->get(), buffer->length(), TimeoutToMs(timeoutNs));
+}
+
+PassRef<IOError>
+EpollImpl::poll(PollBuffer<epoll_event> *buffer, int64_t timeoutNs)
+{
+  int nevents = 0;
+  if (max_spin_ && timeoutNs != 0)
+    nevents = spin(buffer, &timeoutNs);
+  if (nevents == 0)
+    nevents = wait(buffer, timeoutNs);
   if (nevents == -1) {
     if (errno == EINTR)
       return nullptr;
     return new PosixError();
   }
 
-  // Now we acquire the transport lock.
-  AutoMaybeLock lock(lock_);
+  {
+    // Now we acquire the transport lock.
+    AutoMaybeLock lock(lock_);
 
-  generation_++;
-  for (int i = 0; i < nevents; i++) {
-    epoll_event &ep = event_buffer_[i];
-    size_t slot = (size_t)ep.data.ptr;
-    if (isFdChanged(slot))
-      continue;
-
-    // Handle errors first.
-    if (ep.events & EPOLLERR) {
-      reportError_locked(listeners_[slot].transport);
-      continue;
-    }
+    for (int i = 0; i < nevents; i++) {
+      epoll_event &ep = buffer->at(i);
+      size_t slot = size_t(ep.data.u64 & 0xffffffff);
+      uint32_t seq = uint32_t(ep.data.u64 >> 32);
+      if (isFdChanged(slot, seq))
+        continue;
 
-    // Prioritize EPOLLIN over EPOLLHUP/EPOLLRDHUP.
-    if (ep.events & EPOLLIN) {
-      handleEvent<kTransportReading>(slot);
-      if (isFdChanged(slot))
+      if (!concurrent_) {
+        dispatch(slot, seq, ep.events);
         continue;
-    }
+      }
+
+      // Level-triggered descriptors are oneshot, so the kernel disarmed this
+      // one when it gave us the event. If another thread is still dispatching
+      // the transport (which can happen if it was re-armed by ChangeEvents(),
+      // or if it's edge-triggered and a new edge arrived), leave the event to
+      // that thread. It will re-arm the descriptor, and any remaining level-
+      // triggered readiness will be reported again. Edges only happen once,
+      // so we queue them.
+      Ref<PosixTransport> transport = listeners_[slot].transport;
+      bool edge = !!(transport->flags() & kTransportET);
+      if (!edge)
+        transport->flags() &= ~kTransportArmed;
+      if (listeners_[slot].dispatching) {
+        if (edge)
+          listeners_[slot].pending |= ep.events;
+        continue;
+      }
+
+      listeners_[slot].dispatching = true;
+      uint32_t events = ep.events;
+      do {
+        dispatch(slot, seq, events);
+        if (isFdChanged(slot, seq))
+          break;
+        events = listeners_[slot].pending;
+        listeners_[slot].pending = 0;
+      } while (events);
+      if (isFdChanged(slot, seq))
+        continue;
+      listeners_[slot].dispatching = false;
 
-    // Handle explicit hangup.
-    if (ep.events & (EPOLLRDHUP|EPOLLHUP)) {
-      reportHup_locked(listeners_[slot].transport);
-      continue;
+      rearm_locked(slot);
     }
-
-    // Handle output.
-    if (ep.events & EPOLLOUT)
-      handleEvent<kTransportWriting>(slot);
   }
 
-  // If we filled the event buffer, resize it for next time.
-  if (!absolute_max_events_ && size_t(nevents) == max_events_ && max_events_ < (INT_MAX / 2)) {
-    AutoMaybeUnlock unlock(lock_);
-
-    size_t new_size = max_events_ * 2;
-    epoll_event *new_buffer = new epoll_event[new_size];
-    if (new_buffer) {
-      max_events_ = new_size;
-      event_buffer_ = new_buffer;
-    }
-  }
+  // If we filled the event buffer, resize it for next time. The buffer is
+  // ours alone, so this does not need the transport lock.
+  if (!absolute_max_events_ && size_t(nevents) == buffer->length())
+    buffer->maybeResize();
 
   return nullptr;
 }
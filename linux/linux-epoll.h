@@ -13,6 +13,7 @@
 #include "include/amio.h"
 #include "posix/posix-transport.h"
 #include "posix/posix-base-poller.h"
+#include "shared/shared-pollbuf.h"
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
@@ -24,18 +25,41 @@ namespace amio {
 using namespace ke;
 
 // This message pump is based on epoll(), which is available in Linux >= 2.5.44.
+//
+// Unless thread safety is enabled, interest changes only update the
+// transport's flags, and are applied with epoll_ctl() just before the next
+// wait. A transport that toggles an event several times in one round of
+// dispatching costs at most one system call, or none if the changes cancel
+// out.
+//
+// In concurrent mode, any number of threads may call Poll() at once. Level-
+// triggered descriptors are registered with EPOLLONESHOT, so each readiness
+// event is delivered to exactly one thread, and the descriptor is re-armed
+// once that thread has finished dispatching it. Edges that arrive while
+// another thread is dispatching the transport are handed to that thread. A
+// transport is never dispatched on two threads at the same time.
+//
+// If busy polling is enabled, Poll() first checks for events with a zero
+// timeout in a loop, for up to the current spin window, and only then
+// blocks. The window doubles each time spinning catches an event that was
+// not ready yet when we started, and halves each time it comes up empty,
+// down to a small floor so that we keep probing.
 class EpollImpl : public PosixPoller
 {
  public:
-  EpollImpl(size_t maxEvents = 0);
+  EpollImpl(const EpollOptions &options);
   ~EpollImpl();
 
   PassRef<IOError> Initialize();
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return true;
   }
+  size_t MaximumConcurrency() override {
+    return concurrent_ ? 0 : 1;
+  }
+  int64_t SpinWindowNs() override;
 
   PassRef<IOError> attach_locked(
     PosixTransport *transport,
@@ -43,34 +67,67 @@ class EpollImpl : public PosixPoller
     TransportFlags flags) override;
   PassRef<StatusListener> detach_locked(PosixTransport *transport) override;
   PassRef<IOError> change_events_locked(PosixTransport *transport, TransportFlags flags) override;
+  PassRef<IOError> apply_change_locked(PosixTransport *transport) override;
 
  private:
-  bool isFdChanged(size_t slot) const {
-    return listeners_[slot].modified == generation_;
+  // Events carry the slot in the low 32 bits, and the slot's sequence number
+  // in the high 32 bits. The sequence changes whenever the slot is detached,
+  // so events for a previous occupant of the slot can be detected even if
+  // another thread detached it while we were waiting.
+  static inline uint64_t encodeEventData(size_t slot, uint32_t seq) {
+    return (uint64_t(seq) << 32) | uint64_t(slot);
+  }
+  bool isFdChanged(size_t slot, uint32_t seq) const {
+    return listeners_[slot].seq != seq;
   }
 
   PassRef<IOError> epoll_ctl(int cmd, size_t slot, int fd, TransportFlags);
-  
+  PassRef<IOError> poll(PollBuffer<epoll_event> *buffer, int64_t timeoutNs);
+  int spin(PollBuffer<epoll_event> *buffer, int64_t *timeoutNs);
+  int wait(PollBuffer<epoll_event> *buffer, int64_t timeoutNs);
+  void setBusyPollOptions(int fd);
+  void dispatch(size_t slot, uint32_t seq, uint32_t events);
+  void rearm_locked(size_t slot);
+
   template <TransportFlags outFlag>
   inline void handleEvent(size_t slot);
 
  private:
   struct PollData {
     Ref<PosixTransport> transport;
-    size_t modified;
+    uint32_t seq;
+
+    // The events and mode last given to epoll_ctl().
+    TransportFlags registered;
+
+    // Concurrent mode only: set while a thread is dispatching this slot, and
+    // edge-triggered events that arrived in the meantime.
+    bool dispatching;
+    uint32_t pending;
+
+    PollData() : seq(0), registered(kTransportNoFlags), dispatching(false), pending(0)
+    {}
   };
 
   int ep_;
   bool can_use_rdhup_;
-  size_t generation_;
+  bool can_use_pwait2_;
+  bool concurrent_;
+  EpollOptions options_;
+
+  // Busy polling state, in nanoseconds. The window is protected by the
+  // transport lock.
+  int64_t max_spin_;
+  int64_t min_spin_;
+  int64_t spin_window_;
 
   // Note: we currently do not shrink slots.
   ke::Vector<PollData> listeners_;
   ke::Vector<size_t> free_slots_;
 
-  size_t max_events_;
   size_t absolute_max_events_;
-  ke::AutoArray<epoll_event> event_buffer_;
+  PollBuffer<epoll_event> event_buffer_;
+  MultiPollBuffer<epoll_event> event_buffers_;
 };
 
 } // namespace amio
@@ -0,0 +1,330 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include "posix/posix-errors.h"
+#include "linux/linux-io-uring-ring.h"
+
+#if defined(AMIO_HAVE_IO_URING)
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace ke;
+using namespace amio;
+
+static Ref<GenericError> eIoUringMissingFeatures =
+  new GenericError("kernel io_uring is missing required features");
+
+IoUringRing::IoUringRing()
+ : ring_fd_(-1),
+   features_(0),
+   sq_ring_(MAP_FAILED),
+   sq_ring_size_(0),
+   cq_ring_(MAP_FAILED),
+   cq_ring_size_(0),
+   sqes_((struct io_uring_sqe *)MAP_FAILED),
+   sqes_size_(0),
+   sq_khead_(nullptr),
+   sq_ktail_(nullptr),
+   sq_mask_(0),
+   sq_entries_(0),
+   sq_tail_(0),
+   cq_khead_(nullptr),
+   cq_ktail_(nullptr),
+   cq_mask_(0),
+   cq_entries_(0),
+   cqes_(nullptr)
+{
+}
+
+IoUringRing::~IoUringRing()
+{
+  destroy();
+}
+
+void
+IoUringRing::destroy()
+{
+  if (sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ != -1)
+    AMIO_RETRY_IF_EINTR(close(ring_fd_));
+
+  sqes_ = (struct io_uring_sqe *)MAP_FAILED;
+  cq_ring_ = MAP_FAILED;
+  sq_ring_ = MAP_FAILED;
+  ring_fd_ = -1;
+}
+
+PassRef<IOError>
+IoUringRing::Initialize(unsigned entries, unsigned cqEntries, unsigned requiredFeatures)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if (cqEntries > entries) {
+    params.flags |= IORING_SETUP_CQSIZE;
+    params.cq_entries = cqEntries;
+  }
+
+  if ((ring_fd_ = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+    return new PosixError();
+
+  features_ = params.features;
+  if ((features_ & requiredFeatures) != requiredFeatures)
+    return eIoUringMissingFeatures;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (features_ & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = ke::Max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = sq_ring_size_;
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED)
+    return new PosixError();
+
+  if (features_ & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED)
+      return new PosixError();
+  }
+
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = (struct io_uring_sqe *)mmap(nullptr, sqes_size_, PROT_READ|PROT_WRITE,
+                                      MAP_SHARED|MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED)
+    return new PosixError();
+
+  char *sq = reinterpret_cast<char *>(sq_ring_);
+  sq_khead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_ktail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sq_tail_ = *sq_ktail_;
+
+  // We always fill submission slots in order, so the indirection array is
+  // just the identity map.
+  unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; i++)
+    array[i] = i;
+
+  char *cq = reinterpret_cast<char *>(cq_ring_);
+  cq_khead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_ktail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cq_entries_ = params.cq_entries;
+  cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  return nullptr;
+}
+
+int
+IoUringRing::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, ring_fd_, toSubmit, minComplete, flags, arg, argsz);
+}
+
+unsigned
+IoUringRing::publish()
+{
+  __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+  return pending();
+}
+
+PassRef<IOError>
+IoUringRing::getSqe(struct io_uring_sqe **outp)
+{
+  if (pending() >= sq_entries_) {
+    if (Ref<IOError> error = submit())
+      return error;
+  }
+
+  struct io_uring_sqe *sqe = &sqes_[sq_tail_ & sq_mask_];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_tail_++;
+
+  *outp = sqe;
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringRing::submit()
+{
+  publish();
+
+  while (unsigned count = pending()) {
+    int rv = enter(count, 0, 0, nullptr, 0);
+    if (rv == -1) {
+      if (errno == EINTR)
+        continue;
+      return new PosixError();
+    }
+  }
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringRing::wait(unsigned toSubmit, const struct timespec *timeout)
+{
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout) {
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_nsec;
+    arg.ts = uint64_t(uintptr_t(&ts));
+  }
+
+  int rv = enter(toSubmit, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (rv == -1) {
+    if (errno == EINTR || errno == ETIME)
+      return nullptr;
+    return new PosixError();
+  }
+  return nullptr;
+}
+
+int
+IoUringRing::registerOp(unsigned opcode, void *arg, unsigned nargs)
+{
+  return syscall(__NR_io_uring_register, ring_fd_, opcode, arg, nargs);
+}
+
+PassRef<IOError>
+IoUringRing::registerFiles(unsigned count)
+{
+  struct io_uring_rsrc_register reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.nr = count;
+  reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+  if (registerOp(IORING_REGISTER_FILES2, &reg, sizeof(reg)) == -1)
+    return new PosixError();
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringRing::updateFile(unsigned index, int fd)
+{
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = index;
+  update.fds = uint64_t(uintptr_t(&fd));
+
+  if (registerOp(IORING_REGISTER_FILES_UPDATE, &update, 1) == -1)
+    return new PosixError();
+  return nullptr;
+}
+
+bool
+IoUringRing::popCqe(struct io_uring_cqe *outp)
+{
+  unsigned head = *cq_khead_;
+  if (head == __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE))
+    return false;
+
+  *outp = cqes_[head & cq_mask_];
+  __atomic_store_n(cq_khead_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+IoUringBufferRing::IoUringBufferRing()
+ : ring_(nullptr),
+   ring_size_(0),
+   buffers_(nullptr),
+   buffers_size_(0),
+   size_(0),
+   mask_(0),
+   tail_(0),
+   group_(0)
+{
+}
+
+IoUringBufferRing::~IoUringBufferRing()
+{
+  destroy();
+}
+
+void
+IoUringBufferRing::destroy()
+{
+  if (buffers_)
+    munmap(buffers_, buffers_size_);
+  if (ring_)
+    munmap(ring_, ring_size_);
+  buffers_ = nullptr;
+  ring_ = nullptr;
+}
+
+PassRef<IOError>
+IoUringBufferRing::Initialize(IoUringRing *ring, uint16_t group, unsigned count, size_t size)
+{
+  assert(count && (count & (count - 1)) == 0);
+
+  // The ring must be page-aligned, which anonymous mappings always are. The
+  // buffers themselves are mapped separately, so they are only backed by
+  // memory once the kernel actually receives into them.
+  ring_size_ = count * sizeof(struct io_uring_buf);
+  void *mem = mmap(nullptr, ring_size_, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return new PosixError();
+  ring_ = reinterpret_cast<struct io_uring_buf *>(mem);
+
+  buffers_size_ = count * size;
+  mem = mmap(nullptr, buffers_size_, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    Ref<IOError> error = new PosixError();
+    destroy();
+    return error;
+  }
+  buffers_ = reinterpret_cast<uint8_t *>(mem);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = uint64_t(uintptr_t(ring_));
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (ring->registerOp(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    Ref<IOError> error = new PosixError();
+    destroy();
+    return error;
+  }
+
+  size_ = size;
+  mask_ = count - 1;
+  group_ = group;
+  tail_ = 0;
+  for (unsigned i = 0; i < count; i++)
+    recycle(i);
+  return nullptr;
+}
+
+void
+IoUringBufferRing::recycle(unsigned bid)
+{
+  struct io_uring_buf *buf = &ring_[tail_ & mask_];
+  buf->addr = uint64_t(uintptr_t(buffer(bid)));
+  buf->len = uint32_t(size_);
+  buf->bid = uint16_t(bid);
+  tail_++;
+
+  __atomic_store_n(&ring_[0].resv, tail_, __ATOMIC_RELEASE);
+}
+
+#endif // AMIO_HAVE_IO_URING
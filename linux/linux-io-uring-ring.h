@@ -0,0 +1,181 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_linux_io_uring_ring_h_
+#define _include_amio_linux_io_uring_ring_h_
+
+#include "include/amio.h"
+
+// io_uring support is compiled in only if the kernel headers know about it
+// (we need Linux 6.0 headers, for multishot receives). Otherwise, the factory
+// functions will return an error.
+#if defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  if defined(IORING_RECV_MULTISHOT)
+#   define AMIO_HAVE_IO_URING
+#  endif
+# endif
+#endif
+
+#if defined(AMIO_HAVE_IO_URING)
+#include <time.h>
+
+namespace amio {
+
+using namespace ke;
+
+// Thin wrapper around the raw io_uring syscalls and shared ring buffers. We
+// do not depend on liburing. The ring itself is not thread-safe; the owner
+// must serialize submission-side access, and only one thread may consume
+// completions at a time.
+class IoUringRing
+{
+ public:
+  IoUringRing();
+  ~IoUringRing();
+
+  // Create the ring with at least |entries| submission slots and at least
+  // |cqEntries| completion slots. |requiredFeatures| is a mask of
+  // IORING_FEAT_* bits that the kernel must report.
+  PassRef<IOError> Initialize(unsigned entries, unsigned cqEntries, unsigned requiredFeatures);
+
+  // Return a zeroed submission entry. If the submission queue is full,
+  // pending entries are submitted first. The entry is not visible to the
+  // kernel until the next call to publish() or submit().
+  PassRef<IOError> getSqe(struct io_uring_sqe **outp);
+
+  // Make queued entries visible to the kernel, and return how many have not
+  // yet been submitted. This must be serialized with getSqe().
+  unsigned publish();
+
+  // Submit any pending entries without waiting.
+  PassRef<IOError> submit();
+
+  // Submit up to |toSubmit| published entries and wait for at least one
+  // completion. If |timeout| is null, this blocks indefinitely. Timeouts and
+  // signals are not reported as errors.
+  //
+  // This may be called without serializing against getSqe(), as long as the
+  // caller passes the count returned by publish().
+  PassRef<IOError> wait(unsigned toSubmit, const struct timespec *timeout);
+
+  // Unmap and close the ring. No methods other than fd() may be called
+  // afterward.
+  void destroy();
+
+  // Copy out the next completion entry, if any, and release its slot back to
+  // the kernel. Returns false if the completion queue is empty.
+  bool popCqe(struct io_uring_cqe *outp);
+
+  // Register a sparse table of |count| fixed file slots.
+  PassRef<IOError> registerFiles(unsigned count);
+
+  // Install |fd| into fixed file slot |index|, or clear the slot if |fd| is
+  // -1. Requests already using the slot keep their own reference to the
+  // file.
+  PassRef<IOError> updateFile(unsigned index, int fd);
+
+  // Returns the number of entries waiting to be submitted.
+  unsigned pending() const {
+    return sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE);
+  }
+
+  int fd() const {
+    return ring_fd_;
+  }
+  unsigned features() const {
+    return features_;
+  }
+  unsigned cqEntries() const {
+    return cq_entries_;
+  }
+
+ private:
+  friend class IoUringBufferRing;
+
+  int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg, size_t argsz);
+  int registerOp(unsigned opcode, void *arg, unsigned nargs);
+
+ private:
+  int ring_fd_;
+  unsigned features_;
+
+  void *sq_ring_;
+  size_t sq_ring_size_;
+  void *cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe *sqes_;
+  size_t sqes_size_;
+
+  unsigned *sq_khead_;
+  unsigned *sq_ktail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned sq_tail_;
+
+  unsigned *cq_khead_;
+  unsigned *cq_ktail_;
+  unsigned cq_mask_;
+  unsigned cq_entries_;
+  struct io_uring_cqe *cqes_;
+};
+
+// A ring of fixed-size buffers that the kernel picks from when a request is
+// submitted with IOSQE_BUFFER_SELECT. Buffers are handed out in completion
+// entries, and must be recycled once the data has been consumed. Like
+// IoUringRing, this is not thread-safe.
+class IoUringBufferRing
+{
+ public:
+  IoUringBufferRing();
+  ~IoUringBufferRing();
+
+  // Allocate |count| buffers of |size| bytes each, and register them with
+  // |ring| as buffer group |group|. |count| must be a power of two.
+  PassRef<IOError> Initialize(IoUringRing *ring, uint16_t group, unsigned count, size_t size);
+
+  // Free the buffers. The ring they were registered with must have been
+  // destroyed, or the group unregistered, first.
+  void destroy();
+
+  // Return the buffer with the given id, as reported by a completion entry.
+  uint8_t *buffer(unsigned bid) const {
+    return buffers_ + size_t(bid) * size_;
+  }
+
+  // Hand a buffer back to the kernel.
+  void recycle(unsigned bid);
+
+  uint16_t group() const {
+    return group_;
+  }
+  bool active() const {
+    return !!ring_;
+  }
+
+ private:
+  // Note: we don't use struct io_uring_buf_ring, since in C++ its flexible
+  // array member does not start at offset 0. The ring is just an array of
+  // io_uring_buf, with the tail overlaid on the first entry's |resv| field.
+  struct io_uring_buf *ring_;
+  size_t ring_size_;
+  uint8_t *buffers_;
+  size_t buffers_size_;
+  size_t size_;
+  unsigned mask_;
+  uint16_t tail_;
+  uint16_t group_;
+};
+
+} // namespace amio
+
+#endif // AMIO_HAVE_IO_URING
+
+#endif // _include_amio_linux_io_uring_ring_h_
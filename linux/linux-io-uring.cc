@@ -0,0 +1,636 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include "posix/posix-errors.h"
+#include "linux/linux-utils.h"
+#include "linux/linux-io-uring.h"
+#include <amio-time.h>
+
+#if defined(AMIO_HAVE_IO_URING)
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#if !defined(POLLRDHUP)
+# define POLLRDHUP 0x2000
+#endif
+
+using namespace ke;
+using namespace amio;
+
+static const size_t kDefaultSubmitEntries = 128;
+static const size_t kDefaultRecvBuffers = 256;
+static const size_t kMaxRecvBuffers = 32768;
+static const size_t kDefaultRecvBufferSize = 4096;
+static const size_t kDefaultFixedFiles = 1024;
+
+// Buffer group used for completion-mode receives.
+static const uint16_t kRecvBufferGroup = 0;
+
+// Completions for requests we don't care about (such as poll removal) are
+// tagged with this value.
+static const uint64_t kIgnoredUserData = ~uint64_t(0);
+
+// The kernel stores poll masks word-swapped on big-endian machines.
+static inline uint32_t
+PollMask(uint32_t events)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+  return (events << 16) | (events >> 16);
+#else
+  return events;
+#endif
+}
+
+static inline size_t
+RoundUpPow2(size_t value)
+{
+  size_t result = 1;
+  while (result < value)
+    result <<= 1;
+  return result;
+}
+
+IoUringImpl::IoUringImpl(const IoUringOptions &options)
+ : generation_(0),
+   max_events_(options.maxEventsPerPoll ? options.maxEventsPerPoll : kDefaultSubmitEntries),
+   options_(options),
+   completion_(false)
+{
+  if (!options_.recvBufferCount)
+    options_.recvBufferCount = kDefaultRecvBuffers;
+  options_.recvBufferCount = ke::Min(RoundUpPow2(options_.recvBufferCount), kMaxRecvBuffers);
+  if (!options_.recvBufferSize)
+    options_.recvBufferSize = kDefaultRecvBufferSize;
+  if (!options_.fixedFiles)
+    options_.fixedFiles = kDefaultFixedFiles;
+}
+
+PassRef<IOError>
+IoUringImpl::Initialize()
+{
+  // Multishot poll requests need 5.13.
+  if (!IsAtLeastLinux(5, 13, 0))
+    return eIoUringUnsupported;
+
+  // The completion queue is sized larger than the submission queue since a
+  // multishot poll can produce many completions for one submission.
+  Ref<IOError> error = ring_.Initialize(max_events_, max_events_ * 4,
+                                        IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG);
+  if (error)
+    return error;
+
+  // Completion mode needs multishot receives, which arrived in 6.0. If it's
+  // not available we still work as a normal poller.
+  if (!IsAtLeastLinux(6, 0, 0))
+    return nullptr;
+
+  error = buffers_.Initialize(&ring_, kRecvBufferGroup,
+                              options_.recvBufferCount,
+                              options_.recvBufferSize);
+  if (error)
+    return nullptr;
+
+  // Fixed files are an optimization, so it's okay if we can't get them (for
+  // example, if the table is larger than RLIMIT_NOFILE).
+  if (ring_.registerFiles(options_.fixedFiles))
+    options_.fixedFiles = 0;
+
+  completion_ = true;
+  return nullptr;
+}
+
+IoUringImpl::~IoUringImpl()
+{
+  Shutdown();
+}
+
+void
+IoUringImpl::Shutdown()
+{
+  AutoMaybeLock lock(lock_);
+
+  if (ring_.fd() == -1)
+    return;
+
+  for (size_t i = 0; i < listeners_.length(); i++) {
+    if (listeners_[i].transport)
+      detach_for_shutdown_locked(listeners_[i].transport);
+  }
+
+  // The buffer ring must outlive the io_uring instance.
+  ring_.destroy();
+  buffers_.destroy();
+}
+
+PassRef<IOError>
+IoUringImpl::attach_locked(PosixTransport *transport, StatusListener *listener, TransportFlags flags)
+{
+  if (ring_.fd() == -1)
+    return ePollerShutdown;
+
+  size_t slot;
+  if (!free_slots_.empty()) {
+    slot = free_slots_.popCopy();
+  } else {
+    slot = listeners_.length();
+    if (!listeners_.append(PollData()))
+      return eOutOfMemory;
+  }
+
+  // Hook up the transport.
+  listeners_[slot].transport = transport;
+  listeners_[slot].modified = generation_;
+  listeners_[slot].seq++;
+  transport->attach(this, listener);
+  transport->setUserData(slot);
+  transport->flags() |= flags;
+
+  Ref<IOError> error;
+  if (flags & kTransportCompletion)
+    error = attach_completion_locked(slot, flags);
+  else
+    error = arm_locked(slot, flags);
+  if (!error)
+    error = flush_locked();
+  if (error) {
+    // Note: don't call OnChangeProxy, we never fully attached.
+    detach_locked(transport);
+    return error;
+  }
+  return nullptr;
+}
+
+PassRef<StatusListener>
+IoUringImpl::detach_locked(PosixTransport *transport)
+{
+  size_t slot = transport->getUserData();
+  assert(transport->fd() != -1);
+  assert(listeners_[slot].transport == transport);
+
+  // The poll request holds a reference to the underlying file, so submit the
+  // removal right away. Otherwise, closing the descriptor would not be
+  // visible to the peer until the next Poll().
+  disarm_locked(slot);
+  disarm_io_locked(slot);
+  ring_.submit();
+
+  // In-flight requests hold their own reference to the file, so the slot can
+  // be released right away.
+  if (listeners_[slot].fixed) {
+    ring_.updateFile(slot, -1);
+    listeners_[slot].fixed = false;
+  }
+
+  listeners_[slot].transport = nullptr;
+  listeners_[slot].modified = generation_;
+  free_slots_.append(slot);
+
+  // Completion mode is chosen on each attach, so don't let it stick.
+  transport->flags() &= ~kTransportCompletion;
+  return transport->detach();
+}
+
+PassRef<IOError>
+IoUringImpl::change_events_locked(PosixTransport *transport, TransportFlags flags)
+{
+  size_t slot = transport->getUserData();
+
+  if (transport->flags() & kTransportCompletion) {
+    if (Ref<IOError> error = change_completion_locked(slot, flags))
+      return error;
+    transport->flags() &= ~kTransportEventMask;
+    transport->flags() |= flags;
+    return flush_locked();
+  }
+
+  if (Ref<IOError> error = disarm_locked(slot))
+    return error;
+  if (Ref<IOError> error = arm_locked(slot, flags))
+    return error;
+
+  transport->flags() &= ~kTransportEventMask;
+  transport->flags() |= flags;
+  return flush_locked();
+}
+
+PassRef<IOError>
+IoUringImpl::arm_locked(size_t slot, TransportFlags flags)
+{
+  PosixTransport *transport = listeners_[slot].transport;
+
+  struct io_uring_sqe *sqe;
+  if (Ref<IOError> error = ring_.getSqe(&sqe))
+    return error;
+
+  // Errors and hangups are always reported, so we arm even if no events are
+  // requested. In completion mode, the receive reports hangups instead.
+  uint32_t events = 0;
+  if (!(flags & kTransportCompletion) && ReportsReadHangup(flags))
+    events |= POLLRDHUP;
+  if (flags & kTransportReading)
+    events |= POLLIN;
+  if (flags & kTransportWriting)
+    events |= POLLOUT;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = transport->fd();
+  sqe->poll32_events = PollMask(events);
+  sqe->user_data = encodeUserData(slot, listeners_[slot].seq);
+
+  // Multishot polls are edge-triggered. Level-triggered transports get a
+  // oneshot poll that we re-arm after dispatching.
+  if (transport->flags() & kTransportET)
+    sqe->len = IORING_POLL_ADD_MULTI;
+
+  transport->flags() |= kTransportArmed;
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringImpl::disarm_locked(size_t slot)
+{
+  PosixTransport *transport = listeners_[slot].transport;
+
+  // Whether or not we cancel anything, completions already in the queue for
+  // this slot are now stale.
+  uint32_t seq = listeners_[slot].seq++;
+  if (!(transport->flags() & kTransportArmed))
+    return nullptr;
+
+  struct io_uring_sqe *sqe;
+  if (Ref<IOError> error = ring_.getSqe(&sqe))
+    return error;
+
+  // Note: IORING_OP_POLL_REMOVE fails with EALREADY if the poll is in the
+  // middle of being woken up, and leaves it armed. A generic cancel marks
+  // the request so it terminates either way.
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = encodeUserData(slot, seq);
+  sqe->user_data = kIgnoredUserData;
+
+  transport->flags() &= ~kTransportArmed;
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringImpl::attach_completion_locked(size_t slot, TransportFlags flags)
+{
+  PosixTransport *transport = listeners_[slot].transport;
+
+  // Listening sockets accept rather than receive. This also fails for
+  // anything that is not a socket, which completion mode can't handle.
+  int listening = 0;
+  socklen_t len = sizeof(listening);
+  if (getsockopt(transport->fd(), SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1)
+    return new PosixError();
+  listeners_[slot].listening = !!listening;
+
+  // Slots map one-to-one onto fixed files. If we're out, fall back to the
+  // normal descriptor.
+  if (slot < options_.fixedFiles) {
+    if (Ref<IOError> error = ring_.updateFile(slot, transport->fd()))
+      return error;
+    listeners_[slot].fixed = true;
+  }
+
+  return change_completion_locked(slot, flags);
+}
+
+PassRef<IOError>
+IoUringImpl::change_completion_locked(size_t slot, TransportFlags flags)
+{
+  PosixTransport *transport = listeners_[slot].transport;
+
+  if ((flags & kTransportReading) && !listeners_[slot].io_armed) {
+    if (Ref<IOError> error = arm_io_locked(slot))
+      return error;
+  } else if (!(flags & kTransportReading) && listeners_[slot].io_armed) {
+    if (Ref<IOError> error = disarm_io_locked(slot))
+      return error;
+  }
+
+  if ((flags & kTransportWriting) && !(transport->flags() & kTransportArmed)) {
+    if (Ref<IOError> error = arm_locked(slot, flags))
+      return error;
+  } else if (!(flags & kTransportWriting) && (transport->flags() & kTransportArmed)) {
+    if (Ref<IOError> error = disarm_locked(slot))
+      return error;
+  }
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringImpl::arm_io_locked(size_t slot)
+{
+  PosixTransport *transport = listeners_[slot].transport;
+
+  struct io_uring_sqe *sqe;
+  if (Ref<IOError> error = ring_.getSqe(&sqe))
+    return error;
+
+  if (listeners_[slot].fixed) {
+    sqe->fd = slot;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = transport->fd();
+  }
+
+  if (listeners_[slot].listening) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = encodeUserData(slot, listeners_[slot].io_seq, kIoRequest|kAcceptRequest);
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers_.group();
+    sqe->user_data = encodeUserData(slot, listeners_[slot].io_seq, kIoRequest);
+  }
+
+  listeners_[slot].io_armed = true;
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringImpl::disarm_io_locked(size_t slot)
+{
+  // As with polls, anything already in the queue is now stale.
+  uint32_t seq = listeners_[slot].io_seq++;
+  if (!listeners_[slot].io_armed)
+    return nullptr;
+
+  struct io_uring_sqe *sqe;
+  if (Ref<IOError> error = ring_.getSqe(&sqe))
+    return error;
+
+  uint32_t kind = kIoRequest;
+  if (listeners_[slot].listening)
+    kind |= kAcceptRequest;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = encodeUserData(slot, seq, kind);
+  sqe->user_data = kIgnoredUserData;
+
+  listeners_[slot].io_armed = false;
+  return nullptr;
+}
+
+PassRef<IOError>
+IoUringImpl::flush_locked()
+{
+  // If another thread could be blocked in Poll(), it would not see the
+  // change until it woke up, so submit immediately.
+  if (lock_)
+    return ring_.submit();
+  return nullptr;
+}
+
+template <TransportFlags outFlag>
+inline void
+IoUringImpl::handleEvent(size_t slot)
+{
+  Ref<PosixTransport> transport = listeners_[slot].transport;
+
+  // If we are listening for sticky events, but not this event, bail out.
+  if ((transport->flags() & (outFlag|kTransportLT)) == kTransportLT)
+    return;
+
+  // One-shot transports are disarmed until the user asks for more events.
+  if (transport->flags() & kTransportOneShot) {
+    if (!(transport->flags() & outFlag))
+      return;
+    transport->flags() &= ~kTransportEventMask;
+  }
+
+  // We must hold the listener in a ref, since if the transport is detached
+  // in the callback, it could be destroyed while |this| is still on the
+  // stack. Similarly, we must hold the transport in a ref in case releasing
+  // the lock allows a detach to happen.
+  Ref<StatusListener> listener = transport->listener();
+
+  AutoMaybeUnlock unlock(lock_);
+  if (outFlag == kTransportReading)
+    listener->OnReadReady();
+  else if (outFlag == kTransportWriting)
+    listener->OnWriteReady();
+}
+
+PassRef<IOError>
+IoUringImpl::PollNs(int64_t timeoutNs)
+{
+  // We acquire a lock specifically for Poll(), to make sure it isn't called on
+  // any thread or within callbacks.
+  AutoMaybeLock poll_lock(poll_lock_);
+
+  int64_t deadline = 0;
+  if (timeoutNs > 0)
+    deadline = HighResolutionTimer::Counter() + timeoutNs;
+
+  struct timespec timeout;
+  struct timespec *timeoutp = TimeoutToTimespec(timeoutNs, &timeout);
+
+  while (true) {
+    if (timeoutNs > 0)
+      TimeoutToTimespec(ke::Max(deadline - HighResolutionTimer::Counter(), int64_t(0)), &timeout);
+
+    // Publish queued interest changes under the transport lock. The wait
+    // itself submits them, so there is only one syscall.
+    unsigned to_submit;
+    {
+      AutoMaybeLock lock(lock_);
+      if (ring_.fd() == -1)
+        return ePollerShutdown;
+      to_submit = ring_.publish();
+    }
+
+    if (Ref<IOError> error = ring_.wait(to_submit, timeoutp))
+      return error;
+
+    // Unlike epoll_wait(), we can wake up for completions that turn out to be
+    // stale or uninteresting (such as poll removals). Keep waiting in that
+    // case, so Poll() doesn't return early without having done anything.
+    if (dispatch())
+      break;
+    if (timeoutNs == 0 || (timeoutNs > 0 && HighResolutionTimer::Counter() >= deadline))
+      break;
+  }
+
+  return nullptr;
+}
+
+bool
+IoUringImpl::dispatch()
+{
+  // Now we acquire the transport lock.
+  AutoMaybeLock lock(lock_);
+
+  generation_++;
+
+  // Bound the number of completions we process, since edge-triggered
+  // transports can keep producing them while we dispatch.
+  //
+  // Note that a callback can shut down the poller, which unmaps the ring.
+  bool dispatched = false;
+  struct io_uring_cqe cqe;
+  for (size_t i = 0; i < ring_.cqEntries() && ring_.fd() != -1 && ring_.popCqe(&cqe); i++) {
+    if (cqe.user_data == kIgnoredUserData)
+      continue;
+
+    if (uint32_t(cqe.user_data) & kIoRequest) {
+      if (dispatchIo(cqe)) {
+        eventDispatched();
+        dispatched = true;
+      }
+
+      // Whether or not anyone saw the data, the buffer goes back to the pool.
+      if ((cqe.flags & IORING_CQE_F_BUFFER) && ring_.fd() != -1)
+        buffers_.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      continue;
+    }
+
+    size_t slot = size_t(uint32_t(cqe.user_data));
+    uint32_t seq = uint32_t(cqe.user_data >> 32);
+    if (slot >= listeners_.length() || listeners_[slot].seq != seq)
+      continue;
+    if (isFdChanged(slot))
+      continue;
+
+    eventDispatched();
+    dispatched = true;
+
+    Ref<PosixTransport> transport = listeners_[slot].transport;
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+      transport->flags() &= ~kTransportArmed;
+
+    if (cqe.res < 0) {
+      // The kernel can cancel polls on its own, in which case we re-arm.
+      if (cqe.res != -ECANCELED) {
+        reportError_locked(transport, new PosixError(-cqe.res));
+        continue;
+      }
+    } else {
+      int events = cqe.res;
+
+      // Handle errors first. Zero-copy completions also show up as errors.
+      if (events & POLLERR) {
+        if (!handleError_locked(transport) || isFdChanged(slot))
+          continue;
+      }
+
+      // Prioritize POLLIN over POLLHUP/POLLRDHUP.
+      if (events & POLLIN) {
+        handleEvent<kTransportReading>(slot);
+        if (isFdChanged(slot))
+          continue;
+      }
+
+      // Handle explicit hangup. If the read callback stopped reading, a half
+      // close is left for the listener to handle.
+      if ((events & POLLHUP) ||
+          ((events & POLLRDHUP) && ReportsReadHangup(transport->flags())))
+      {
+        reportHup_locked(transport);
+        continue;
+      }
+
+      // Handle output.
+      if (events & POLLOUT) {
+        handleEvent<kTransportWriting>(slot);
+        if (isFdChanged(slot))
+          continue;
+      }
+    }
+
+    // Re-arm oneshot polls, unless a callback already changed events, or the
+    // transport is in one-shot mode. The new request is submitted with the
+    // next Poll().
+    if (!(transport->flags() & (kTransportArmed|kTransportOneShot)) &&
+        wantsPoll(transport->flags()))
+    {
+      if (Ref<IOError> error = arm_locked(slot, transport->flags()))
+        reportError_locked(transport, error);
+    }
+  }
+
+  return dispatched;
+}
+
+bool
+IoUringImpl::dispatchIo(const struct io_uring_cqe &cqe)
+{
+  uint32_t kind = uint32_t(cqe.user_data);
+  size_t slot = size_t(kind & kSlotMask);
+  uint32_t seq = uint32_t(cqe.user_data >> 32);
+  if (slot >= listeners_.length() || listeners_[slot].io_seq != seq || isFdChanged(slot)) {
+    // Nobody is around to take ownership of a late connection.
+    if ((kind & kAcceptRequest) && cqe.res >= 0)
+      AMIO_RETRY_IF_EINTR(close(cqe.res));
+    return false;
+  }
+
+  Ref<PosixTransport> transport = listeners_[slot].transport;
+  if (!(cqe.flags & IORING_CQE_F_MORE))
+    listeners_[slot].io_armed = false;
+
+  // Hold the listener in a ref, as in handleEvent().
+  // Attach() only accepts CompletionListeners in completion mode.
+  Ref<StatusListener> base = transport->listener();
+  Ref<CompletionListener> listener = base->toCompletionListener();
+  assert(listener);
+
+  if (cqe.res < 0) {
+    switch (-cqe.res) {
+      case ECANCELED:
+      case ENOBUFS:
+        // The kernel gave up on the request, or ran out of buffers. Every
+        // buffer is recycled by the time we re-arm, so try again.
+        break;
+      default:
+        if (!(kind & kAcceptRequest)) {
+          reportError_locked(transport, new PosixError(-cqe.res));
+          return true;
+        }
+
+        {
+          AutoMaybeUnlock unlock(lock_);
+          listener->OnAcceptError(new PosixError(-cqe.res));
+        }
+        break;
+    }
+  } else if (kind & kAcceptRequest) {
+    AutoMaybeUnlock unlock(lock_);
+    listener->OnAccept(cqe.res);
+  } else if (cqe.res == 0) {
+    reportHup_locked(transport);
+    return true;
+  } else {
+    assert(cqe.flags & IORING_CQE_F_BUFFER);
+
+    AutoMaybeUnlock unlock(lock_);
+    listener->OnRecv(buffers_.buffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT), size_t(cqe.res));
+  }
+
+  // Re-arm if the kernel ended the request, unless a callback detached the
+  // transport or no longer wants reads.
+  if (ring_.fd() == -1 || isFdChanged(slot))
+    return true;
+  if (!listeners_[slot].io_armed && (transport->flags() & kTransportReading)) {
+    if (Ref<IOError> error = arm_io_locked(slot))
+      reportError_locked(transport, error);
+  }
+  return true;
+}
+
+#endif // AMIO_HAVE_IO_URING
@@ -0,0 +1,139 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_linux_io_uring_pump_h_
+#define _include_amio_linux_io_uring_pump_h_
+
+#include "include/amio.h"
+#include "posix/posix-transport.h"
+#include "posix/posix-base-poller.h"
+#include "linux/linux-io-uring-ring.h"
+#include <am-utility.h>
+#include <am-vector.h>
+
+#if defined(AMIO_HAVE_IO_URING)
+
+namespace amio {
+
+using namespace ke;
+
+// This message pump uses io_uring poll requests (Linux >= 5.13) instead of
+// epoll. Interest changes are queued as submission entries rather than
+// issued as individual syscalls, and are flushed together with the wait in
+// a single io_uring_enter() per Poll().
+//
+// Edge-triggered transports use a multishot poll that stays armed. Level-
+// triggered transports use a oneshot poll that is re-armed after each event
+// is delivered; the re-arm is batched into the next Poll().
+//
+// If thread-safety is enabled, interest changes are submitted immediately,
+// since another thread may already be blocked in Poll().
+//
+// Transports attached in completion mode have a multishot recv (or accept,
+// for listening sockets) instead of a read poll. Received data lands in a
+// provided buffer ring shared by every transport, and the buffer is handed
+// back to the kernel once the listener has seen it. Write events still use
+// oneshot polls.
+class IoUringImpl : public PosixPoller
+{
+ public:
+  IoUringImpl(const IoUringOptions &options);
+  ~IoUringImpl();
+
+  PassRef<IOError> Initialize();
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
+  void Shutdown() override;
+  bool SupportsEdgeTriggering() override {
+    return true;
+  }
+  bool SupportsCompletionMode() override {
+    return completion_;
+  }
+
+  PassRef<IOError> attach_locked(
+    PosixTransport *transport,
+    StatusListener *listener,
+    TransportFlags flags) override;
+  PassRef<StatusListener> detach_locked(PosixTransport *transport) override;
+  PassRef<IOError> change_events_locked(PosixTransport *transport, TransportFlags flags) override;
+
+ private:
+  bool isFdChanged(size_t slot) const {
+    return listeners_[slot].modified == generation_;
+  }
+
+  // Completions carry the slot and request kind in the low 32 bits, and the
+  // slot's arming sequence in the high 32 bits. Completions for an old
+  // sequence are stale and ignored. Polls and completion-mode requests have
+  // separate sequences.
+  static const uint32_t kIoRequest = 0x80000000;
+  static const uint32_t kAcceptRequest = 0x40000000;
+  static const uint32_t kSlotMask = ~(kIoRequest|kAcceptRequest);
+
+  static inline uint64_t encodeUserData(size_t slot, uint32_t seq, uint32_t kind = 0) {
+    return (uint64_t(seq) << 32) | uint64_t(slot) | kind;
+  }
+
+  bool wantsPoll(TransportFlags flags) const {
+    // In completion mode, reads don't need a poll.
+    if (flags & kTransportCompletion)
+      return !!(flags & kTransportWriting);
+    return true;
+  }
+
+  PassRef<IOError> arm_locked(size_t slot, TransportFlags flags);
+  PassRef<IOError> disarm_locked(size_t slot);
+  PassRef<IOError> flush_locked();
+
+  PassRef<IOError> attach_completion_locked(size_t slot, TransportFlags flags);
+  PassRef<IOError> change_completion_locked(size_t slot, TransportFlags flags);
+  PassRef<IOError> arm_io_locked(size_t slot);
+  PassRef<IOError> disarm_io_locked(size_t slot);
+
+  // Process completions. Returns false if every completion was stale.
+  bool dispatch();
+  bool dispatchIo(const struct io_uring_cqe &cqe);
+
+  template <TransportFlags outFlag>
+  inline void handleEvent(size_t slot);
+
+ private:
+  struct PollData {
+    Ref<PosixTransport> transport;
+    size_t modified;
+    uint32_t seq;
+
+    // Completion mode state.
+    uint32_t io_seq;
+    bool io_armed;
+    bool listening;
+    bool fixed;
+
+    PollData() : modified(0), seq(0), io_seq(0), io_armed(false), listening(false), fixed(false)
+    {}
+  };
+
+  IoUringRing ring_;
+  size_t generation_;
+  size_t max_events_;
+
+  IoUringOptions options_;
+  bool completion_;
+  IoUringBufferRing buffers_;
+
+  // Note: we currently do not shrink slots.
+  ke::Vector<PollData> listeners_;
+  ke::Vector<size_t> free_slots_;
+};
+
+} // namespace amio
+
+#endif // AMIO_HAVE_IO_URING
+
+#endif // _include_amio_linux_io_uring_pump_h_
@@ -12,6 +12,7 @@
 #include "posix/posix-errors.h"
 #include "linux/linux-utils.h"
 #include "linux/linux-epoll.h"
+#include "linux/linux-io-uring.h"
 #include <string.h>
 #include <stdlib.h>
 #include <sys/utsname.h>
@@ -19,6 +20,8 @@
 using namespace ke;
 using namespace amio;
 
+ke::Ref<GenericError> amio::eIoUringUnsupported = new GenericError("io_uring polling requires Linux 5.13 or higher");
+
 bool
 amio::GetLinuxVersion(int *major, int *minor, int *release)
 {
@@ -46,12 +49,52 @@ amio::GetLinuxVersion(int *major, int *minor, int *release)
 PassRef<IOError>
 PollerFactory::CreateEpollImpl(Ref<Poller> *outp, size_t maxEventsPerPoll)
 {
-  Ref<EpollImpl> poller(new EpollImpl(maxEventsPerPoll));
+  EpollOptions options;
+  options.maxEventsPerPoll = maxEventsPerPoll;
+  return CreateEpollImpl(outp, options);
+}
+
+PassRef<IOError>
+PollerFactory::CreateConcurrentEpollImpl(Ref<Poller> *outp, size_t maxEventsPerPoll)
+{
+  EpollOptions options;
+  options.maxEventsPerPoll = maxEventsPerPoll;
+  options.concurrent = true;
+  return CreateEpollImpl(outp, options);
+}
+
+PassRef<IOError>
+PollerFactory::CreateEpollImpl(Ref<Poller> *outp, const EpollOptions &options)
+{
+  Ref<EpollImpl> poller(new EpollImpl(options));
+  Ref<IOError> error = poller->Initialize();
+  if (error)
+    return error;
+  *outp = poller;
+  return nullptr;
+}
+
+PassRef<IOError>
+PollerFactory::CreateIoUringImpl(Ref<Poller> *outp, size_t maxEventsPerPoll)
+{
+  IoUringOptions options;
+  options.maxEventsPerPoll = maxEventsPerPoll;
+  return CreateIoUringImpl(outp, options);
+}
+
+PassRef<IOError>
+PollerFactory::CreateIoUringImpl(Ref<Poller> *outp, const IoUringOptions &options)
+{
+#if defined(AMIO_HAVE_IO_URING)
+  Ref<IoUringImpl> poller(new IoUringImpl(options));
   Ref<IOError> error = poller->Initialize();
   if (error)
     return error;
   *outp = poller;
   return nullptr;
+#else
+  return eIoUringUnsupported;
+#endif
 }
 
 PassRef<IOError>
@@ -11,9 +11,12 @@
 #define _include_amio_linux_h_
 
 #include "include/amio.h"
+#include "shared/shared-errors.h"
 
 namespace amio {
 
+extern ke::Ref<GenericError> eIoUringUnsupported;
+
 bool GetLinuxVersion(int *major, int *minor, int *release);
 
 static inline bool
@@ -12,6 +12,12 @@
 #include "posix/posix-transport.h"
 #include "posix/posix-base-poller.h"
 #include "posix/posix-errors.h"
+#include <errno.h>
+#if defined(AMIO_HAVE_ZEROCOPY)
+# include <string.h>
+# include <netinet/in.h>
+# include <linux/errqueue.h>
+#endif
 
 using namespace ke;
 using namespace amio;
@@ -23,6 +29,7 @@ EventsToFlags(Events events)
   assert(int(Events::Write) == int(kTransportWriting));
   assert(int(EventMode::Level) == int(kTransportLT));
   assert(int(EventMode::Edge) == int(kTransportET));
+  assert(int(EventMode::OneShot) == int(kTransportOneShot));
 
   return TransportFlags(events);
 }
@@ -50,6 +57,12 @@ PosixPoller::Attach(Ref<Transport> baseTransport, Ref<StatusListener> listener,
 
   if (mode == EventMode::Edge && !SupportsEdgeTriggering())
     return eEdgeTriggeringUnsupported;
+  if ((mode & EventMode::Completion) == EventMode::Completion) {
+    if (!SupportsCompletionMode())
+      return eCompletionModeUnsupported;
+    if (!listener->toCompletionListener())
+      return eCompletionListenerRequired;
+  }
   if (mode == EventMode::ETS)
     mode = EventMode::Edge;
 
@@ -60,6 +73,14 @@ PosixPoller::Attach(Ref<Transport> baseTransport, Ref<StatusListener> listener,
   return attach_locked(transport, listener, flags);
 }
 
+PassRef<IOError>
+PosixPoller::Poll(int timeoutMs)
+{
+  if (timeoutMs < 0)
+    return PollNs(kNoTimeout);
+  return PollNs(int64_t(timeoutMs) * kNanosecondsPerMillisecond);
+}
+
 void
 PosixPoller::Detach(Ref<Transport> baseTransport)
 {
@@ -216,9 +237,104 @@ PosixPoller::reportError_locked(Ref<PosixTransport> transport, Ref<IOError> erro
   listener->OnHangup(error);
 }
 
+#if defined(AMIO_HAVE_ZEROCOPY)
+struct ZeroCopyCompletion
+{
+  uint32_t first;
+  uint32_t last;
+  bool copied;
+};
+
+// Pop the next zero-copy notification off a socket's error queue. Returns 1
+// if |out| was filled, 0 if the queue is empty, or -1 with errno set.
+static int
+ReadZeroCopyCompletion(int fd, ZeroCopyCompletion *out)
+{
+  for (;;) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (AMIO_RETRY_IF_EINTR(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+
+    // Anything else on the queue (such as ICMP errors) is not ours to report.
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+      {
+        continue;
+      }
+
+      const struct sock_extended_err *serr =
+        reinterpret_cast<const struct sock_extended_err *>(CMSG_DATA(cmsg));
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+        continue;
+
+      out->first = serr->ee_info;
+      out->last = serr->ee_data;
+      out->copied = !!(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+      return 1;
+    }
+  }
+}
+#endif
+
+// This is called within the poll lock.
+bool
+PosixPoller::handleError_locked(Ref<PosixTransport> transport)
+{
+#if defined(AMIO_HAVE_ZEROCOPY)
+  if (transport->flags() & kTransportZeroCopy) {
+    ZeroCopyCompletion completion;
+    int rv;
+    while ((rv = ReadZeroCopyCompletion(transport->fd(), &completion)) == 1) {
+      transport->completeZeroCopy(completion.last);
+      {
+        Ref<StatusListener> listener = transport->listener();
+
+        AutoMaybeUnlock unlock(lock_);
+        listener->OnZeroCopyComplete(completion.first, completion.last, completion.copied);
+      }
+
+      // The callback may have detached or closed the transport.
+      Ref<PosixPoller> poller = transport->poller();
+      if (poller != this)
+        return false;
+    }
+
+    if (rv == -1) {
+      reportError_locked(transport, new PosixError());
+      return false;
+    }
+
+    // If the error queue was all there was, keep dispatching.
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(transport->fd(), SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+    if (!error)
+      return true;
+
+    reportError_locked(transport, new PosixError(error));
+    return false;
+  }
+#endif
+
+  reportError_locked(transport);
+  return false;
+}
+
 void
 PosixPoller::detach_for_shutdown_locked(PosixTransport *transport)
 {
+  cancel_change_locked(transport);
+
   if (transport->isProxying()) {
     if (Ref<StatusListener> listener = transport->detach()) {
       AutoMaybeUnlock unlock(lock_);
@@ -229,9 +345,58 @@ PosixPoller::detach_for_shutdown_locked(PosixTransport *transport)
   }
 }
 
+void
+PosixPoller::defer_change_locked(PosixTransport *transport)
+{
+  if (transport->flags() & kTransportChangePending)
+    return;
+
+  // If we can't queue the change, apply it now.
+  if (!changelist_.append(transport)) {
+    if (Ref<IOError> error = apply_change_locked(transport))
+      reportError_locked(transport, error);
+    return;
+  }
+  transport->flags() |= kTransportChangePending;
+}
+
+void
+PosixPoller::cancel_change_locked(PosixTransport *transport)
+{
+  // The transport stays in the list, but will be skipped, even if another
+  // poller marks it as pending again.
+  transport->flags() &= ~kTransportChangePending;
+}
+
+void
+PosixPoller::flush_changes_locked()
+{
+  // Note: errors are reported through callbacks, which can queue more
+  // changes, so the length must be re-checked on each iteration.
+  for (size_t i = 0; i < changelist_.length(); i++) {
+    Ref<PosixTransport> transport = changelist_[i];
+    if (!(transport->flags() & kTransportChangePending))
+      continue;
+
+    // If the transport was detached and then attached to another poller, a
+    // pending change belongs to that poller.
+    Ref<PosixPoller> poller = transport->poller();
+    if (poller != this)
+      continue;
+    transport->flags() &= ~kTransportChangePending;
+
+    if (Ref<IOError> error = apply_change_locked(transport))
+      reportError_locked(transport, error);
+  }
+  changelist_.clear();
+}
+
 void
 PosixPoller::EnableThreadSafety()
 {
+  // Changes can't be deferred anymore, so apply anything still queued.
+  flush_changes_locked();
+
   lock_ = new Mutex();
   poll_lock_ = new Mutex();
 }
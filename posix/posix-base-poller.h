@@ -11,13 +11,50 @@
 #define _include_amio_base_pump_h_
 
 #include "include/amio.h"
+#include "include/amio-time.h"
 #include "posix/posix-transport.h"
 #include <am-thread-utils.h>
+#include <am-vector.h>
+#include <limits.h>
+#include <time.h>
 
 namespace amio {
 
 using namespace ke;
 
+// Convert a PollNs() timeout for system calls that take a timespec. Returns
+// null if the timeout is infinite.
+static inline struct timespec *
+TimeoutToTimespec(int64_t timeoutNs, struct timespec *ts)
+{
+  if (timeoutNs < 0)
+    return nullptr;
+  ts->tv_sec = time_t(timeoutNs / kNanosecondsPerSecond);
+  ts->tv_nsec = long(timeoutNs % kNanosecondsPerSecond);
+  return ts;
+}
+
+// Convert a PollNs() timeout for system calls that take milliseconds. This
+// rounds up, so callers waiting for a deadline don't wake up early and spin.
+static inline int
+TimeoutToMs(int64_t timeoutNs)
+{
+  if (timeoutNs < 0)
+    return kNoTimeout;
+  int64_t ms = (timeoutNs + kNanosecondsPerMillisecond - 1) / kNanosecondsPerMillisecond;
+  return int(ke::Min(ms, int64_t(INT_MAX)));
+}
+
+// Whether the peer shutting down its end of a stream (POLLRDHUP, or EOF on a
+// read filter) should be reported as a hangup. A transport that has stopped
+// reading but is still writing can flush output to a half-closed peer, so it
+// only hears about a full hangup.
+static inline bool
+ReportsReadHangup(TransportFlags flags)
+{
+  return (flags & kTransportReading) || !(flags & kTransportWriting);
+}
+
 // Baseline for posix transports. Note that some internal functions take in
 // raw pointers. In these cases, we expect that the caller is hoding the
 // pointer alive in a Ref.
@@ -26,6 +63,11 @@ class PosixPoller
     public RefcountedThreadsafe<PosixPoller>
 {
  public:
+  PosixPoller()
+   : num_transports_(0),
+     num_events_(0)
+  {}
+
   void EnableThreadSafety() override;
 
   void AddRef() override {
@@ -38,6 +80,36 @@ class PosixPoller
     return 1;
   }
 
+  // Return the number of attached transports. This may be called from any
+  // thread.
+  size_t NumTransports() const {
+    return __atomic_load_n(&num_transports_, __ATOMIC_RELAXED);
+  }
+
+  // Called by PosixTransport when it is attached to or detached from this
+  // poller.
+  void transportAttached() {
+    __atomic_add_fetch(&num_transports_, 1, __ATOMIC_RELAXED);
+  }
+  void transportDetached() {
+    __atomic_sub_fetch(&num_transports_, 1, __ATOMIC_RELAXED);
+  }
+
+  // Return the number of transport events dispatched so far. Event loops
+  // compare this across a poll to tell whether it found anything. This may
+  // be called from any thread.
+  size_t NumEventsDispatched() const {
+    return __atomic_load_n(&num_events_, __ATOMIC_RELAXED);
+  }
+
+  // Called by pollers for each transport they dispatch events to.
+  void eventDispatched() {
+    __atomic_add_fetch(&num_events_, 1, __ATOMIC_RELAXED);
+  }
+
+  // Pollers implement PollNs(); this forwards to it.
+  PassRef<IOError> Poll(int timeoutMs) override;
+
   // Helper functions. These perform validation and route on to inner
   // functions.
   PassRef<IOError> Attach(
@@ -79,11 +151,42 @@ class PosixPoller
   void reportError_locked(Ref<PosixTransport> transport);
   void reportError_locked(Ref<PosixTransport> transport, Ref<IOError> error);
 
+  // Called when the kernel flags an error on |transport|. Zero-copy
+  // transports first deliver any completions on the socket's error queue;
+  // if those were the only problem, this returns true and the caller should
+  // go on dispatching events. Otherwise, the error is reported and this
+  // returns false.
+  bool handleError_locked(Ref<PosixTransport> transport);
+
   void detach_for_shutdown_locked(PosixTransport *transport);
 
+  // Deferred interest changes. Pollers where each change costs a system call
+  // can queue the transport here from change_events_locked(), after updating
+  // its flags, and call flush_changes_locked() before waiting for events. A
+  // transport is queued at most once no matter how many times it changes,
+  // and apply_change_locked() is then called with its final flags. Changes
+  // that cancel each other out can be skipped entirely.
+  //
+  // Changes can only be deferred if thread safety is off, since otherwise
+  // another thread may already be waiting for events.
+  bool can_defer_changes() const {
+    return !lock_;
+  }
+  void defer_change_locked(PosixTransport *transport);
+  void cancel_change_locked(PosixTransport *transport);
+  void flush_changes_locked();
+  virtual PassRef<IOError> apply_change_locked(PosixTransport *transport) {
+    return nullptr;
+  }
+
  protected:
   AutoPtr<Mutex> lock_;
   AutoPtr<Mutex> poll_lock_;
+
+ private:
+  Vector<Ref<PosixTransport>> changelist_;
+  size_t num_transports_;
+  size_t num_events_;
 };
 
 } // namespace amio
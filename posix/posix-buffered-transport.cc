@@ -0,0 +1,409 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "posix-buffered-transport.h"
+#include "../shared/shared-errors.h"
+
+using namespace ke;
+using namespace amio;
+
+// The most output blocks to hand to a single writev().
+static const size_t kMaxWriteBlocks = 16;
+
+PassRef<IOError>
+BufferedTransport::Create(Ref<BufferedTransport> *outp,
+                          Ref<IODispatcher> dispatcher,
+                          Ref<Transport> transport,
+                          Ref<BufferedListener> listener,
+                          const BufferedTransportOptions &options)
+{
+  Ref<BufferedTransportImpl> impl = new BufferedTransportImpl(dispatcher, transport, listener, options);
+  if (Ref<IOError> error = impl->Initialize())
+    return error;
+
+  *outp = impl;
+  return nullptr;
+}
+
+BufferedTransportImpl::BufferedTransportImpl(Ref<IODispatcher> dispatcher,
+                                             Ref<Transport> transport,
+                                             Ref<BufferedListener> listener,
+                                             const BufferedTransportOptions &options)
+ : dispatcher_(dispatcher),
+   transport_(transport),
+   listener_(listener),
+   options_(options),
+   input_start_(0),
+   input_length_(0),
+   reading_paused_(false),
+   input_ended_(false),
+   head_(nullptr),
+   tail_(nullptr),
+   pending_output_(0),
+   waiting_for_write_(false)
+{
+  if (!options_.highWatermark)
+    options_.highWatermark = options_.inputCapacity;
+}
+
+BufferedTransportImpl::~BufferedTransportImpl()
+{
+  freeOutput();
+}
+
+PassRef<IOError>
+BufferedTransportImpl::Initialize()
+{
+  if (!options_.inputCapacity ||
+      options_.highWatermark > options_.inputCapacity ||
+      options_.lowWatermark >= options_.highWatermark)
+  {
+    return new GenericError("invalid buffered transport watermarks");
+  }
+
+  input_ = new char[options_.inputCapacity];
+
+  // Write events are only enabled while output is queued.
+  if (Ref<IOError> error = dispatcher_->Attach(transport_, this, Events::Read, EventMode::Level)) {
+    transport_ = nullptr;
+    listener_ = nullptr;
+    return error;
+  }
+  return nullptr;
+}
+
+PassRef<IOError>
+BufferedTransportImpl::Write(const void *data, size_t length)
+{
+  if (!transport_)
+    return eTransportClosed;
+
+  const char *ptr = reinterpret_cast<const char *>(data);
+
+  // If nothing is queued, try to skip the copy entirely.
+  if (!head_) {
+    IOResult r;
+    if (!transport_->Write(&r, ptr, length)) {
+      Close();
+      return r.error;
+    }
+    ptr += r.bytes;
+    length -= r.bytes;
+  }
+  if (!length)
+    return nullptr;
+
+  if (!enqueue(ptr, length))
+    return eOutOfMemory;
+
+  if (!waiting_for_write_) {
+    if (Ref<IOError> error = dispatcher_->AddEvents(transport_, Events::Write)) {
+      Close();
+      return error;
+    }
+    waiting_for_write_ = true;
+  }
+  return nullptr;
+}
+
+bool
+BufferedTransportImpl::enqueue(const char *data, size_t length)
+{
+  // Fill whatever room is left in the last block first.
+  if (tail_ && tail_->end < tail_->capacity) {
+    size_t count = ke::Min(length, tail_->capacity - tail_->end);
+    memcpy(tail_->data() + tail_->end, data, count);
+    tail_->end += count;
+    pending_output_ += count;
+    data += count;
+    length -= count;
+  }
+  if (!length)
+    return true;
+
+  // Large writes get a block of their own, so they are copied exactly once.
+  size_t capacity = ke::Max(length, options_.outputBlockSize);
+  Block *block = reinterpret_cast<Block *>(malloc(sizeof(Block) + capacity));
+  if (!block)
+    return false;
+
+  block->next = nullptr;
+  block->start = 0;
+  block->end = length;
+  block->capacity = capacity;
+  memcpy(block->data(), data, length);
+  pending_output_ += length;
+
+  if (tail_)
+    tail_->next = block;
+  else
+    head_ = block;
+  tail_ = block;
+  return true;
+}
+
+PassRef<IOError>
+BufferedTransportImpl::flush()
+{
+  while (head_) {
+    struct iovec iov[kMaxWriteBlocks];
+    size_t count = 0;
+    for (Block *block = head_; block && count < kMaxWriteBlocks; block = block->next) {
+      iov[count].iov_base = block->data() + block->start;
+      iov[count].iov_len = block->end - block->start;
+      count++;
+    }
+
+    IOResult r;
+    if (!transport_->WriteV(&r, iov, count))
+      return r.error;
+    if (!r.completed || !r.bytes)
+      return nullptr;
+
+    size_t written = r.bytes;
+    pending_output_ -= written;
+    while (written) {
+      Block *block = head_;
+      size_t remaining = block->end - block->start;
+      if (written < remaining) {
+        block->start += written;
+        break;
+      }
+      written -= remaining;
+      head_ = block->next;
+      free(block);
+    }
+    if (!head_)
+      tail_ = nullptr;
+  }
+  return nullptr;
+}
+
+void
+BufferedTransportImpl::freeOutput()
+{
+  while (head_) {
+    Block *block = head_;
+    head_ = block->next;
+    free(block);
+  }
+  tail_ = nullptr;
+  pending_output_ = 0;
+}
+
+size_t
+BufferedTransportImpl::freeRegions(struct iovec iov[2])
+{
+  size_t capacity = options_.inputCapacity;
+  size_t space = capacity - input_length_;
+  if (!space)
+    return 0;
+
+  size_t end = (input_start_ + input_length_) % capacity;
+  size_t first = ke::Min(space, capacity - end);
+  iov[0].iov_base = input_ + end;
+  iov[0].iov_len = first;
+  if (first == space)
+    return 1;
+
+  iov[1].iov_base = input_;
+  iov[1].iov_len = space - first;
+  return 2;
+}
+
+size_t
+BufferedTransportImpl::Peek(void *buffer, size_t maxlength)
+{
+  size_t capacity = options_.inputCapacity;
+  size_t count = ke::Min(maxlength, input_length_);
+  size_t first = ke::Min(count, capacity - input_start_);
+
+  char *out = reinterpret_cast<char *>(buffer);
+  memcpy(out, input_ + input_start_, first);
+  memcpy(out + first, input_, count - first);
+  return count;
+}
+
+void
+BufferedTransportImpl::Consume(size_t length)
+{
+  length = ke::Min(length, input_length_);
+  input_length_ -= length;
+
+  // Rewind an empty ring, so the next read is a single region.
+  if (!input_length_)
+    input_start_ = 0;
+  else
+    input_start_ = (input_start_ + length) % options_.inputCapacity;
+
+  if (reading_paused_ && input_length_ <= options_.lowWatermark)
+    resumeReading();
+}
+
+size_t
+BufferedTransportImpl::Read(void *buffer, size_t maxlength)
+{
+  size_t count = Peek(buffer, maxlength);
+  Consume(count);
+  return count;
+}
+
+void
+BufferedTransportImpl::pauseReading()
+{
+  if (Ref<IOError> error = dispatcher_->RemoveEvents(transport_, Events::Read)) {
+    closeWithError(error);
+    return;
+  }
+  reading_paused_ = true;
+}
+
+void
+BufferedTransportImpl::resumeReading()
+{
+  reading_paused_ = false;
+  if (!transport_ || input_ended_)
+    return;
+
+  // Reads are level-triggered, so anything that arrived while we were paused
+  // is reported on the next poll.
+  if (Ref<IOError> error = dispatcher_->AddEvents(transport_, Events::Read))
+    closeWithError(error);
+}
+
+void
+BufferedTransportImpl::OnReadReady()
+{
+  // Callbacks may close us and drop the last outside reference.
+  Ref<BufferedTransportImpl> self(this);
+
+  bool got_data = false;
+  bool ended = false;
+  Ref<IOError> error;
+  while (transport_ && !reading_paused_) {
+    struct iovec iov[2];
+    size_t count = freeRegions(iov);
+    assert(count);
+
+    IOResult r;
+    if (!transport_->ReadV(&r, iov, count)) {
+      error = r.error;
+      break;
+    }
+    if (!r.completed)
+      break;
+    if (r.ended) {
+      ended = true;
+      break;
+    }
+
+    input_length_ += r.bytes;
+    got_data = true;
+
+    if (input_length_ >= options_.highWatermark) {
+      pauseReading();
+      break;
+    }
+
+    // A short read means the transport is (probably) empty, so don't spend
+    // a system call finding out for sure.
+    if (r.bytes < iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0))
+      break;
+  }
+
+  if (got_data && listener_)
+    listener_->OnData();
+  if (error)
+    closeWithError(error);
+  else if (ended)
+    endOfStream();
+}
+
+void
+BufferedTransportImpl::endOfStream()
+{
+  if (!transport_)
+    return;
+
+  input_ended_ = true;
+  if (!head_) {
+    closeWithError(nullptr);
+    return;
+  }
+
+  // Reads would only report the end again, so listen for writes until the
+  // output chain is flushed.
+  if (Ref<IOError> error = dispatcher_->RemoveEvents(transport_, Events::Read))
+    closeWithError(error);
+}
+
+void
+BufferedTransportImpl::OnWriteReady()
+{
+  Ref<BufferedTransportImpl> self(this);
+
+  if (!transport_)
+    return;
+
+  if (Ref<IOError> error = flush()) {
+    closeWithError(error);
+    return;
+  }
+  if (head_)
+    return;
+
+  // Stop listening for write events, or a level-triggered poller would spin.
+  waiting_for_write_ = false;
+  if (Ref<IOError> error = dispatcher_->RemoveEvents(transport_, Events::Write)) {
+    closeWithError(error);
+    return;
+  }
+  if (listener_)
+    listener_->OnDrained();
+
+  // The listener may have queued more output in response.
+  if (input_ended_ && !head_)
+    closeWithError(nullptr);
+}
+
+void
+BufferedTransportImpl::OnHangup(Ref<IOError> error)
+{
+  Ref<BufferedTransportImpl> self(this);
+  closeWithError(error);
+}
+
+void
+BufferedTransportImpl::closeWithError(Ref<IOError> error)
+{
+  if (!transport_)
+    return;
+
+  Ref<BufferedListener> listener = listener_;
+  Close();
+  if (listener)
+    listener->OnClosed(error);
+}
+
+void
+BufferedTransportImpl::Close()
+{
+  if (!transport_)
+    return;
+
+  // Closing the transport also detaches it.
+  transport_->Close();
+  transport_ = nullptr;
+  listener_ = nullptr;
+  waiting_for_write_ = false;
+  freeOutput();
+}
@@ -0,0 +1,112 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_posix_buffered_transport_h_
+#define _include_amio_posix_buffered_transport_h_
+
+#include <amio-buffered.h>
+#include <am-refcounting.h>
+#include <am-utility.h>
+
+namespace amio {
+
+using namespace ke;
+
+class BufferedTransportImpl
+ : public BufferedTransport,
+   public StatusListener,
+   public ke::Refcounted<BufferedTransportImpl>
+{
+ public:
+  BufferedTransportImpl(Ref<IODispatcher> dispatcher,
+                        Ref<Transport> transport,
+                        Ref<BufferedListener> listener,
+                        const BufferedTransportOptions &options);
+  ~BufferedTransportImpl();
+
+  KE_IMPL_REFCOUNTING(BufferedTransportImpl);
+
+  PassRef<IOError> Initialize();
+
+  // BufferedTransport.
+  PassRef<IOError> Write(const void *data, size_t length) override;
+  size_t PendingOutput() override {
+    return pending_output_;
+  }
+  size_t Available() override {
+    return input_length_;
+  }
+  size_t Peek(void *buffer, size_t maxlength) override;
+  void Consume(size_t length) override;
+  size_t Read(void *buffer, size_t maxlength) override;
+  void Close() override;
+  bool Closed() override {
+    return !transport_;
+  }
+
+  // StatusListener.
+  void OnReadReady() override;
+  void OnWriteReady() override;
+  void OnHangup(Ref<IOError> error) override;
+
+ private:
+  // A block of queued output. Bytes in [start, end) have not been written.
+  struct Block
+  {
+    Block *next;
+    size_t start;
+    size_t end;
+    size_t capacity;
+
+    char *data() {
+      return reinterpret_cast<char *>(this + 1);
+    }
+  };
+
+  bool enqueue(const char *data, size_t length);
+  PassRef<IOError> flush();
+  void freeOutput();
+
+  // Fill |iov| with the free space in the ring, returning the number of
+  // regions used.
+  size_t freeRegions(struct iovec iov[2]);
+
+  void pauseReading();
+  void resumeReading();
+
+  // The peer has finished sending. Stop reading, and close once queued output
+  // has been written.
+  void endOfStream();
+
+  // Close the transport and notify the listener.
+  void closeWithError(Ref<IOError> error);
+
+ private:
+  Ref<IODispatcher> dispatcher_;
+  Ref<Transport> transport_;
+  Ref<BufferedListener> listener_;
+  BufferedTransportOptions options_;
+
+  // Input ring buffer.
+  AutoArray<char> input_;
+  size_t input_start_;
+  size_t input_length_;
+  bool reading_paused_;
+  bool input_ended_;
+
+  // Output chain.
+  Block *head_;
+  Block *tail_;
+  size_t pending_output_;
+  bool waiting_for_write_;
+};
+
+} // namespace amio
+
+#endif // _include_amio_posix_buffered_transport_h_
@@ -9,19 +9,34 @@
 //
 #include "posix-event-loop.h"
 #include "posix-event-queue.h"
+#include "posix-base-poller.h"
+#include "../shared/shared-task-batch.h"
+#if defined(__linux__)
+# include <sys/eventfd.h>
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 using namespace ke;
 using namespace amio;
 
 PassRef<IOError>
 EventLoopForIO::Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller)
+{
+  return Create(outp, poller, EventLoopOptions());
+}
+
+PassRef<IOError>
+EventLoopForIO::Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller,
+                       const EventLoopOptions &options)
 {
   if (!poller) {
     if (Ref<IOError> error = PollerFactory::Create(&poller))
       return error;
   }
 
-  Ref<PosixEventLoopForIO> pump(new PosixEventLoopForIO(poller));
+  Ref<PosixEventLoopForIO> pump(new PosixEventLoopForIO(poller, options));
   if (Ref<IOError> error = pump->Initialize())
     return error;
 
@@ -29,12 +44,17 @@ EventLoopForIO::Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller)
   return nullptr;
 }
 
-PosixEventLoopForIO::PosixEventLoopForIO(Ref<Poller> poller)
+PosixEventLoopForIO::PosixEventLoopForIO(Ref<Poller> poller, const EventLoopOptions &options)
  : poller_(poller),
-   received_wakeup_(false)
+   options_(options),
+   use_eventfd_(false),
+   now_(HighResolutionTimer::Counter()),
+   wakeup_events_(0),
+   parked_(0)
 {
   assert(poller_);
-  tasks_ = new TaskQueueImpl(this);
+  tasks_ = new TaskQueueImpl(this, options.taskQueueCapacity);
+  timers_ = new TimerQueue(this);
   wakeup_ = new Wakeup(this);
   event_queue_ = new EventQueueImpl(poller_);
 }
@@ -47,25 +67,71 @@ PosixEventLoopForIO::~PosixEventLoopForIO()
 Ref<IOError>
 PosixEventLoopForIO::Initialize()
 {
-  if (Ref<IOError> error = TransportFactory::CreatePipe(&read_pipe_, &write_pipe_))
+  if (Ref<IOError> error = createWakeup())
     return error;
 
-  // The read pipe is level-triggered so that we don't have to read the entire
-  // pipe on each poll, but the write pipe is edge-triggered so we don't wakeup
-  // spuriously.
-  if (Ref<IOError> error = poller_->Attach(read_pipe_, wakeup_, Events::Read, EventMode::Level))
-    return error;
-  if (Ref<IOError> error = poller_->Attach(write_pipe_, wakeup_, Events::Write, EventMode::ETS))
+  // The reader is level-triggered so a wakeup can't be lost. The write end
+  // of a pipe is edge-triggered so we don't wakeup spuriously.
+  if (Ref<IOError> error = poller_->Attach(wakeup_reader_, wakeup_, Events::Read, EventMode::Level))
     return error;
+  if (!use_eventfd_) {
+    if (Ref<IOError> error = poller_->Attach(wakeup_writer_, wakeup_, Events::Write, EventMode::ETS))
+      return error;
+  }
   return nullptr;
 }
 
+Ref<IOError>
+PosixEventLoopForIO::createWakeup()
+{
+#if defined(__linux__) && defined(EFD_NONBLOCK)
+  // An eventfd is a single descriptor with an 8-byte counter, so any number
+  // of wakeups can be consumed with one read.
+  int fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (fd != -1) {
+    if (Ref<IOError> error = TransportFactory::CreateFromDescriptor(&wakeup_reader_, fd)) {
+      close(fd);
+      return error;
+    }
+    wakeup_writer_ = wakeup_reader_;
+    use_eventfd_ = true;
+    return nullptr;
+  }
+#endif
+
+  return TransportFactory::CreatePipe(&wakeup_reader_, &wakeup_writer_);
+}
+
 void
 PosixEventLoopForIO::PostTask(Task *task)
 {
   tasks_->PostTask(task);
 }
 
+void
+PosixEventLoopForIO::PostTask(Task *task, TaskPriority priority)
+{
+  tasks_->PostTask(task, priority);
+}
+
+bool
+PosixEventLoopForIO::TryPostTask(Task *task, TaskPriority priority)
+{
+  return tasks_->TryPostTask(task, priority);
+}
+
+void
+PosixEventLoopForIO::GetTaskQueueStats(TaskQueueStats *stats)
+{
+  tasks_->GetStats(stats);
+}
+
+PassRef<Timer>
+PosixEventLoopForIO::PostDelayedTask(Task *task, int64_t delayNs)
+{
+  return timers_->PostDelayedTask(task, delayNs);
+}
+
 void
 PosixEventLoopForIO::PostQuit()
 {
@@ -83,24 +149,70 @@ PosixEventLoopForIO::Loop()
 {
   AutoDisableSigPipe disable_sigpipe;
 
+  now_ = HighResolutionTimer::Counter();
   while (!ShouldQuit()) {
-    // If this starves the event loop, we have bigger problems.
-    if (tasks_->ProcessNextTask())
-      continue;
+    LoopIterationStats stats;
 
-    // Reset the received_wakeup_ flag before entering Poll(), so we can tell
-    // whether or not we woke up due to needing another task.
-    received_wakeup_ = false;
+    // Run a batch of tasks. If the batch was cut short, we still check for
+    // I/O, but without blocking, so a flood of tasks can't starve transports.
+    bool more = RunTaskBatch(tasks_, timers_, options_, now_, &stats);
+    if (ShouldQuit())
+      break;
 
-    if (Ref<IOError> error = poller_->Poll()) {
+    // With direct dispatch, listeners run inside Poll(), so the only way to
+    // know whether there was I/O is to ask the poller how many it dispatched.
+    PosixPoller *poller = static_cast<PosixPoller *>(*poller_);
+    size_t dispatched = poller->NumEventsDispatched();
+    size_t wakeups = wakeup_events_;
+
+    Ref<IOError> error;
+    if (more) {
+      error = poller_->PollNs(0);
+    } else {
+      // Announce that we're going to sleep before making the final checks for
+      // work. Anyone who posts after this point will see that we're parked
+      // and wake us up; anyone who posted before will be seen by the checks.
+      __atomic_store_n(&parked_, 1, __ATOMIC_SEQ_CST);
+
+      // Sleep until the next timer is due. Timers posted from other threads
+      // while we're asleep will wake us up if they're due sooner.
+      int64_t timeout = timers_->PrepareToWait();
+      if (ShouldQuit() ||
+          tasks_->HasPendingTasks() ||
+          tasks_->HasIdleTasks() ||
+          event_queue_->HasPendingEvents())
+      {
+        timeout = 0;
+      }
+      stats.waited = (timeout != 0);
+
+      error = poller_->PollNs(timeout);
+      timers_->FinishWait();
+      __atomic_store_n(&parked_, 0, __ATOMIC_SEQ_CST);
+    }
+    now_ = HighResolutionTimer::Counter();
+
+    if (error) {
       fprintf(stderr, "Could not poll: %s\n", error->Message());
-      continue;
+    } else if (options_.directDispatch) {
+      dispatched = poller->NumEventsDispatched() - dispatched;
+      wakeups = wakeup_events_ - wakeups;
+      stats.events = (dispatched > wakeups) ? dispatched - wakeups : 0;
+    } else {
+      // The wakeup transport is attached to the poller directly, so anything
+      // queued here is a real event. Events get the same count limit as
+      // tasks; any left over stay queued for the next iteration.
+      size_t limit = options_.maxTasksPerIteration;
+      while ((!limit || stats.events < limit) && event_queue_->DispatchNextEvent())
+        stats.events++;
     }
 
-    if (received_wakeup_)
-      continue;
+    // Idle tasks only run if the loop had nothing else to do.
+    if (!error && !more && !stats.events && !tasks_->HasPendingTasks())
+      RunIdleBatch(tasks_, options_, &stats);
 
-    event_queue_->DispatchEvents();
+    if (options_.observer)
+      options_.observer->OnLoopIteration(stats);
   }
 }
 
@@ -109,37 +221,53 @@ PosixEventLoopForIO::Wakeup::OnReadReady()
 {
   if (!parent_)
     return;
+  parent_->wakeup_events_++;
   parent_->OnWakeup();
 }
 
+void
+PosixEventLoopForIO::Wakeup::OnWriteReady()
+{
+  // The write end of a wakeup pipe reports once when it's attached.
+  if (parent_)
+    parent_->wakeup_events_++;
+}
+
 void
 PosixEventLoopForIO::OnWakeup()
 {
-  char buffer[1] = {0};
-  IOResult r;
-  if (!read_pipe_->Read(&r, buffer, sizeof(buffer)))
-    fprintf(stderr, "Could not read after wakeup: %s\n", r.error->Message());
+  // Drain everything that's been written, so we don't wake up again for
+  // wakeups that have already been handled. An eventfd is drained by a single
+  // read of its counter.
+  char buffer[64];
+  size_t length = use_eventfd_ ? sizeof(uint64_t) : sizeof(buffer);
+  while (true) {
+    IOResult r;
+    if (!wakeup_reader_->Read(&r, buffer, length)) {
+      fprintf(stderr, "Could not read after wakeup: %s\n", r.error->Message());
+      break;
+    }
+    if (use_eventfd_ || r.bytes < length)
+      break;
+  }
 
-  // We attach the pipe directly to the poller, not to the event queue, so
-  // we don't need to do anything here other than tell our caller that a
-  // new task is available (rather than test the waters by calling
-  // ProcessNextTask()).
-  received_wakeup_ = true;
+  // We attach the wakeup directly to the poller, not to the event queue, so
+  // there's nothing else to do. The loop will see the new task.
 }
 
 void
 PosixEventLoopForIO::NotifyTask()
 {
-  // If for some reason the pipe failed to write, but the reader is empty,
-  // we'll still wake up the event loop via OnWriteReady().
-  char buffer[1] = {0};
-  IOResult r;
-  if (!write_pipe_->Write(&r, buffer, sizeof(buffer)))
-    fprintf(stderr, "Could not wakeup: %s\n", r.error->Message());
-
-  // Tell the event dispatcher to stop. This can race and miss the opportunity
-  // to break, but that's fine. It's more of a warning shot than anything.
-  event_queue_->Break();
+  // Only write if the loop is parked, and only once per park. Otherwise, the
+  // loop is awake and will check for tasks before it sleeps again.
+  if (__atomic_exchange_n(&parked_, 0, __ATOMIC_SEQ_CST)) {
+    // If for some reason the pipe failed to write, but the reader is empty,
+    // we'll still wake up the event loop via OnWriteReady().
+    uint64_t value = 1;
+    IOResult r;
+    if (!wakeup_writer_->Write(&r, &value, use_eventfd_ ? sizeof(value) : 1))
+      fprintf(stderr, "Could not wakeup: %s\n", r.error->Message());
+  }
 }
 
 void
@@ -151,13 +279,18 @@ PosixEventLoopForIO::NotifyQuit()
 PassRef<IOError>
 PosixEventLoopForIO::Attach(Ref<Transport> transport, Ref<StatusListener> listener, Events events, EventMode mode)
 {
+  if (options_.directDispatch)
+    return poller_->Attach(transport, listener, events, mode);
   return event_queue_->Attach(transport, listener, events, mode);
 }
 
 void
 PosixEventLoopForIO::Detach(Ref<Transport> transport)
 {
-  event_queue_->Detach(transport);
+  if (options_.directDispatch)
+    poller_->Detach(transport);
+  else
+    event_queue_->Detach(transport);
 }
 
 PassRef<IOError>
@@ -178,6 +311,21 @@ PosixEventLoopForIO::RemoveEvents(Ref<Transport> transport, Events events)
   return event_queue_->RemoveEvents(transport, events);
 }
 
+size_t
+PosixEventLoopForIO::NumTransports()
+{
+  // Callers on other threads must not race with Shutdown().
+  if (!event_queue_)
+    return 0;
+  if (!options_.directDispatch)
+    return event_queue_->NumDelegates();
+
+  // Don't count the wakeup transports.
+  size_t wakeups = use_eventfd_ ? 1 : 2;
+  size_t count = static_cast<PosixPoller *>(*poller_)->NumTransports();
+  return count > wakeups ? count - wakeups : 0;
+}
+
 void
 PosixEventLoopForIO::Shutdown()
 {
@@ -185,11 +333,13 @@ PosixEventLoopForIO::Shutdown()
     return;
 
   wakeup_->disable();
-  write_pipe_->Close();
-  read_pipe_->Close();
+  wakeup_writer_->Close();
+  wakeup_reader_->Close();
   event_queue_->Shutdown();
+  timers_->Shutdown();
 
-  // Zap these so they destroy right away.
+  // Zap these so they destroy right away. The timer queue is kept, since
+  // once shut down it frees any delayed tasks that are still posted.
   event_queue_ = nullptr;
   tasks_ = nullptr;
   poller_ = nullptr;
@@ -13,18 +13,22 @@
 #include <amio-eventloop.h>
 #include "posix-event-queue.h"
 #include "../shared/shared-task-queue.h"
+#include "../shared/shared-timers.h"
 
 namespace amio {
 
 using namespace ke;
 
+// Other threads wake the event loop by writing to an eventfd on Linux, or to a
+// pipe elsewhere. Wakeups are only sent while the loop is parked in Poll();
+// if the loop is busy, it will see new tasks before it next goes to sleep.
 class PosixEventLoopForIO
  : public EventLoopForIO,
    public TaskQueue::Delegate,
    public ke::Refcounted<PosixEventLoopForIO>
 {
  public:
-  PosixEventLoopForIO(Ref<Poller> poller);
+  PosixEventLoopForIO(Ref<Poller> poller, const EventLoopOptions &options);
   ~PosixEventLoopForIO();
 
   KE_IMPL_REFCOUNTING(PosixEventLoopForIO);
@@ -32,8 +36,16 @@ class PosixEventLoopForIO
   Ref<IOError> Initialize();
 
  public:
+  using EventLoop::PostTask;
   void PostTask(Task *task) override;
+  void PostTask(Task *task, TaskPriority priority) override;
+  bool TryPostTask(Task *task, TaskPriority priority) override;
+  void GetTaskQueueStats(TaskQueueStats *stats) override;
+  PassRef<Timer> PostDelayedTask(Task *task, int64_t delayNs) override;
   void PostQuit() override;
+  int64_t Now() override {
+    return now_;
+  }
   bool ShouldQuit() override;
   void Loop() override;
   void NotifyTask() override;
@@ -50,8 +62,10 @@ class PosixEventLoopForIO
   PassRef<Poller> GetPoller() override {
     return poller_;
   }
+  size_t NumTransports() override;
 
  private:
+  Ref<IOError> createWakeup();
   void OnWakeup();
 
  private:
@@ -67,6 +81,7 @@ class PosixEventLoopForIO
     KE_IMPL_REFCOUNTING(Wakeup);
 
     void OnReadReady() override;
+    void OnWriteReady() override;
 
     void disable() {
       parent_ = nullptr;
@@ -77,13 +92,27 @@ class PosixEventLoopForIO
   };
 
  private:
-  Ref<Poller> poller_;	
+  Ref<Poller> poller_;
+  EventLoopOptions options_;
   AutoPtr<TaskQueueImpl> tasks_;
-  Ref<Transport> read_pipe_;
-  Ref<Transport> write_pipe_;
+  Ref<TimerQueue> timers_;
+  Ref<Transport> wakeup_reader_;
+  Ref<Transport> wakeup_writer_;
+  bool use_eventfd_;
   Ref<Wakeup> wakeup_;
   Ref<EventQueueImpl> event_queue_;
-  volatile bool received_wakeup_;
+
+  // The loop's cached clock, updated once per iteration after polling.
+  int64_t now_;
+
+  // Poller events that went to the wakeup transports. These are subtracted
+  // from the poller's dispatch count, since they aren't I/O for listeners.
+  // Only accessed from the loop thread.
+  size_t wakeup_events_;
+
+  // Non-zero while the loop is (about to be) blocked in Poll(). Accessed with
+  // atomic builtins; the first thread to clear it sends the wakeup.
+  int parked_;
 };
 
 } // namespace amio
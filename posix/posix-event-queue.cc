@@ -8,6 +8,7 @@
 // License, version 3 or higher. For more information, see LICENSE.txt
 //
 #include "posix-event-queue.h"
+#include <amio-time.h>
 
 using namespace ke;
 using namespace amio;
@@ -19,9 +20,10 @@ EventQueue::Create(Ref<Poller> poller)
 }
 
 EventQueueImpl::EventQueueImpl(Ref<Poller> poller)
- : poller_(poller)
+ : poller_(poller),
+   num_delegates_(0),
+   got_break_(false)
 {
-  tasks_ = new TaskQueueImpl(nullptr);
 }
 
 EventQueueImpl::~EventQueueImpl()
@@ -35,18 +37,22 @@ EventQueueImpl::Shutdown()
   if (!poller_)
     return;
 
+  // Drop any undispatched events, so each detach below removes its delegate
+  // right away.
+  while (!ready_.empty()) {
+    Delegate *delegate = static_cast<Delegate *>(*ready_.begin());
+    ready_.remove(delegate);
+    delegate->events_ &= ~Events::Queued;
+  }
+
   while (true) {
     InlineList<Delegate>::iterator first = delegates_.begin();
     if (first == delegates_.end())
       break;
-
-    // Force the status to be dequeued.
-    first->events_ &= ~Events::Queued;
     poller_->Detach(first->transport_);
   }
 
   poller_ = nullptr;
-  tasks_ = nullptr;
 }
 
 PassRef<IOError>
@@ -57,7 +63,10 @@ EventQueueImpl::Attach(Ref<Transport> transport, Ref<StatusListener> listener,
   if (Ref<IOError> error = poller_->Attach(transport, delegate, events, mode|EventMode::Proxy))
     return error;
 
+  // This reference is dropped in remove_delegate().
+  delegate->AddRef();
   delegates_.append(delegate);
+  __atomic_store_n(&num_delegates_, num_delegates_ + 1, __ATOMIC_RELAXED);
   return nullptr;
 }
 
@@ -105,31 +114,106 @@ EventQueueImpl::RemoveEvents(Ref<Transport> transport, Events events)
 void
 EventQueueImpl::remove_delegate(Delegate *delegate)
 {
+  if ((delegate->events_ & Events::Queued) == Events::Queued)
+    ready_.remove(delegate);
+
   delegates_.remove(delegate);
+  __atomic_store_n(&num_delegates_, num_delegates_ - 1, __ATOMIC_RELAXED);
   delegate->transport_ = nullptr;
   delegate->forward_ = nullptr;
   delegate->parent_ = nullptr;
 
-  // If we're inside Delegate::Run(), make sure we don't try to double-remove.
+  // If we're inside Delegate::Dispatch(), make sure we don't try to
+  // double-remove, and keep the delegate alive until it returns.
   delegate->events_ = Events::None;
+  if (delegate->dispatch_depth_)
+    delegate->release_pending_ = true;
+  else
+    delegate->Release();
 }
 
 bool
 EventQueueImpl::DispatchNextEvent()
 {
-  return tasks_->ProcessNextTask();
+  if (ready_.empty())
+    return false;
+
+  Delegate *delegate = static_cast<Delegate *>(*ready_.begin());
+  ready_.remove(delegate);
+
+  // Clear the queue flag first, so callbacks can requeue the delegate.
+  delegate->events_ &= ~Events::Queued;
+
+  delegate->dispatch_depth_++;
+  delegate->Dispatch();
+  if (--delegate->dispatch_depth_ == 0 && delegate->release_pending_)
+    delegate->Release();
+  return true;
 }
 
 bool
 EventQueueImpl::DispatchEvents(struct timeval *timelimitp, size_t nlimit)
 {
-  return tasks_->ProcessTasks(timelimitp, nlimit);
+  if (timelimitp)
+    return DispatchEventsForTime(timelimitp, nlimit);
+
+  if (!DispatchNextEvent())
+    return false;
+
+  got_break_ = false;
+
+  size_t count = 0;
+  do {
+    if (nlimit && (++count >= nlimit))
+      break;
+  } while (!got_break_ && DispatchNextEvent());
+
+  return true;
+}
+
+bool
+EventQueueImpl::DispatchEventsForTime(struct timeval *timelimitp, size_t nlimit)
+{
+  int64_t resolution = HighResolutionTimer::Resolution();
+  if (!resolution) {
+    // Process one event and then leave. It's too risky to use timers.
+    return DispatchNextEvent();
+  }
+
+  if (!DispatchNextEvent())
+    return false;
+
+  got_break_ = false;
+
+  int64_t maxtime = (timelimitp->tv_sec * kNanosecondsPerSecond) +
+                    (timelimitp->tv_usec * kNanosecondsPerMicrosecond);
+  maxtime -= maxtime % resolution;
+
+  int64_t start = HighResolutionTimer::FastCounter();
+  int64_t end = start + maxtime;
+  int64_t last = start;
+
+  size_t count = 0;
+  do {
+    int64_t now = HighResolutionTimer::FastCounter();
+    if (now >= end || got_break_)
+      break;
+    if (nlimit && ++count >= nlimit)
+      break;
+
+    // Make sure we don't iloop due to timer bugs.
+    if (now < last)
+      break;
+    last = now;
+  } while (DispatchNextEvent());
+
+  return true;
 }
 
 void
 EventQueueImpl::Break()
 {
-  tasks_->Break();
+  got_break_ = true;
 }
 
 void
@@ -140,11 +224,8 @@ EventQueueImpl::Delegate::MaybeEnqueue()
 
   assert(parent_);
 
-  // Note: Manually add a ref for while we're sitting in the task queue. We've
-  // overridden DeleteMe() to drop this ref.
-  this->AddRef();
   events_ |= Events::Queued;
-  parent_->tasks_->PostTask(this);
+  parent_->ready_.append(this);
 }
 
 void
@@ -169,6 +250,23 @@ EventQueueImpl::Delegate::OnHangup(Ref<IOError> error)
   MaybeEnqueue();
 }
 
+void
+EventQueueImpl::Delegate::OnZeroCopyComplete(uint32_t first, uint32_t last, bool copied)
+{
+  // If any send in the range was copied, report the whole range as copied;
+  // it's only a hint.
+  if (zerocopy_pending_) {
+    zerocopy_last_ = last;
+    zerocopy_copied_ |= copied;
+  } else {
+    zerocopy_pending_ = true;
+    zerocopy_copied_ = copied;
+    zerocopy_first_ = first;
+    zerocopy_last_ = last;
+  }
+  MaybeEnqueue();
+}
+
 void
 EventQueueImpl::Delegate::OnProxyDetach()
 {
@@ -202,16 +300,17 @@ EventQueueImpl::Delegate::OnChangeEvents(Events new_events)
   events_ &= ~(new_events & (Events::Read|Events::Write));
 }
 
-void 
-EventQueueImpl::Delegate::Run()
+void
+EventQueueImpl::Delegate::Dispatch()
 {
-  // Remove the queue flag.
-  events_ &= ~Events::Queued;
+  // Detach() removes delegates from the ready list, so we still have a parent.
+  assert(parent_);
 
-  // If we were enqueued while Detach() was called, we may no longer have a
-  // parent.
-  if (!parent_)
-    return;
+  // Release buffers first, since the read and write handlers may want them.
+  if (zerocopy_pending_) {
+    zerocopy_pending_ = false;
+    forward_->OnZeroCopyComplete(zerocopy_first_, zerocopy_last_, zerocopy_copied_);
+  }
 
   if ((events_ & Events::Read) == Events::Read)
     forward_->OnReadReady();
@@ -221,6 +320,9 @@ EventQueueImpl::Delegate::Run()
   if (!!(events_ & (Events::Detached|Events::Hangup))) {
     if ((events_ & Events::Hangup) == Events::Hangup)
       forward_->OnHangup(error_);
-    parent_->remove_delegate(this);
+
+    // The hangup callback may have detached us already.
+    if (parent_)
+      parent_->remove_delegate(this);
   }
 }
@@ -12,12 +12,16 @@
 
 #include <amio-eventloop.h>
 #include <am-inlinelist.h>
-#include "../shared/shared-task-queue.h"
 
 namespace amio {
 
 using namespace ke;
 
+// Status changes from the poller are recorded in the transport's delegate,
+// and the delegate is linked into an intrusive ready list. Dispatching walks
+// the list in FIFO order and forwards each delegate's pending events in one
+// go, so a readiness event costs a few pointer writes rather than a task
+// post.
 class EventQueueImpl
  : public EventQueue,
    public ke::Refcounted<EventQueueImpl>
@@ -40,11 +44,25 @@ class EventQueueImpl
   PassRef<IOError> AddEvents(Ref<Transport> transport, Events events) override;
   PassRef<IOError> RemoveEvents(Ref<Transport> transport, Events events) override;
 
+  // Returns whether events are queued but not yet dispatched.
+  bool HasPendingEvents() {
+    return !ready_.empty();
+  }
+
+  // Only the owning thread changes the count, but anyone may read it.
+  size_t NumDelegates() const {
+    return __atomic_load_n(&num_delegates_, __ATOMIC_RELAXED);
+  }
+
  private:
+  // Links a delegate into the ready list; delegates_ uses the other node.
+  class ReadyLink : public InlineListNode<ReadyLink>
+  {};
+
   class Delegate
    : public StatusListener,
-     public Task,
      public InlineListNode<Delegate>,
+     public ReadyLink,
      public ke::Refcounted<Delegate>
   {
     friend class EventQueueImpl;
@@ -54,25 +72,28 @@ class EventQueueImpl
      : parent_(parent),
        transport_(transport),
        forward_(forward),
-       events_(Events::None)
+       events_(Events::None),
+       zerocopy_pending_(false),
+       zerocopy_copied_(false),
+       zerocopy_first_(0),
+       zerocopy_last_(0),
+       dispatch_depth_(0),
+       release_pending_(false)
     {}
 
     KE_IMPL_REFCOUNTING(Delegate);
 
-    void Run() override;
-    void DeleteMe() override {
-      Release();
-    }
-
     void OnReadReady() override;
     void OnWriteReady() override;
     void OnHangup(Ref<IOError> error) override;
+    void OnZeroCopyComplete(uint32_t first, uint32_t last, bool copied) override;
     void OnProxyDetach() override;
     void OnChangeProxy(Ref<StatusListener> new_listener) override;
     void OnChangeEvents(Events events) override;
 
    private:
     void MaybeEnqueue();
+    void Dispatch();
 
    private:
     EventQueueImpl *parent_; // Not Ref<>, this would form cycles.
@@ -80,15 +101,34 @@ class EventQueueImpl
     Ref<StatusListener> forward_;
     Events events_;
     Ref<IOError> error_;
+
+    // Zero-copy completions cover consecutive ids in order, so everything
+    // reported since the last dispatch merges into one range.
+    bool zerocopy_pending_;
+    bool zerocopy_copied_;
+    uint32_t zerocopy_first_;
+    uint32_t zerocopy_last_;
+
+    // The queue's reference is dropped when the delegate is removed, unless
+    // the delegate is being dispatched; then it is dropped afterward.
+    size_t dispatch_depth_;
+    bool release_pending_;
   };
 
  private:
   void remove_delegate(Delegate *delegate);
+  bool DispatchEventsForTime(struct timeval *timelimitp, size_t nlimit);
 
  private:
   Ref<Poller> poller_;
-  AutoPtr<TaskQueueImpl> tasks_;
+
+  // Every attached delegate. The queue holds a reference to each.
   InlineList<Delegate> delegates_;
+  size_t num_delegates_;
+
+  // Delegates with undispatched events; these have Events::Queued set.
+  InlineList<ReadyLink> ready_;
+  volatile bool got_break_;
 };
 
 } // namespace amio
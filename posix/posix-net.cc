@@ -379,7 +379,7 @@ amio::net::ConnectTo(Ref<Connection> *outp, Protocol protocol, Ref<Address> addr
 
 class PosixServer
  : public Server,
-   public StatusListener,
+   public CompletionListener,
    public ke::RefcountedThreadsafe<PosixServer>
 {
  public:
@@ -449,21 +449,34 @@ class PosixServer
         return;
       }
 
-      // Wrap the new conection in a transport.
-      Ref<PosixConnection> conn;
-      if (Ref<IOError> error = ConnectionForSocket(&conn, rv, address_->Family())) {
-        listener_->OnError(error, Severity::Warning);
-        return;
-      }
-      if (Ref<IOError> error = conn->Setup()) {
-        listener_->OnError(error, Severity::Warning);
-        return;
-      }
-
       // If the user wants more connections, loop back. Otherwise, we return.
       // Since we're level-triggered here we'll accept more connections next
       // poll.
-      if (listener_->Accept(conn) == Action::DeferNext)
+      if (accepted(rv) == Action::DeferNext)
+        return;
+    }
+  }
+
+  // In completion mode, the poller accepts connections for us. There is no
+  // way to defer them, so the listener's action is ignored.
+  void OnAccept(int fd) override {
+    accepted(fd);
+  }
+  void OnAcceptError(Ref<IOError> error) override {
+    switch (error->ErrorCode()) {
+      case EBADF:
+      case EINVAL:
+        Close();
+        listener_->OnError(error, Severity::Fatal);
+        return;
+      case EMFILE:
+      case ENFILE:
+      case ENOBUFS:
+      case ENOMEM:
+        listener_->OnError(error, Severity::Severe);
+        return;
+      default:
+        listener_->OnError(error, Severity::Warning);
         return;
     }
   }
@@ -485,6 +498,21 @@ class PosixServer
     closing_ = true;
   }
 
+ private:
+  Action accepted(int fd) {
+    // Wrap the new conection in a transport.
+    Ref<PosixConnection> conn;
+    if (Ref<IOError> error = ConnectionForSocket(&conn, fd, address_->Family())) {
+      listener_->OnError(error, Severity::Warning);
+      return Action::DeferNext;
+    }
+    if (Ref<IOError> error = conn->Setup()) {
+      listener_->OnError(error, Severity::Warning);
+      return Action::DeferNext;
+    }
+    return listener_->Accept(conn);
+  }
+
  private:
   Ref<PosixTransport> transport_;
   Ref<Server::Listener> listener_;
@@ -497,7 +525,7 @@ Server::Create(Ref<Server> *outp,
                Ref<IODispatcher> dispatcher,
                Ref<Address> address, Protocol protocol,
                Ref<Server::Listener> listener,
-               unsigned backlog)
+               const ServerOptions &options)
 {
   switch (protocol) {
     case Protocol::TCP:
@@ -506,8 +534,7 @@ Server::Create(Ref<Server> *outp,
     default:
       return eUnsupportedProtocol;
   }
-  if (!backlog)
-    backlog = SOMAXCONN;
+  unsigned backlog = options.backlog ? options.backlog : SOMAXCONN;
 
   Ref<PosixTransport> transport;
   if (Ref<IOError> error = SocketForAddress(&transport, address->Family(), protocol))
@@ -526,8 +553,13 @@ Server::Create(Ref<Server> *outp,
   if (getsockname(transport->fd(), buf, &buflen) == -1)
     return new PosixError();
 
+  // If asked, and the dispatcher can accept connections itself, let it.
+  EventMode mode = (options.acceptInDispatcher && dispatcher->SupportsCompletionMode())
+                   ? EventMode::Completion
+                   : EventMode::Level;
+
   Ref<PosixServer> server = new PosixServer(transport, listener, local);
-  if (Ref<IOError> error = dispatcher->Attach(transport, server, Events::Read, EventMode::Level))
+  if (Ref<IOError> error = dispatcher->Attach(transport, server, Events::Read, mode))
     return error;
 
   *outp = server;
@@ -25,6 +25,10 @@ using namespace amio;
 
 static const size_t kInitialPollSize = 4096;
 
+// Number of pollfd entries whose revents are tested together when looking
+// for the next ready descriptor.
+static const size_t kScanBlockSize = 8;
+
 PollImpl::PollImpl()
  : generation_(0),
    tmp_buffer_len_(0)
@@ -73,24 +77,16 @@ PollImpl::attach_locked(PosixTransport *transport, StatusListener *listener, Tra
   }
   assert(size_t(transport->fd()) < fds_.length());
 
-  int defaultEvents = POLLERR | POLLHUP;
-#if defined(__linux__)
-  if (can_use_rdhup_)
-    defaultEvents |= POLLRDHUP;
-#endif
-
-  size_t slot;
+  // Note that we always append, rather than fill a hole. Holes are only
+  // filled by compact_locked(), so slot indices stay stable while events are
+  // being dispatched.
+  size_t slot = poll_events_.length();
   struct pollfd pe;
   pe.fd = transport->fd();
-  pe.events = defaultEvents;
-  if (free_slots_.empty()) {
-    slot = poll_events_.length();
-    if (!poll_events_.append(pe))
-      return eOutOfMemory;
-  } else {
-    slot = free_slots_.popCopy();
-    poll_events_[slot] = pe;
-  }
+  pe.events = POLLERR | POLLHUP;
+  pe.revents = 0;
+  if (!poll_events_.append(pe))
+    return eOutOfMemory;
   poll_ctl(slot, flags);
 
   transport->attach(this, listener);
@@ -112,9 +108,10 @@ PollImpl::detach_locked(PosixTransport *transport)
   assert(poll_events_[slot].fd == fd);
 
   poll_events_[slot].fd = -1;
+  poll_events_[slot].events = 0;
   fds_[fd].transport = nullptr;
   fds_[fd].modified = generation_;
-  free_slots_.append(slot);
+  holes_.append(slot);
 
   return transport->detach();
 }
@@ -137,6 +134,57 @@ PollImpl::poll_ctl(size_t slot, TransportFlags flags)
     poll_events_[slot].events |= POLLIN;
   if (flags & kTransportWriting)
     poll_events_[slot].events |= POLLOUT;
+#if defined(__linux__)
+  poll_events_[slot].events &= ~POLLRDHUP;
+  if (can_use_rdhup_ && ReportsReadHangup(flags))
+    poll_events_[slot].events |= POLLRDHUP;
+#endif
+}
+
+void
+PollImpl::compact_locked()
+{
+  // Fill each hole with the last live entry, dropping trailing holes as we
+  // go. This is O(holes), rather than O(slots).
+  size_t length = poll_events_.length();
+  for (size_t i = 0; i < holes_.length(); i++) {
+    while (length > 0 && poll_events_[length - 1].fd == -1)
+      length--;
+
+    size_t hole = holes_[i];
+    if (hole >= length)
+      continue;
+
+    struct pollfd &last = poll_events_[length - 1];
+    fds_[last.fd].transport->setUserData(hole);
+    poll_events_[hole] = last;
+    length--;
+  }
+  holes_.clear();
+
+  while (poll_events_.length() > length)
+    poll_events_.pop();
+}
+
+// Return the index of the first entry at or after |start| with a non-zero
+// revents field, or |length| if there is none. Entries are OR'd together a
+// block at a time, which the compiler can turn into vector loads, so long
+// runs of idle descriptors do not cost a branch each.
+static inline size_t
+FindNextReady(const struct pollfd *buffer, size_t start, size_t length)
+{
+  size_t i = start;
+  while (i + kScanBlockSize <= length) {
+    int revents = 0;
+    for (size_t j = 0; j < kScanBlockSize; j++)
+      revents |= buffer[i + j].revents;
+    if (revents)
+      break;
+    i += kScanBlockSize;
+  }
+  while (i < length && !buffer[i].revents)
+    i++;
+  return i;
 }
 
 template <int inFlag, TransportFlags outFlag>
@@ -144,14 +192,20 @@ inline void
 PollImpl::handleEvent(size_t event_idx, int fd)
 {
   Ref<PosixTransport> transport = fds_[fd].transport;
-  if (transport->flags() & kTransportLT) {
+  if (transport->flags() & kTransportOneShot) {
+    // Ignore if disarmed; otherwise, disarm everything.
+    if (!(transport->flags() & outFlag))
+      return;
+    transport->flags() &= ~kTransportEventMask;
+    poll_ctl(event_idx, transport->flags());
+  } else if (transport->flags() & kTransportLT) {
     // Ignore - the event's been changed.
     if (!(transport->flags() & outFlag))
       return;
   } else {
     // Unset to emulate edge-triggered behavior.
-    poll_events_[event_idx].events &= ~inFlag;
     transport->flags() &= ~outFlag;
+    poll_ctl(event_idx, transport->flags());
   }
 
   // We must hold the listener in a ref, since if the transport is detached
@@ -168,7 +222,7 @@ PollImpl::handleEvent(size_t event_idx, int fd)
 }
 
 PassRef<IOError>
-PollImpl::Poll(int timeoutMs)
+PollImpl::PollNs(int64_t timeoutNs)
 {
   // We acquire a lock specifically for Poll(), to make sure it isn't called on
   // any thread or within callbacks.
@@ -176,29 +230,39 @@ PollImpl::Poll(int timeoutMs)
 
   size_t poll_buffer_len;
   struct pollfd *poll_buffer;
-  if (lock_) {
-    // We need to the copy poll buffer; otherwise, we could mutate the buffer
-    // while poll() is operating, and locking over poll() could trivially lead
-    // to deadlocks.
+  {
     AutoMaybeLock lock(lock_);
 
-    if (tmp_buffer_len_ < poll_events_.length()) {
-      struct pollfd *new_buffer = new struct pollfd[poll_events_.length()];
-      if (!new_buffer)
-        return eOutOfMemory;
-      tmp_buffer_ = new_buffer;
-      tmp_buffer_len_ = poll_events_.length();
-      memcpy(tmp_buffer_, poll_events_.buffer(), sizeof(struct pollfd) * tmp_buffer_len_);
-    }
+    // Squeeze out any holes left by detached transports, so neither the
+    // kernel nor the scan below has to step over them.
+    if (!holes_.empty())
+      compact_locked();
 
-    poll_buffer = tmp_buffer_;
-    poll_buffer_len = tmp_buffer_len_;
-  } else {
-    poll_buffer = poll_events_.buffer();
     poll_buffer_len = poll_events_.length();
+    if (lock_) {
+      // We need to the copy poll buffer; otherwise, we could mutate the buffer
+      // while poll() is operating, and locking over poll() could trivially lead
+      // to deadlocks.
+      if (tmp_buffer_len_ < poll_buffer_len) {
+        struct pollfd *new_buffer = new struct pollfd[poll_buffer_len];
+        if (!new_buffer)
+          return eOutOfMemory;
+        tmp_buffer_ = new_buffer;
+        tmp_buffer_len_ = poll_buffer_len;
+      }
+      memcpy(tmp_buffer_, poll_events_.buffer(), sizeof(struct pollfd) * poll_buffer_len);
+      poll_buffer = tmp_buffer_;
+    } else {
+      poll_buffer = poll_events_.buffer();
+    }
   }
 
-  int nevents = poll(poll_buffer, poll_buffer_len, timeoutMs);
+#if defined(__linux__)
+  struct timespec timeout;
+  int nevents = ppoll(poll_buffer, poll_buffer_len, TimeoutToTimespec(timeoutNs, &timeout), nullptr);
+#else
+  int nevents = poll(poll_buffer, poll_buffer_len, TimeoutToMs(timeoutNs));
+#endif
   if (nevents == -1) {
     if (errno == EINTR)
       return nullptr;
@@ -211,22 +275,28 @@ PollImpl::Poll(int timeoutMs)
   AutoMaybeLock lock(lock_);
 
   generation_++;
-  for (size_t i = 0; i < poll_buffer_len && nevents > 0; i++) {
-    int revents = poll_buffer[i].revents;
-    if (revents == 0)
-      continue;
+  for (size_t i = 0; nevents > 0; i++) {
+    // Callbacks may attach new transports, which can move the event buffer.
+    if (!lock_)
+      poll_buffer = poll_events_.buffer();
 
+    i = FindNextReady(poll_buffer, i, poll_buffer_len);
+    if (i == poll_buffer_len)
+      break;
+
+    int revents = poll_buffer[i].revents;
     int fd = poll_buffer[i].fd;
     nevents--;
 
     // We have to check this in case the list changes during iteration.
-    if (isFdChanged(fd))
+    if (isFdChanged(fd) || !fds_[fd].transport)
       continue;
+    eventDispatched();
 
-    // Handle errors first.
+    // Handle errors first. Zero-copy completions also show up as errors.
     if (revents & POLLERR) {
-      reportError_locked(fds_[fd].transport);
-      continue;
+      if (!handleError_locked(fds_[fd].transport) || isFdChanged(fd))
+        continue;
     }
 
     // Prioritize POLLIN over POLLHUP/POLLRDHUP.
@@ -236,9 +306,12 @@ PollImpl::Poll(int timeoutMs)
         continue;
     }
 
-    // Handle explicit hangup.
+    // Handle explicit hangup. If the read callback stopped reading, a half
+    // close is left for the listener to handle.
 #if defined(__linux__)
-    if (revents & (POLLRDHUP|POLLHUP)) {
+    if ((revents & POLLHUP) ||
+        ((revents & POLLRDHUP) && ReportsReadHangup(fds_[fd].transport->flags())))
+    {
 #else
     if (revents & POLLHUP) {
 #endif
@@ -26,6 +26,10 @@ using namespace ke;
 // This message pump is based on poll(), which is available in glibc, Linux,
 // and BSD. Notably it is not present (as a function call) on Solaris, but
 // as a device (/dev/poll) which deserves a separate implementation.
+//
+// Detaching a transport leaves a hole in the pollfd array. Holes are
+// compacted away at the start of the next Poll(), by moving entries from the
+// end of the array, so the array stays dense under connection churn.
 class PollImpl : public PosixPoller
 {
  public:
@@ -33,7 +37,7 @@ class PollImpl : public PosixPoller
   ~PollImpl();
 
   PassRef<IOError> Initialize();
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return false;
@@ -51,6 +55,7 @@ class PollImpl : public PosixPoller
 
  private:
   void poll_ctl(size_t slot, TransportFlags flags);
+  void compact_locked();
 
   bool isFdChanged(int fd) const {
     return fds_[fd].modified == generation_;
@@ -74,7 +79,7 @@ class PollImpl : public PosixPoller
   uintptr_t generation_;
   Vector<struct pollfd> poll_events_;
   Vector<PollData> fds_;
-  Vector<size_t> free_slots_;
+  Vector<size_t> holes_;
   AutoPtr<struct pollfd> tmp_buffer_;
   size_t tmp_buffer_len_;
 };
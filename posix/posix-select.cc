@@ -118,7 +118,13 @@ inline void
 SelectImpl::handleEvent(fd_set *set, int fd)
 {
   Ref<PosixTransport> transport = fds_[fd].transport;
-  if (transport->flags() & kTransportLT) {
+  if (transport->flags() & kTransportOneShot) {
+    // Ignore if disarmed; otherwise, disarm everything.
+    if (!(transport->flags() & outFlag))
+      return;
+    select_ctl(fd, kTransportNoFlags);
+    transport->flags() &= ~kTransportEventMask;
+  } else if (transport->flags() & kTransportLT) {
     // Ignore - the event's been changed.
     if (!(transport->flags() & outFlag))
       return;
@@ -142,7 +148,7 @@ SelectImpl::handleEvent(fd_set *set, int fd)
 }
 
 PassRef<IOError>
-SelectImpl::Poll(int timeoutMs)
+SelectImpl::PollNs(int64_t timeoutNs)
 {
   // We acquire a lock specifically for Poll(), to make sure it isn't called on
   // any thread or within callbacks.
@@ -152,13 +158,8 @@ SelectImpl::Poll(int timeoutMs)
   if (fd_watermark_ == -1)
     return nullptr;
 
-  struct timeval timeout;
-  struct timeval *timeoutp = nullptr;
-  if (timeoutMs >= 0) {
-    timeout.tv_sec = timeoutMs / 1000;
-    timeout.tv_usec = (timeoutMs % 1000) * 1000;
-    timeoutp = &timeout;
-  }
+  struct timespec timeout;
+  struct timespec *timeoutp = TimeoutToTimespec(timeoutNs, &timeout);
 
   fd_set read_fds, write_fds;
   int fd_watermark;
@@ -172,7 +173,7 @@ SelectImpl::Poll(int timeoutMs)
     fd_watermark = fd_watermark_;
   }
 
-  int result = select(fd_watermark + 1, &read_fds, &write_fds, nullptr, timeoutp);
+  int result = pselect(fd_watermark + 1, &read_fds, &write_fds, nullptr, timeoutp, nullptr);
   if (result == -1) {
     if (errno == EINTR)
       return nullptr;
@@ -182,18 +183,41 @@ SelectImpl::Poll(int timeoutMs)
   AutoMaybeLock lock(lock_);
 
   generation_++;
-  for (int i = 0; i <= fd_watermark; i++) {
-    // Make sure this transport wasn't swapped out or removed.
-    if (isFdChanged(i))
-      continue;
 
-    if (FD_ISSET(i, &read_fds)) {
-      handleEvent<kTransportReading>(&read_fds_, i);
+  // Rather than test every descriptor up to the watermark, scan the sets a
+  // word at a time and only visit descriptors with a bit set in either one.
+  const fd_mask *read_words = FdSetWords(&read_fds);
+  const fd_mask *write_words = FdSetWords(&write_fds);
+  size_t nwords = size_t(fd_watermark) / NFDBITS + 1;
+  for (size_t word = 0; word < nwords; word++) {
+    unsigned long bits = MaskToBits(read_words[word] | write_words[word]);
+    while (bits) {
+      int i = int(word * NFDBITS + __builtin_ctzl(bits));
+      bits &= bits - 1;
+
+      // Make sure this transport wasn't swapped out or removed.
       if (isFdChanged(i))
         continue;
+      eventDispatched();
+
+      // select() reports socket errors as readiness, so zero-copy
+      // completions must be drained here or we would spin on them. That
+      // costs a few system calls, so only bother while sends are in flight.
+      if ((fds_[i].transport->flags() & kTransportZeroCopy) &&
+          fds_[i].transport->hasPendingZeroCopy())
+      {
+        if (!handleError_locked(fds_[i].transport) || isFdChanged(i))
+          continue;
+      }
+
+      if (FD_ISSET(i, &read_fds)) {
+        handleEvent<kTransportReading>(&read_fds_, i);
+        if (isFdChanged(i))
+          continue;
+      }
+      if (FD_ISSET(i, &write_fds))
+        handleEvent<kTransportWriting>(&write_fds_, i);
     }
-    if (FD_ISSET(i, &write_fds))
-      handleEvent<kTransportWriting>(&write_fds_, i);
   }
 
   return nullptr;
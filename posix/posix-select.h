@@ -18,6 +18,10 @@
 #include <sys/types.h>
 #include <am-utility.h>
 
+#if !defined(NFDBITS)
+# define NFDBITS (sizeof(fd_mask) * 8)
+#endif
+
 namespace amio {
 
 using namespace ke;
@@ -28,7 +32,7 @@ class SelectImpl : public PosixPoller
   SelectImpl();
   ~SelectImpl();
 
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return false;
@@ -48,6 +52,17 @@ class SelectImpl : public PosixPoller
 
   void select_ctl(int fd, TransportFlags flags);
 
+  // An fd_set is an array of fd_mask words, where descriptor |fd| is bit
+  // (fd % NFDBITS) of word (fd / NFDBITS).
+  static inline const fd_mask *FdSetWords(const fd_set *set) {
+    return reinterpret_cast<const fd_mask *>(set);
+  }
+  static inline unsigned long MaskToBits(fd_mask mask) {
+    static_assert(sizeof(fd_mask) <= sizeof(unsigned long), "fd_mask is too large");
+    // Don't let a signed fd_mask sign-extend into bits past NFDBITS.
+    return (unsigned long)mask & (~0UL >> (8 * (sizeof(unsigned long) - sizeof(fd_mask))));
+  }
+
   template <TransportFlags outFlag>
   inline void handleEvent(fd_set *set, int fd);
 
@@ -10,15 +10,23 @@
 #include "posix/posix-transport.h"
 #include "posix/posix-errors.h"
 #include "posix/posix-base-poller.h"
+#include "shared/shared-errors.h"
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#endif
 
 using namespace amio;
 
 PosixTransport::PosixTransport(int fd, TransportFlags flags)
  : fd_(fd),
-   flags_(flags & kTransportUserFlagMask)
+   flags_(flags & kTransportUserFlagMask),
+   zerocopy_id_(0),
+   zerocopy_done_(0)
 {
 }
 
@@ -63,6 +71,162 @@ PosixTransport::Read(IOResult *result, void *buffer, size_t maxlength)
   *result = IOResult();
 
   ssize_t rv = AMIO_RETRY_IF_EINTR(read(fd_, buffer, maxlength));
+  return finishRead(result, rv);
+}
+
+bool
+PosixTransport::Write(IOResult *result, const void *buffer, size_t maxlength)
+{
+  *result = IOResult();
+
+  ssize_t rv = AMIO_RETRY_IF_EINTR(write(fd_, buffer, maxlength));
+  return finishWrite(result, rv);
+}
+
+// readv() and writev() fail with EINVAL past IOV_MAX, so clamp instead; the
+// caller sees a partial transfer.
+static inline int
+ClampIovecCount(size_t count)
+{
+#if defined(IOV_MAX)
+  return int(ke::Min(count, size_t(IOV_MAX)));
+#else
+  return int(ke::Min(count, size_t(1024)));
+#endif
+}
+
+bool
+PosixTransport::ReadV(IOResult *result, const struct iovec *iov, size_t count)
+{
+  *result = IOResult();
+
+  ssize_t rv = AMIO_RETRY_IF_EINTR(readv(fd_, iov, ClampIovecCount(count)));
+  return finishRead(result, rv);
+}
+
+bool
+PosixTransport::WriteV(IOResult *result, const struct iovec *iov, size_t count)
+{
+  *result = IOResult();
+
+  ssize_t rv = AMIO_RETRY_IF_EINTR(writev(fd_, iov, ClampIovecCount(count)));
+  return finishWrite(result, rv);
+}
+
+PassRef<IOError>
+PosixTransport::EnableZeroCopy()
+{
+#if defined(AMIO_HAVE_ZEROCOPY)
+  if (flags_ & kTransportZeroCopy)
+    return nullptr;
+
+  int on = 1;
+  if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1)
+    return new PosixError();
+  flags_ |= kTransportZeroCopy;
+  return nullptr;
+#else
+  return eZeroCopyUnsupported;
+#endif
+}
+
+bool
+PosixTransport::WriteZeroCopy(IOResult *result, const void *buffer, size_t maxlength, uint32_t *id)
+{
+  *result = IOResult();
+
+#if defined(AMIO_HAVE_ZEROCOPY)
+  if (!(flags_ & kTransportZeroCopy)) {
+    result->error = eZeroCopyNotEnabled;
+    return false;
+  }
+
+  ssize_t rv = AMIO_RETRY_IF_EINTR(send(fd_, buffer, maxlength, MSG_ZEROCOPY));
+  if (!finishWrite(result, rv))
+    return false;
+
+  // The kernel only uses up an id if the send transferred something.
+  if (result->bytes)
+    *id = zerocopy_id_++;
+  return true;
+#else
+  result->error = eZeroCopyUnsupported;
+  return false;
+#endif
+}
+
+bool
+PosixTransport::SendFile(IOResult *result, int fd, int64_t offset, size_t maxlength)
+{
+  *result = IOResult();
+
+#if defined(__linux__)
+  off_t pos = off_t(offset);
+  ssize_t rv = AMIO_RETRY_IF_EINTR(sendfile(fd_, fd, &pos, maxlength));
+#else
+  // Bounce through a buffer. Since reads are positional, anything that
+  // doesn't fit in a partial write is simply read again on the next call.
+  char buffer[16 * 1024];
+  ssize_t rv = AMIO_RETRY_IF_EINTR(pread(fd, buffer, ke::Min(maxlength, sizeof(buffer)), off_t(offset)));
+  if (rv == -1) {
+    result->error = new PosixError();
+    return false;
+  }
+  if (rv > 0)
+    rv = AMIO_RETRY_IF_EINTR(write(fd_, buffer, size_t(rv)));
+#endif
+
+  if (!finishWrite(result, rv))
+    return false;
+  if (result->completed && !result->bytes && maxlength)
+    result->ended = true;
+  return true;
+}
+
+bool
+PosixTransport::Splice(IOResult *result, Ref<Transport> source, size_t maxlength)
+{
+  *result = IOResult();
+
+  if (source->Closed()) {
+    result->error = eTransportClosed;
+    return false;
+  }
+
+#if defined(__linux__)
+  ssize_t rv = AMIO_RETRY_IF_EINTR(splice(source->FileDescriptor(), nullptr, fd_, nullptr,
+                                          maxlength, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+  if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // splice() doesn't say which side would block. If we can write, it must
+    // be the source.
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT)) {
+      if (Ref<IOError> error = source->ReadIsBlocked()) {
+        result->error = error;
+        return false;
+      }
+      return true;
+    }
+    errno = EAGAIN;
+  }
+
+  if (!finishWrite(result, rv))
+    return false;
+  if (result->completed && !result->bytes && maxlength)
+    result->ended = true;
+  return true;
+#else
+  result->error = eSpliceUnsupported;
+  return false;
+#endif
+}
+
+bool
+PosixTransport::finishRead(IOResult *result, ssize_t rv)
+{
   if (rv == -1) {
     if (errno == EWOULDBLOCK || errno == EAGAIN) {
       if (Ref<IOError> error = ReadIsBlocked()) {
@@ -87,11 +251,8 @@ PosixTransport::Read(IOResult *result, void *buffer, size_t maxlength)
 }
 
 bool
-PosixTransport::Write(IOResult *result, const void *buffer, size_t maxlength)
+PosixTransport::finishWrite(IOResult *result, ssize_t rv)
 {
-  *result = IOResult();
-
-  ssize_t rv = AMIO_RETRY_IF_EINTR(write(fd_, buffer, maxlength));
   if (rv == -1) {
     if (errno == EWOULDBLOCK || errno == EAGAIN) {
       if (Ref<IOError> error = WriteIsBlocked()) {
@@ -185,11 +346,15 @@ PosixTransport::attach(PosixPoller *poller, StatusListener *listener)
   // Do not overwrite an existing pump with a non-null pump.
   poller_ = poller;
   listener_ = listener;
+  if (poller)
+    poller->transportAttached();
 }
 
 PassRef<StatusListener>
 PosixTransport::detach()
 {
+  if (Ref<PosixPoller> poller = poller_.get())
+    poller->transportDetached();
   poller_ = nullptr;
   flags_ &= ~kTransportClearMask;
   return listener_.take();
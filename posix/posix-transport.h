@@ -16,6 +16,13 @@
 # error PosixTransport cannot be used on Windows.
 #endif
 
+#if defined(__linux__)
+# include <sys/socket.h>
+# if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#   define AMIO_HAVE_ZEROCOPY
+# endif
+#endif
+
 namespace amio {
 
 // Forward declaration.
@@ -33,6 +40,12 @@ class PosixTransport
   // Transport implementation.
   bool Read(IOResult *result, void *buffer, size_t maxlength) override;
   bool Write(IOResult *result, const void *buffer, size_t maxlength) override;
+  bool ReadV(IOResult *result, const struct iovec *iov, size_t count) override;
+  bool WriteV(IOResult *result, const struct iovec *iov, size_t count) override;
+  PassRef<IOError> EnableZeroCopy() override;
+  bool WriteZeroCopy(IOResult *result, const void *buffer, size_t maxlength, uint32_t *id) override;
+  bool SendFile(IOResult *result, int fd, int64_t offset, size_t maxlength) override;
+  bool Splice(IOResult *result, Ref<Transport> source, size_t maxlength) override;
   void Close() override;
 
   PosixTransport *toPosixTransport() override {
@@ -102,11 +115,29 @@ class PosixTransport
     return flags_;
   }
 
+  // Returns whether any zero-copy sends have not been reported complete.
+  bool hasPendingZeroCopy() const {
+    return zerocopy_done_ != zerocopy_id_;
+  }
+  void completeZeroCopy(uint32_t last) {
+    zerocopy_done_ = last + 1;
+  }
+
+ private:
+  // Fill in |result| from the return value of a read or write call.
+  bool finishRead(IOResult *result, ssize_t rv);
+  bool finishWrite(IOResult *result, ssize_t rv);
+
  private:
   int fd_;
   uintptr_t impldata_;
   TransportFlags flags_;
 
+  // The id the kernel will assign to the next zero-copy send, and the id of
+  // the oldest send it has not yet reported complete.
+  uint32_t zerocopy_id_;
+  uint32_t zerocopy_done_;
+
   // These should not cause cycles. When the transport is closed, or when the
   // poller removes transports, it forcibly nulls out these fields. However,
   // if a poller is never shutdown and it has a transport that never receives
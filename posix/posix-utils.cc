@@ -16,6 +16,7 @@
 #endif
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
 
 using namespace ke;
 using namespace amio;
@@ -71,6 +72,13 @@ PollerFactory::CreatePollImpl(Ref<Poller> *outp)
 }
 #endif
 
+void
+CompletionListener::OnAccept(int fd)
+{
+  // By default, nobody wants the connection.
+  AMIO_RETRY_IF_EINTR(close(fd));
+}
+
 AutoDisableSigPipe::AutoDisableSigPipe()
 {
   prev_handler_ = signal(SIGPIPE, SIG_IGN);
@@ -21,6 +21,11 @@ ke::Ref<GenericError> amio::eUnsupportedProtocol = new GenericError("unsupported
 ke::Ref<GenericError> amio::ePollerShutdown = new GenericError("poller has been shutdown");
 ke::Ref<GenericError> amio::eTransportNotAttached = new GenericError("transport is not attached");
 ke::Ref<GenericError> amio::eEdgeTriggeringUnsupported = new GenericError("native edge-triggering is not supported");
+ke::Ref<GenericError> amio::eCompletionModeUnsupported = new GenericError("completion mode is not supported");
+ke::Ref<GenericError> amio::eCompletionListenerRequired = new GenericError("completion mode requires a CompletionListener");
+ke::Ref<GenericError> amio::eZeroCopyUnsupported = new GenericError("zero-copy sends are not supported");
+ke::Ref<GenericError> amio::eZeroCopyNotEnabled = new GenericError("zero-copy sends are not enabled");
+ke::Ref<GenericError> amio::eSpliceUnsupported = new GenericError("splice is not supported");
 
 GenericError::GenericError(const char *fmt, ...)
 {
@@ -44,6 +44,11 @@ extern ke::Ref<GenericError> eUnsupportedAddressFamily;
 extern ke::Ref<GenericError> eUnsupportedProtocol;
 extern ke::Ref<GenericError> ePollerShutdown;
 extern ke::Ref<GenericError> eEdgeTriggeringUnsupported;
+extern ke::Ref<GenericError> eCompletionModeUnsupported;
+extern ke::Ref<GenericError> eCompletionListenerRequired;
+extern ke::Ref<GenericError> eZeroCopyUnsupported;
+extern ke::Ref<GenericError> eZeroCopyNotEnabled;
+extern ke::Ref<GenericError> eSpliceUnsupported;
 
 } // namespace amio
 
@@ -0,0 +1,211 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include "shared-event-loop-group.h"
+#include "shared-errors.h"
+#if defined(_MSC_VER)
+# include <windows.h>
+#else
+# include <unistd.h>
+# include <pthread.h>
+# if defined(__linux__)
+#  include <sched.h>
+# endif
+#endif
+
+using namespace ke;
+using namespace amio;
+
+static size_t
+NumberOfCpus()
+{
+#if defined(_MSC_VER)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? size_t(count) : 1;
+#else
+  return 1;
+#endif
+}
+
+// Pin the calling thread to a CPU. This is best-effort; a loop that can't be
+// pinned still works.
+static void
+PinCurrentThread(int cpu)
+{
+#if defined(_MSC_VER)
+  if (cpu < int(sizeof(DWORD_PTR) * 8))
+    SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+#endif
+}
+
+PassRef<IOError>
+EventLoopGroup::Create(Ref<EventLoopGroup> *outp, const EventLoopGroupOptions &options)
+{
+  Ref<EventLoopGroupImpl> group = new EventLoopGroupImpl(options);
+  if (Ref<IOError> error = group->Initialize())
+    return error;
+
+  *outp = group;
+  return nullptr;
+}
+
+EventLoopGroupImpl::EventLoopGroupImpl(const EventLoopGroupOptions &options)
+ : options_(options),
+   next_(0),
+   shutdown_(false)
+{
+}
+
+EventLoopGroupImpl::~EventLoopGroupImpl()
+{
+  Shutdown();
+}
+
+PassRef<IOError>
+EventLoopGroupImpl::Initialize()
+{
+  size_t ncpus = NumberOfCpus();
+  size_t nloops = options_.numLoops ? options_.numLoops : ncpus;
+
+  // Create every loop before starting any threads, so a failure doesn't
+  // leave a partially running group.
+  for (size_t i = 0; i < nloops; i++) {
+    Ref<EventLoopForIO> loop;
+    if (Ref<IOError> error = EventLoopForIO::Create(&loop, nullptr, options_.loopOptions))
+      return error;
+
+    int cpu = options_.pinThreads ? int(i % ncpus) : -1;
+    if (!workers_.append(new Worker(loop, cpu)))
+      return eOutOfMemory;
+  }
+
+  for (size_t i = 0; i < workers_.length(); i++) {
+    Worker *worker = workers_[i];
+    worker->thread_ = new Thread(worker, "amio event loop");
+    if (!worker->thread_->Succeeded()) {
+      worker->thread_ = nullptr;
+      return new GenericError("could not start event loop thread");
+    }
+  }
+  return nullptr;
+}
+
+void
+EventLoopGroupImpl::Worker::Run()
+{
+  if (cpu_ != -1)
+    PinCurrentThread(cpu_);
+  loop_->Loop();
+}
+
+size_t
+EventLoopGroupImpl::NumLoops()
+{
+  AutoLock lock(&lock_);
+  return workers_.length();
+}
+
+PassRef<EventLoopForIO>
+EventLoopGroupImpl::GetLoop(size_t index)
+{
+  AutoLock lock(&lock_);
+  if (index >= workers_.length())
+    return nullptr;
+  return workers_[index]->loop_;
+}
+
+PassRef<EventLoopForIO>
+EventLoopGroupImpl::Next()
+{
+  AutoLock lock(&lock_);
+  if (shutdown_)
+    return nullptr;
+
+#if defined(KE_POSIX)
+  if (options_.policy == EventLoopGroupOptions::Policy::LeastLoaded)
+    return pickLeastLoaded();
+#endif
+
+  Worker *worker = workers_[next_];
+  next_ = (next_ + 1) % workers_.length();
+  return worker->loop_;
+}
+
+#if defined(KE_POSIX)
+EventLoopForIO *
+EventLoopGroupImpl::pickLeastLoaded()
+{
+  // Ties go to the loop after the last one picked, so an idle group still
+  // spreads new connections around before any of them are attached.
+  Worker *best = nullptr;
+  size_t best_load = 0;
+  for (size_t i = 0; i < workers_.length(); i++) {
+    Worker *worker = workers_[(next_ + i) % workers_.length()];
+    size_t load = worker->loop_->NumTransports();
+    if (!best || load < best_load) {
+      best = worker;
+      best_load = load;
+    }
+  }
+  next_ = (next_ + 1) % workers_.length();
+  return best->loop_;
+}
+#endif
+
+void
+EventLoopGroupImpl::PostQuit()
+{
+  AutoLock lock(&lock_);
+  for (size_t i = 0; i < workers_.length(); i++)
+    workers_[i]->loop_->PostQuit();
+}
+
+void
+EventLoopGroupImpl::Shutdown()
+{
+  Vector<Worker *> workers;
+  {
+    AutoLock lock(&lock_);
+    if (shutdown_)
+      return;
+    shutdown_ = true;
+
+    for (size_t i = 0; i < workers_.length(); i++) {
+      workers_[i]->loop_->PostQuit();
+      workers.append(workers_[i]);
+    }
+    workers_.clear();
+  }
+
+  for (size_t i = 0; i < workers.length(); i++) {
+    Worker *worker = workers[i];
+    if (worker->thread_)
+      worker->thread_->Join();
+
+    // EventLoopForIO also inherits Shutdown() from IODispatcher.
+    EventLoop *loop = worker->loop_;
+    loop->Shutdown();
+    delete worker;
+  }
+}
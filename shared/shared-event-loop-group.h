@@ -0,0 +1,72 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_event_loop_group_h_
+#define _include_amio_event_loop_group_h_
+
+#include <amio-eventloop.h>
+#include <am-thread-utils.h>
+#include <am-refcounting-threadsafe.h>
+#include <am-vector.h>
+
+namespace amio {
+
+using namespace ke;
+
+class EventLoopGroupImpl
+ : public EventLoopGroup,
+   public ke::RefcountedThreadsafe<EventLoopGroupImpl>
+{
+ public:
+  EventLoopGroupImpl(const EventLoopGroupOptions &options);
+  ~EventLoopGroupImpl();
+
+  KE_IMPL_REFCOUNTING_TS(EventLoopGroupImpl);
+
+  PassRef<IOError> Initialize();
+
+  size_t NumLoops() override;
+  PassRef<EventLoopForIO> GetLoop(size_t index) override;
+  PassRef<EventLoopForIO> Next() override;
+  void PostQuit() override;
+  void Shutdown() override;
+
+ private:
+  class Worker : public IRunnable
+  {
+   public:
+    Worker(Ref<EventLoopForIO> loop, int cpu)
+     : loop_(loop),
+       cpu_(cpu)
+    {}
+
+    void Run() override;
+
+    Ref<EventLoopForIO> loop_;
+    AutoPtr<Thread> thread_;
+
+    // The CPU to pin to, or -1.
+    int cpu_;
+  };
+
+#if defined(KE_POSIX)
+  EventLoopForIO *pickLeastLoaded();
+#endif
+
+ private:
+  EventLoopGroupOptions options_;
+  Mutex lock_;
+  Vector<Worker *> workers_;
+  size_t next_;
+  bool shutdown_;
+};
+
+} // namespace amio
+
+#endif // _include_amio_event_loop_group_h_
@@ -0,0 +1,305 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <assert.h>
+#include "shared-executor.h"
+#include "shared-errors.h"
+#if defined(_MSC_VER)
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+using namespace ke;
+using namespace amio;
+
+// Counters are sequentially consistent, so that a sleeper announcing itself
+// and a submitter announcing new work can't miss each other.
+static inline long
+AtomicAdd(long *ptr, long delta)
+{
+#if defined(_MSC_VER)
+  return InterlockedExchangeAdd(ptr, delta) + delta;
+#else
+  return __atomic_add_fetch(ptr, delta, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline long
+AtomicLoad(long *ptr)
+{
+#if defined(_MSC_VER)
+  return InterlockedCompareExchange(ptr, 0, 0);
+#else
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline long
+AtomicExchange(long *ptr, long value)
+{
+#if defined(_MSC_VER)
+  return InterlockedExchange(ptr, value);
+#else
+  return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline size_t
+AtomicIncrement(size_t *ptr)
+{
+#if defined(_MSC_VER)
+  return size_t(InterlockedIncrementSizeT(ptr));
+#else
+  return __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static size_t
+NumberOfCpus()
+{
+#if defined(_MSC_VER)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? size_t(count) : 1;
+#else
+  return 1;
+#endif
+}
+
+// The executor and worker for the pool thread we're on, if any.
+static thread_local ExecutorImpl *sCurrentExecutor = nullptr;
+static thread_local size_t sCurrentWorker = 0;
+
+PassRef<IOError>
+Executor::Create(Ref<Executor> *outp, size_t numThreads)
+{
+  Ref<ExecutorImpl> executor = new ExecutorImpl();
+  if (Ref<IOError> error = executor->Initialize(numThreads ? numThreads : NumberOfCpus()))
+    return error;
+
+  *outp = executor;
+  return nullptr;
+}
+
+ExecutorImpl::Worker::Worker(ExecutorImpl *parent, size_t index)
+ : parent_(parent),
+   index_(index),
+   rng_(uint32_t(index + 1) * 0x9e3779b9)
+{
+}
+
+void
+ExecutorImpl::Worker::Run()
+{
+  parent_->workerMain(this);
+}
+
+ExecutorImpl::ExecutorImpl()
+ : pending_(0),
+   sleepers_(0),
+   next_worker_(0),
+   shutdown_(0)
+{
+}
+
+ExecutorImpl::~ExecutorImpl()
+{
+  Shutdown();
+  for (size_t i = 0; i < workers_.length(); i++)
+    delete workers_[i];
+}
+
+PassRef<IOError>
+ExecutorImpl::Initialize(size_t numThreads)
+{
+  for (size_t i = 0; i < numThreads; i++) {
+    if (!workers_.append(new Worker(this, i)))
+      return eOutOfMemory;
+  }
+
+  // Threads can steal from each other as soon as they start, so every
+  // worker must exist first.
+  for (size_t i = 0; i < workers_.length(); i++) {
+    Worker *worker = workers_[i];
+    worker->thread_ = new Thread(worker, "amio executor");
+    if (!worker->thread_->Succeeded()) {
+      worker->thread_ = nullptr;
+      return new GenericError("could not start executor thread");
+    }
+  }
+  return nullptr;
+}
+
+size_t
+ExecutorImpl::NumThreads()
+{
+  return workers_.length();
+}
+
+void
+ExecutorImpl::Submit(Task *work, EventLoop *loop, Task *continuation)
+{
+  assert(work);
+  assert(loop || !continuation);
+
+  WorkItem item(work, loop, continuation);
+
+  // Nested work stays on the submitting thread. Everything else is spread
+  // around, so submitters don't all contend on one lock.
+  Worker *target;
+  if (sCurrentExecutor == this) {
+    target = workers_[sCurrentWorker];
+  } else {
+    if (workers_.empty()) {
+      discardItem(item);
+      return;
+    }
+    target = workers_[AtomicIncrement(&next_worker_) % workers_.length()];
+  }
+
+  {
+    AutoLock lock(&target->lock_);
+    if (AtomicLoad(&shutdown_)) {
+      AutoUnlock unlock(&target->lock_);
+      discardItem(item);
+      return;
+    }
+    target->queue_.append(item);
+  }
+
+  AtomicAdd(&pending_, 1);
+  if (AtomicLoad(&sleepers_)) {
+    AutoLock lock(&idle_);
+    idle_.Notify();
+  }
+}
+
+void
+ExecutorImpl::workerMain(Worker *worker)
+{
+  sCurrentExecutor = this;
+  sCurrentWorker = worker->index_;
+
+  while (true) {
+    WorkItem item;
+    if (!popLocal(worker, &item) && !steal(worker, &item)) {
+      if (!waitForWork())
+        break;
+      continue;
+    }
+
+    AtomicAdd(&pending_, -1);
+    runItem(item);
+  }
+
+  sCurrentExecutor = nullptr;
+}
+
+bool
+ExecutorImpl::popLocal(Worker *worker, WorkItem *item)
+{
+  AutoLock lock(&worker->lock_);
+  if (worker->queue_.empty())
+    return false;
+  *item = worker->queue_.popBackCopy();
+  return true;
+}
+
+bool
+ExecutorImpl::steal(Worker *worker, WorkItem *item)
+{
+  // xorshift32, to pick where to start looking.
+  uint32_t x = worker->rng_;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  worker->rng_ = x;
+
+  size_t count = workers_.length();
+  size_t start = x % count;
+  for (size_t i = 0; i < count; i++) {
+    Worker *victim = workers_[(start + i) % count];
+    if (victim == worker)
+      continue;
+
+    AutoLock lock(&victim->lock_);
+    if (victim->queue_.empty())
+      continue;
+    *item = victim->queue_.popFrontCopy();
+    return true;
+  }
+  return false;
+}
+
+bool
+ExecutorImpl::waitForWork()
+{
+  AutoLock lock(&idle_);
+  AtomicAdd(&sleepers_, 1);
+  while (AtomicLoad(&pending_) <= 0 && !AtomicLoad(&shutdown_))
+    idle_.Wait();
+  AtomicAdd(&sleepers_, -1);
+  return !AtomicLoad(&shutdown_);
+}
+
+void
+ExecutorImpl::runItem(const WorkItem &item)
+{
+  item.work->Run();
+  item.work->DeleteMe();
+
+  if (item.continuation)
+    item.loop->PostTask(item.continuation);
+}
+
+void
+ExecutorImpl::discardItem(const WorkItem &item)
+{
+  item.work->DeleteMe();
+  if (item.continuation)
+    item.continuation->DeleteMe();
+}
+
+void
+ExecutorImpl::Shutdown()
+{
+  if (AtomicExchange(&shutdown_, 1))
+    return;
+
+  // Take whatever hasn't started. Since we hold each deque's lock while
+  // emptying it, and submitters check the flag under the same lock, nothing
+  // can be queued afterward.
+  Vector<WorkItem> discarded;
+  for (size_t i = 0; i < workers_.length(); i++) {
+    Worker *worker = workers_[i];
+    AutoLock lock(&worker->lock_);
+    while (!worker->queue_.empty())
+      discarded.append(worker->queue_.popFrontCopy());
+  }
+
+  {
+    AutoLock lock(&idle_);
+    idle_.NotifyAll();
+  }
+
+  for (size_t i = 0; i < workers_.length(); i++) {
+    Worker *worker = workers_[i];
+    if (worker->thread_)
+      worker->thread_->Join();
+  }
+
+  // Workers stay allocated until we're destroyed, so a racing Submit() can
+  // still find a deque to check the flag on.
+  for (size_t i = 0; i < discarded.length(); i++)
+    discardItem(discarded[i]);
+}
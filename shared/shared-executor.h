@@ -0,0 +1,102 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_shared_executor_h_
+#define _include_amio_shared_executor_h_
+
+#include <amio-executor.h>
+#include <am-thread-utils.h>
+#include <am-refcounting-threadsafe.h>
+#include <am-deque.h>
+#include <am-vector.h>
+#include <stdint.h>
+
+namespace amio {
+
+using namespace ke;
+
+class ExecutorImpl
+ : public Executor,
+   public ke::RefcountedThreadsafe<ExecutorImpl>
+{
+ public:
+  ExecutorImpl();
+  ~ExecutorImpl();
+
+  KE_IMPL_REFCOUNTING_TS(ExecutorImpl);
+
+  PassRef<IOError> Initialize(size_t numThreads);
+
+  void Submit(Task *work, EventLoop *loop, Task *continuation) override;
+  size_t NumThreads() override;
+  void Shutdown() override;
+
+ private:
+  struct WorkItem
+  {
+    Task *work;
+    EventLoop *loop;
+    Task *continuation;
+
+    WorkItem()
+     : work(nullptr),
+       loop(nullptr),
+       continuation(nullptr)
+    {}
+    WorkItem(Task *work, EventLoop *loop, Task *continuation)
+     : work(work),
+       loop(loop),
+       continuation(continuation)
+    {}
+  };
+
+  // The owning thread pushes and pops at the back of its deque; thieves take
+  // from the front. Each deque has its own lock, so threads only contend
+  // when one of them is stealing.
+  class Worker : public IRunnable
+  {
+   public:
+    Worker(ExecutorImpl *parent, size_t index);
+
+    void Run() override;
+
+    ExecutorImpl *parent_;
+    size_t index_;
+    uint32_t rng_;
+    Mutex lock_;
+    Deque<WorkItem> queue_;
+    AutoPtr<Thread> thread_;
+  };
+
+  void workerMain(Worker *worker);
+  bool popLocal(Worker *worker, WorkItem *item);
+  bool steal(Worker *worker, WorkItem *item);
+  bool waitForWork();
+  void runItem(const WorkItem &item);
+  static void discardItem(const WorkItem &item);
+
+ private:
+  Vector<Worker *> workers_;
+
+  // Used to sleep when there's nothing to steal. Submitters only take this
+  // lock if someone is asleep.
+  ConditionVariable idle_;
+
+  // These are accessed with atomic builtins. |pending_| is the number of
+  // queued items, and may briefly go negative while a submit races with a
+  // thief.
+  long pending_;
+  long sleepers_;
+  size_t next_worker_;
+  long shutdown_;
+};
+
+} // namespace amio
+
+#endif // _include_amio_shared_executor_h_
@@ -0,0 +1,79 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_task_batch_h_
+#define _include_amio_task_batch_h_
+
+#include <amio-eventloop.h>
+#include <amio-time.h>
+#include "shared-task-queue.h"
+#include "shared-timers.h"
+
+namespace amio {
+
+// Run one iteration's worth of tasks for an event loop: urgent and normal
+// tasks first, then expired timers, until both are empty, a quit is posted, or a limit in
+// |options| is reached. Timers due by |now|, the loop's cached clock, are
+// run. Counts are added to |stats|.
+//
+// The time limit is checked after every task, so it uses
+// HighResolutionTimer::FastCounter().
+//
+// Returns true if a limit was reached, meaning more work may be waiting.
+static inline bool
+RunTaskBatch(TaskQueueImpl *tasks, TimerQueue *timers, const EventLoopOptions &options,
+             int64_t now, LoopIterationStats *stats)
+{
+  int64_t deadline = 0;
+  if (options.maxTaskTimeNs)
+    deadline = HighResolutionTimer::FastCounter() + options.maxTaskTimeNs;
+
+  size_t count = 0;
+  while (!tasks->ShouldQuit()) {
+    if (options.maxTasksPerIteration && count >= options.maxTasksPerIteration)
+      return true;
+    if (deadline && count && HighResolutionTimer::FastCounter() >= deadline)
+      return true;
+
+    if (tasks->ProcessNextTask(TaskPriority::Normal))
+      stats->tasks++;
+    else if (timers->ProcessNextTask(now))
+      stats->timers++;
+    else
+      return false;
+    count++;
+  }
+  return false;
+}
+
+// Run idle tasks, within the same limits as RunTaskBatch(). This stops early
+// if any other task is posted.
+static inline void
+RunIdleBatch(TaskQueueImpl *tasks, const EventLoopOptions &options, LoopIterationStats *stats)
+{
+  int64_t deadline = 0;
+  if (options.maxTaskTimeNs)
+    deadline = HighResolutionTimer::FastCounter() + options.maxTaskTimeNs;
+
+  size_t count = 0;
+  while (!tasks->ShouldQuit() && !tasks->HasPendingTasks()) {
+    if (options.maxTasksPerIteration && count >= options.maxTasksPerIteration)
+      return;
+    if (deadline && count && HighResolutionTimer::FastCounter() >= deadline)
+      return;
+    if (!tasks->ProcessIdleTask())
+      return;
+    stats->idle++;
+    count++;
+  }
+}
+
+} // namespace amio
+
+#endif // _include_amio_task_batch_h_
@@ -0,0 +1,162 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <assert.h>
+#include <stdlib.h>
+#include <amio-eventloop.h>
+#include <am-thread-utils.h>
+#include <am-vector.h>
+
+using namespace ke;
+using namespace amio;
+
+namespace {
+
+// Slots move between threads in batches of this size. A thread's cache holds
+// at most two batches before giving one back.
+static const size_t kBatchSize = 128;
+
+struct SlotLink
+{
+  SlotLink *next;
+};
+
+struct Batch
+{
+  SlotLink *head;
+  size_t count;
+
+  Batch()
+   : head(nullptr),
+     count(0)
+  {}
+  Batch(SlotLink *head, size_t count)
+   : head(head),
+     count(count)
+  {}
+};
+
+// Batches of free slots that aren't owned by any thread. Memory for slots is
+// never given back to the system; the pool only grows to the peak number of
+// tasks in flight.
+//
+// This lives at namespace scope, since we build with -fno-threadsafe-statics
+// and the first tasks may be posted from several threads at once.
+class Depot
+{
+ public:
+  bool take(Batch *out) {
+    AutoLock lock(&lock_);
+    if (batches_.empty())
+      return false;
+    *out = batches_.popCopy();
+    return true;
+  }
+
+  void give(const Batch &batch) {
+    AutoLock lock(&lock_);
+    // If this fails, the slots are leaked, which is the best we can do.
+    batches_.append(batch);
+  }
+
+ private:
+  Mutex lock_;
+  Vector<Batch> batches_;
+};
+
+static Depot sDepot;
+
+class SlotCache
+{
+ public:
+  SlotCache()
+   : head_(nullptr),
+     count_(0)
+  {}
+  ~SlotCache() {
+    // Don't strand our slots when the thread exits.
+    if (head_)
+      sDepot.give(Batch(head_, count_));
+  }
+
+  void *allocate() {
+    if (!head_ && !refill())
+      return nullptr;
+
+    SlotLink *slot = head_;
+    head_ = slot->next;
+    count_--;
+    return slot;
+  }
+
+  void free(void *ptr) {
+    SlotLink *slot = reinterpret_cast<SlotLink *>(ptr);
+    slot->next = head_;
+    head_ = slot;
+    count_++;
+
+    // Threads that only consume tasks would otherwise hoard every slot.
+    if (count_ >= kBatchSize * 2)
+      release();
+  }
+
+ private:
+  bool refill() {
+    Batch batch;
+    if (sDepot.take(&batch)) {
+      head_ = batch.head;
+      count_ = batch.count;
+      return true;
+    }
+
+    char *block = reinterpret_cast<char *>(malloc(TaskPool::kSlotSize * kBatchSize));
+    if (!block)
+      return false;
+    for (size_t i = 0; i < kBatchSize; i++) {
+      SlotLink *slot = reinterpret_cast<SlotLink *>(block + i * TaskPool::kSlotSize);
+      slot->next = head_;
+      head_ = slot;
+    }
+    count_ = kBatchSize;
+    return true;
+  }
+
+  void release() {
+    SlotLink *head = head_;
+    SlotLink *tail = head_;
+    for (size_t i = 1; i < kBatchSize; i++)
+      tail = tail->next;
+
+    head_ = tail->next;
+    count_ -= kBatchSize;
+    tail->next = nullptr;
+    sDepot.give(Batch(head, kBatchSize));
+  }
+
+ private:
+  SlotLink *head_;
+  size_t count_;
+};
+
+static thread_local SlotCache sSlotCache;
+
+} // anonymous namespace
+
+void *
+TaskPool::AllocateSlot()
+{
+  return sSlotCache.allocate();
+}
+
+void
+TaskPool::FreeSlot(void *slot)
+{
+  assert(slot);
+  sSlotCache.free(slot);
+}
@@ -10,57 +10,223 @@
 #include <assert.h>
 #include <amio-time.h>
 #include "shared-task-queue.h"
+#if defined(_MSC_VER)
+# include <windows.h>
+#endif
 
 using namespace ke;
 using namespace amio;
 
 TaskQueue *
-TaskQueue::Create(Delegate *delegate)
+TaskQueue::Create(Delegate *delegate, size_t capacity)
 {
-  return new TaskQueueImpl(delegate);
+  return new TaskQueueImpl(delegate, capacity);
 }
 
-TaskQueueImpl::TaskQueueImpl(Delegate *delegate)
+TaskQueueImpl::TaskQueueImpl(Delegate *delegate, size_t capacity)
  : delegate_(delegate),
+   capacity_(capacity),
+   depth_(0),
+   high_water_(0),
    got_break_(false),
    got_quit_(false)
 {
-  if (delegate_)
-    queue_lock_ = new Mutex();
-  incoming_ = new Deque<Task *>();
-  work_ = new Deque<Task *>();
   timer_res_ = HighResolutionTimer::Resolution();
 }
 
 TaskQueueImpl::~TaskQueueImpl()
 {
-  ZapQueue(incoming_);
-  ZapQueue(work_);
+  for (size_t i = 0; i < kNumLanes; i++) {
+    while (Task *task = lanes_[i].pop())
+      task->DeleteMe();
+  }
+}
+
+// The queue needs an atomic exchange, and loads and stores that are ordered
+// with it. These are all sequentially consistent, so that HasPendingTasks()
+// pairs with the event loop's own parking flag.
+static inline Task *
+ExchangeTask(Task **ptr, Task *value)
+{
+#if defined(_MSC_VER)
+  return reinterpret_cast<Task *>(InterlockedExchangePointer(reinterpret_cast<void **>(ptr), value));
+#else
+  return __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline Task *
+LoadTask(Task **ptr)
+{
+#if defined(_MSC_VER)
+  Task *value = *reinterpret_cast<Task * volatile *>(ptr);
+  MemoryBarrier();
+  return value;
+#else
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void
+StoreTask(Task **ptr, Task *value)
+{
+#if defined(_MSC_VER)
+  InterlockedExchangePointer(reinterpret_cast<void **>(ptr), value);
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+TaskQueueImpl::Lane::Lane()
+ : head_(&stub_),
+   tail_(&stub_)
+{
+}
+
+// The depth counters only need atomicity, not ordering.
+static inline size_t
+AddToDepth(size_t *ptr, intptr_t delta)
+{
+#if defined(_MSC_VER)
+  return size_t(InterlockedExchangeAddSizeT(ptr, delta)) + size_t(delta);
+#else
+  return __atomic_add_fetch(ptr, size_t(delta), __ATOMIC_RELAXED);
+#endif
+}
+
+static inline size_t
+LoadDepth(size_t *ptr)
+{
+#if defined(_MSC_VER)
+  return *reinterpret_cast<volatile size_t *>(ptr);
+#else
+  return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline bool
+CompareExchangeDepth(size_t *ptr, size_t expected, size_t desired)
+{
+#if defined(_MSC_VER)
+  void *old = InterlockedCompareExchangePointer(reinterpret_cast<void * volatile *>(ptr),
+                                                reinterpret_cast<void *>(desired),
+                                                reinterpret_cast<void *>(expected));
+  return old == reinterpret_cast<void *>(expected);
+#else
+  return __atomic_compare_exchange_n(ptr, &expected, desired, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#endif
 }
 
 void
-TaskQueueImpl::ZapQueue(Deque<Task *> *queue)
+TaskQueueImpl::Lane::push(Task *task)
 {
-  while (!queue->empty())
-    queue->popFrontCopy()->DeleteMe();
+  StoreTask(&task->next_task_, nullptr);
+  Task *prev = ExchangeTask(&head_, task);
+  StoreTask(&prev->next_task_, task);
+}
+
+Task *
+TaskQueueImpl::Lane::pop()
+{
+  Task *tail = tail_;
+  Task *next = LoadTask(&tail->next_task_);
+  if (tail == &stub_) {
+    if (!next)
+      return nullptr;
+    tail_ = next;
+    tail = next;
+    next = LoadTask(&tail->next_task_);
+  }
+
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+
+  // |tail| looks like the last task. If it isn't the head, a producer is
+  // halfway through linking in a new task, and we'll see it after that
+  // producer notifies us.
+  if (tail != LoadTask(&head_))
+    return nullptr;
+
+  // Put the stub back behind |tail|, so we can unlink |tail| without ever
+  // leaving the queue without a node.
+  push(&stub_);
+  next = LoadTask(&tail->next_task_);
+  if (next) {
+    tail_ = next;
+    return tail;
+  }
+  return nullptr;
+}
+
+bool
+TaskQueueImpl::Lane::empty()
+{
+  return tail_ == &stub_ && LoadTask(&head_) == &stub_;
 }
 
 void
 TaskQueueImpl::PostTask(Task *task)
+{
+  PostTask(task, TaskPriority::Normal);
+}
+
+void
+TaskQueueImpl::PostTask(Task *task, TaskPriority priority)
 {
   assert(task);
 
-  {
-    AutoMaybeLock lock(queue_lock_);
-    if (!incoming_->append(task))
-      task->DeleteMe();
+  post(AddToDepth(&depth_, 1), task, priority);
+}
+
+bool
+TaskQueueImpl::TryPostTask(Task *task, TaskPriority priority)
+{
+  assert(task);
+
+  if (!capacity_) {
+    PostTask(task, priority);
+    return true;
   }
 
-  // Delegate can't change yet so we don't have grab it during the lock.
+  // Reserve a spot first, so racing producers can't overshoot.
+  size_t depth = AddToDepth(&depth_, 1);
+  if (depth > capacity_) {
+    AddToDepth(&depth_, -1);
+    return false;
+  }
+
+  post(depth, task, priority);
+  return true;
+}
+
+void
+TaskQueueImpl::post(size_t depth, Task *task, TaskPriority priority)
+{
+  size_t high_water = LoadDepth(&high_water_);
+  while (depth > high_water) {
+    if (CompareExchangeDepth(&high_water_, high_water, depth))
+      break;
+    high_water = LoadDepth(&high_water_);
+  }
+
+  // The notification must come after the task is fully linked in, since
+  // until then the consumer may not be able to see it.
+  lane(priority).push(task);
   if (delegate_)
     delegate_->NotifyTask();
 }
 
+void
+TaskQueueImpl::GetStats(TaskQueueStats *stats)
+{
+  stats->depth = LoadDepth(&depth_);
+  stats->highWaterMark = LoadDepth(&high_water_);
+  stats->capacity = capacity_;
+}
+
 void
 TaskQueueImpl::PostQuit()
 {
@@ -72,28 +238,46 @@ TaskQueueImpl::PostQuit()
 }
 
 bool
-TaskQueueImpl::RefillWorkQueue()
+TaskQueueImpl::HasPendingTasks()
 {
-  if (!work_->empty())
-    return true;
-
-  AutoMaybeLock lock(queue_lock_);
-  if (incoming_->empty())
-    return false;
+  return !lane(TaskPriority::Urgent).empty() || !lane(TaskPriority::Normal).empty();
+}
 
-  AutoPtr<Deque<Task *>> tmp(work_.take());
-  work_ = incoming_.take();
-  incoming_ = tmp.take();
-  return true;
+bool
+TaskQueueImpl::HasIdleTasks()
+{
+  return !lane(TaskPriority::Idle).empty();
 }
 
 bool
 TaskQueueImpl::ProcessNextTask()
 {
-  if (!RefillWorkQueue())
+  return ProcessNextTask(TaskPriority::Idle);
+}
+
+bool
+TaskQueueImpl::ProcessNextTask(TaskPriority lowest)
+{
+  Task *task = nullptr;
+  for (size_t i = 0; i <= size_t(lowest) && !task; i++)
+    task = lanes_[i].pop();
+  return runTask(task);
+}
+
+bool
+TaskQueueImpl::ProcessIdleTask()
+{
+  return runTask(lane(TaskPriority::Idle).pop());
+}
+
+bool
+TaskQueueImpl::runTask(Task *task)
+{
+  if (!task)
     return false;
 
-  Task *task = work_->popFrontCopy();
+  // Free the spot before running, so the task can post a replacement.
+  AddToDepth(&depth_, -1);
   task->Run();
   task->DeleteMe();
   return true;
@@ -124,13 +308,14 @@ TaskQueueImpl::ProcessTasksForTime(struct timeval *timelimitp, size_t nlimit)
   maxtime -= maxtime % timer_res_;
   assert(maxtime >= 0);
 
-  int64_t start = HighResolutionTimer::Counter();
+  // The clock is read after every task, so use the cheapest one.
+  int64_t start = HighResolutionTimer::FastCounter();
   int64_t end = start + maxtime;
   int64_t last = start;
 
   size_t count = 0;
   while (ProcessNextTask()) {
-    int64_t now = HighResolutionTimer::Counter();
+    int64_t now = HighResolutionTimer::FastCounter();
     if (now >= end || got_quit_ || got_break_)
       break;
 
@@ -12,19 +12,31 @@
 
 #include <amio-eventloop.h>
 #include <am-thread-utils.h>
-#include <am-deque.h>
 
 namespace amio {
 
 using namespace ke;
 
+// Tasks are kept in intrusive, lock-free multi-producer, single-consumer
+// queues (Vyukov's algorithm), linked through Task::next_task_. Posting is a
+// single atomic exchange plus a store; there is no lock for producers to
+// contend on. There is one queue, or lane, per TaskPriority.
+//
+// A producer that has swapped itself in as the head, but not yet linked its
+// predecessor to it, hides itself and every task posted after it from the
+// consumer until it finishes. The consumer treats this like an empty queue;
+// the producer's notification, which comes after the link, covers it.
 class TaskQueueImpl : public TaskQueue
 {
  public:
-  TaskQueueImpl(Delegate *delegate);
+  TaskQueueImpl(Delegate *delegate, size_t capacity = 0);
   ~TaskQueueImpl();
 
+  using TaskQueue::PostTask;
   void PostTask(Task *task) override;
+  void PostTask(Task *task, TaskPriority priority) override;
+  bool TryPostTask(Task *task, TaskPriority priority) override;
+  void GetStats(TaskQueueStats *stats) override;
   void PostQuit() override;
   bool ProcessNextTask() override;
   bool ProcessTasks(struct timeval *timelimitp, size_t nlimit) override;
@@ -33,19 +45,77 @@ class TaskQueueImpl : public TaskQueue
     return got_quit_;
   }
 
+  // Run the highest-priority task that is at least as important as
+  // |lowest|. Returns whether a task was run.
+  bool ProcessNextTask(TaskPriority lowest);
+
+  // Run one idle task, if there is one.
+  bool ProcessIdleTask();
+
+  // Returns whether any urgent or normal tasks are waiting to be processed,
+  // including tasks that are still being posted. This must be called from
+  // the thread processing tasks.
+  bool HasPendingTasks();
+
+  // Same as HasPendingTasks(), for idle tasks.
+  bool HasIdleTasks();
+
  private:
   bool ProcessTasksForTime(struct timeval *timelimitp, size_t nlimit);
   bool ProcessTasks(size_t nlimit);
 
-  bool RefillWorkQueue();
+  // |depth| is the queue depth including the new task.
+  void post(size_t depth, Task *task, TaskPriority priority);
+  bool runTask(Task *task);
+
+ private:
+  class StubTask : public Task
+  {
+   public:
+    void Run() override
+    {}
+    void DeleteMe() override
+    {}
+  };
+
+  class Lane
+  {
+   public:
+    Lane();
+
+    void push(Task *task);
+    Task *pop();
+    bool empty();
 
-  void ZapQueue(Deque<Task *> *queue);
+   private:
+    // Producers swap themselves in at |head_|; the consumer pops from
+    // |tail_|. Keep them, and the next lane, on separate cache lines.
+    Task *head_;
+    char head_padding_[64 - sizeof(Task *)];
+    Task *tail_;
+    StubTask stub_;
+    char tail_padding_[64 - sizeof(Task *) - sizeof(StubTask) % 64];
+  };
+
+  static const size_t kNumLanes = 3;
+
+  Lane &lane(TaskPriority priority) {
+    return lanes_[size_t(priority)];
+  }
 
  private:
   Delegate *delegate_;
-  AutoPtr<Mutex> queue_lock_;
-  AutoPtr<Deque<Task *>> incoming_;
-  AutoPtr<Deque<Task *>> work_;
+  Lane lanes_[kNumLanes];
+
+  // The depth is adjusted atomically by producers and the consumer. The
+  // high-water mark is only written when it grows, so it stays cheap to
+  // read. Each is on its own cache line.
+  size_t capacity_;
+  size_t depth_;
+  char depth_padding_[64 - sizeof(size_t)];
+  size_t high_water_;
+  char high_water_padding_[64 - sizeof(size_t)];
+
   int64_t timer_res_;
   volatile bool got_break_;
   volatile bool got_quit_;
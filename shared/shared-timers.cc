@@ -0,0 +1,409 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <assert.h>
+#include <string.h>
+#include <amio-time.h>
+#include <am-vector.h>
+#include "shared-timers.h"
+#if defined(_MSC_VER)
+# include <intrin.h>
+#endif
+
+using namespace ke;
+using namespace amio;
+
+static const int64_t kMaxTime = INT64_MAX;
+
+// The event loop is not blocked waiting for anything.
+static const int64_t kNotWaiting = -1;
+
+static inline size_t
+CountTrailingZeroes(uint64_t bits)
+{
+  assert(bits);
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return index;
+#else
+  return __builtin_ctzll(bits);
+#endif
+}
+
+TimerWheel::TimerWheel(int64_t now)
+ : cur_tick_(now >> kTickShift),
+   count_(0)
+{
+  memset(occupied_, 0, sizeof(occupied_));
+}
+
+void
+TimerWheel::Insert(Entry *entry, int64_t deadline)
+{
+  assert(!entry->in_wheel_);
+  entry->deadline_ = deadline;
+  place(entry);
+  count_++;
+}
+
+void
+TimerWheel::Remove(Entry *entry)
+{
+  unlink(entry);
+  count_--;
+}
+
+void
+TimerWheel::place(Entry *entry)
+{
+  int64_t expires = ke::Max(entry->deadline_ >> kTickShift, cur_tick_);
+  int64_t delta = expires - cur_tick_;
+
+  size_t level = 0;
+  while (level < kLevels - 1 && delta >= (int64_t(1) << ((level + 1) * kLevelBits)))
+    level++;
+
+  // Anything past the end of the wheel is parked in the last level. Since we
+  // keep the real deadline, it is placed correctly once it cascades.
+  int64_t range = int64_t(1) << (kLevels * kLevelBits);
+  if (delta >= range)
+    expires = cur_tick_ + range - 1;
+
+  size_t slot = size_t(expires >> (level * kLevelBits)) & kSlotMask;
+  entry->level_ = uint8_t(level);
+  entry->slot_ = uint8_t(slot);
+  entry->in_wheel_ = true;
+  slots_[level][slot].append(entry);
+  occupied_[level] |= uint64_t(1) << slot;
+}
+
+void
+TimerWheel::unlink(Entry *entry)
+{
+  assert(entry->in_wheel_);
+
+  InlineList<Entry> &list = slots_[entry->level_][entry->slot_];
+  list.remove(entry);
+  if (list.empty())
+    occupied_[entry->level_] &= ~(uint64_t(1) << entry->slot_);
+  entry->in_wheel_ = false;
+}
+
+void
+TimerWheel::cascade(size_t level)
+{
+  if (level >= kLevels)
+    return;
+
+  // If this level just wrapped around, the level above must cascade first,
+  // since it may have entries due in the slot we're about to empty.
+  size_t slot = size_t(cur_tick_ >> (level * kLevelBits)) & kSlotMask;
+  if (slot == 0)
+    cascade(level + 1);
+
+  if (!(occupied_[level] & (uint64_t(1) << slot)))
+    return;
+
+  // Detach the whole slot first, since an entry parked a full rotation ahead
+  // goes right back into it.
+  InlineList<Entry> &list = slots_[level][slot];
+  InlineList<Entry> pending;
+  while (!list.empty()) {
+    Entry *entry = *list.begin();
+    list.remove(entry);
+    pending.append(entry);
+  }
+  occupied_[level] &= ~(uint64_t(1) << slot);
+
+  while (!pending.empty()) {
+    Entry *entry = *pending.begin();
+    pending.remove(entry);
+    place(entry);
+  }
+}
+
+void
+TimerWheel::Advance(int64_t now, InlineList<Entry> *expired)
+{
+  int64_t target = now >> kTickShift;
+  while (cur_tick_ < target) {
+    if (count_ == 0) {
+      cur_tick_ = target;
+      break;
+    }
+
+    if (!occupied_[0]) {
+      // Nothing is due before the next cascade, so skip straight to it.
+      int64_t next = (cur_tick_ | int64_t(kSlotMask)) + 1;
+      if (next > target) {
+        cur_tick_ = target;
+        break;
+      }
+      cur_tick_ = next;
+      cascade(1);
+      continue;
+    }
+
+    // Everything in a slot we've moved past has expired.
+    InlineList<Entry> &list = slots_[0][size_t(cur_tick_) & kSlotMask];
+    while (!list.empty()) {
+      Entry *entry = *list.begin();
+      Remove(entry);
+      expired->append(entry);
+    }
+
+    cur_tick_++;
+    if ((size_t(cur_tick_) & kSlotMask) == 0)
+      cascade(1);
+  }
+
+  // The current tick is only partially over.
+  InlineList<Entry> &list = slots_[0][size_t(cur_tick_) & kSlotMask];
+  for (InlineList<Entry>::iterator iter = list.begin(); iter != list.end(); ) {
+    Entry *entry = *iter;
+    iter++;
+    if (entry->deadline_ <= now) {
+      Remove(entry);
+      expired->append(entry);
+    }
+  }
+}
+
+void
+TimerWheel::RemoveAll(InlineList<Entry> *out)
+{
+  for (size_t level = 0; level < kLevels; level++) {
+    for (size_t slot = 0; slot < kSlotsPerLevel; slot++) {
+      InlineList<Entry> &list = slots_[level][slot];
+      while (!list.empty()) {
+        Entry *entry = *list.begin();
+        Remove(entry);
+        out->append(entry);
+      }
+    }
+  }
+  assert(count_ == 0);
+}
+
+size_t
+TimerWheel::nextOccupied(size_t level, size_t start) const
+{
+  uint64_t bits = occupied_[level];
+  if (!bits)
+    return kSlotsPerLevel;
+  if (start)
+    bits = (bits >> start) | (bits << (kSlotsPerLevel - start));
+  return CountTrailingZeroes(bits);
+}
+
+int64_t
+TimerWheel::NextTimeout(int64_t now)
+{
+  if (count_ == 0)
+    return kNoTimeout;
+
+  int64_t next = kMaxTime;
+
+  // Level 0 slots are one tick each, so the first occupied slot holds the
+  // earliest deadlines.
+  size_t start = size_t(cur_tick_) & kSlotMask;
+  size_t offset = nextOccupied(0, start);
+  if (offset < kSlotsPerLevel) {
+    InlineList<Entry> &list = slots_[0][(start + offset) & kSlotMask];
+    for (InlineList<Entry>::iterator iter = list.begin(); iter != list.end(); iter++)
+      next = ke::Min(next, iter->deadline_);
+  }
+
+  // For higher levels, we have to wake up when the first occupied slot
+  // cascades. The current slot has already cascaded, so anything in it is a
+  // full rotation away; start searching from the slot after it.
+  for (size_t level = 1; level < kLevels; level++) {
+    size_t shift = level * kLevelBits;
+    size_t distance = nextOccupied(level, (size_t(cur_tick_ >> shift) + 1) & kSlotMask);
+    if (distance == kSlotsPerLevel)
+      continue;
+    offset = distance + 1;
+
+    int64_t tick = ((cur_tick_ >> shift) + int64_t(offset)) << shift;
+    next = ke::Min(next, tick << kTickShift);
+  }
+
+  return ke::Max(next - now, int64_t(0));
+}
+
+TimerImpl::TimerImpl(TimerQueue *queue, Task *task)
+ : queue_(queue),
+   task_(task)
+{
+}
+
+TimerImpl::~TimerImpl()
+{
+  assert(!task_);
+}
+
+bool
+TimerImpl::Cancel()
+{
+  return queue_->cancel(this);
+}
+
+bool
+TimerImpl::IsPending()
+{
+  AutoLock lock(&queue_->lock_);
+  return !!task_;
+}
+
+TimerQueue::TimerQueue(TaskQueue::Delegate *delegate)
+ : delegate_(delegate),
+   wheel_(HighResolutionTimer::Counter()),
+   wakeup_time_(kNotWaiting),
+   shutdown_(false)
+{
+}
+
+TimerQueue::~TimerQueue()
+{
+  // Pending timers keep us alive, so there can't be any left.
+  assert(wheel_.empty());
+  assert(expired_.empty());
+}
+
+PassRef<Timer>
+TimerQueue::PostDelayedTask(Task *task, int64_t delayNs)
+{
+  assert(task);
+
+  Ref<TimerImpl> timer = new TimerImpl(this, task);
+
+  AutoLock lock(&lock_);
+  if (shutdown_) {
+    timer->task_ = nullptr;
+    task->DeleteMe();
+    return nullptr;
+  }
+
+  int64_t now = HighResolutionTimer::Counter();
+  int64_t deadline = now + ke::Max(ke::Min(delayNs, kMaxTime - now), int64_t(0));
+  wheel_.Insert(timer, deadline);
+
+  // The queue holds a reference until the timer fires or is cancelled.
+  timer->AddRef();
+
+  // If the event loop is asleep and won't wake up in time, poke it.
+  if (wakeup_time_ != kNotWaiting && deadline < wakeup_time_) {
+    wakeup_time_ = deadline;
+    delegate_->NotifyTask();
+  }
+  return timer;
+}
+
+bool
+TimerQueue::cancel(TimerImpl *timer)
+{
+  Task *task;
+  {
+    AutoLock lock(&lock_);
+    if (!timer->task_)
+      return false;
+
+    if (timer->inWheel())
+      wheel_.Remove(timer);
+    else
+      expired_.remove(timer);
+
+    task = timer->task_;
+    timer->task_ = nullptr;
+  }
+
+  task->DeleteMe();
+  timer->Release();
+  return true;
+}
+
+bool
+TimerQueue::ProcessNextTask(int64_t now)
+{
+  TimerImpl *timer;
+  Task *task;
+  {
+    AutoLock lock(&lock_);
+    if (expired_.empty()) {
+      if (wheel_.empty())
+        return false;
+      wheel_.Advance(now, &expired_);
+      if (expired_.empty())
+        return false;
+    }
+
+    // Expired timers stay in the queue until they run, so they can still be
+    // cancelled.
+    timer = static_cast<TimerImpl *>(*expired_.begin());
+    expired_.remove(timer);
+
+    task = timer->task_;
+    timer->task_ = nullptr;
+  }
+
+  task->Run();
+  task->DeleteMe();
+  timer->Release();
+  return true;
+}
+
+int64_t
+TimerQueue::PrepareToWait()
+{
+  AutoLock lock(&lock_);
+
+  int64_t now = HighResolutionTimer::Counter();
+  int64_t timeout = expired_.empty() ? wheel_.NextTimeout(now) : 0;
+  if (timeout == kNoTimeout)
+    wakeup_time_ = kMaxTime;
+  else
+    wakeup_time_ = now + timeout;
+  return timeout;
+}
+
+void
+TimerQueue::FinishWait()
+{
+  AutoLock lock(&lock_);
+  wakeup_time_ = kNotWaiting;
+}
+
+void
+TimerQueue::Shutdown()
+{
+  Vector<TimerImpl *> timers;
+  Vector<Task *> tasks;
+  {
+    AutoLock lock(&lock_);
+    shutdown_ = true;
+    delegate_ = nullptr;
+    wakeup_time_ = kNotWaiting;
+
+    wheel_.RemoveAll(&expired_);
+    while (!expired_.empty()) {
+      TimerImpl *timer = static_cast<TimerImpl *>(*expired_.begin());
+      expired_.remove(timer);
+
+      tasks.append(timer->task_);
+      timers.append(timer);
+      timer->task_ = nullptr;
+    }
+  }
+
+  for (size_t i = 0; i < tasks.length(); i++)
+    tasks[i]->DeleteMe();
+  for (size_t i = 0; i < timers.length(); i++)
+    timers[i]->Release();
+}
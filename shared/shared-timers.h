@@ -0,0 +1,176 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_timers_h_
+#define _include_amio_timers_h_
+
+#include <amio-eventloop.h>
+#include <am-thread-utils.h>
+#include <am-inlinelist.h>
+#include <am-refcounting-threadsafe.h>
+#include <stdint.h>
+
+namespace amio {
+
+using namespace ke;
+
+// A hierarchical timing wheel. Each level has 64 slots, and each slot in
+// level N covers 64 slots of level N-1; level 0 slots are one tick (~1ms)
+// wide. Inserting and removing an entry is O(1), and entries are cascaded
+// into lower levels as time advances, so each entry is touched at most once
+// per level.
+//
+// Entries keep their exact deadline, so nothing fires early, and the wheel
+// can report the next deadline with sub-tick precision once an entry has
+// reached level 0.
+//
+// The wheel is not thread-safe.
+class TimerWheel
+{
+ public:
+  class Entry : public InlineListNode<Entry>
+  {
+    friend class TimerWheel;
+
+   public:
+    Entry()
+     : deadline_(0),
+       level_(0),
+       slot_(0),
+       in_wheel_(false)
+    {}
+
+    int64_t deadline() const {
+      return deadline_;
+    }
+    bool inWheel() const {
+      return in_wheel_;
+    }
+
+   private:
+    int64_t deadline_;
+    uint8_t level_;
+    uint8_t slot_;
+    bool in_wheel_;
+  };
+
+  // |now| is the current time, in nanoseconds.
+  TimerWheel(int64_t now);
+
+  // Add an entry that expires at |deadline|, in nanoseconds.
+  void Insert(Entry *entry, int64_t deadline);
+
+  // Remove an entry that is still in the wheel.
+  void Remove(Entry *entry);
+
+  // Advance the wheel to |now|, and append every entry whose deadline has
+  // passed to |expired|.
+  void Advance(int64_t now, InlineList<Entry> *expired);
+
+  // Remove every entry, appending them to |out|.
+  void RemoveAll(InlineList<Entry> *out);
+
+  // Return the number of nanoseconds until the wheel next needs to be
+  // advanced, or kNoTimeout if it is empty. This may be earlier than the
+  // next deadline, if an entry needs to cascade first.
+  int64_t NextTimeout(int64_t now);
+
+  bool empty() const {
+    return count_ == 0;
+  }
+
+ private:
+  static const int64_t kTickShift = 20;
+  static const size_t kLevelBits = 6;
+  static const size_t kSlotsPerLevel = size_t(1) << kLevelBits;
+  static const size_t kSlotMask = kSlotsPerLevel - 1;
+  static const size_t kLevels = 6;
+
+  void place(Entry *entry);
+  void unlink(Entry *entry);
+  void cascade(size_t level);
+
+  // Return the distance from |start| to the next occupied slot in |level|,
+  // wrapping around, or kSlotsPerLevel if the level is empty.
+  size_t nextOccupied(size_t level, size_t start) const;
+
+ private:
+  int64_t cur_tick_;
+  size_t count_;
+  uint64_t occupied_[kLevels];
+  InlineList<Entry> slots_[kLevels][kSlotsPerLevel];
+};
+
+class TimerQueue;
+
+class TimerImpl
+ : public Timer,
+   public TimerWheel::Entry,
+   public ke::RefcountedThreadsafe<TimerImpl>
+{
+  friend class TimerQueue;
+
+ public:
+  TimerImpl(TimerQueue *queue, Task *task);
+  ~TimerImpl();
+
+  KE_IMPL_REFCOUNTING_TS(TimerImpl);
+
+  bool Cancel() override;
+  bool IsPending() override;
+
+ private:
+  // Pending timers are owned by the queue; the handle keeps the queue alive
+  // so Cancel() is safe after the event loop is gone.
+  Ref<TimerQueue> queue_;
+  Task *task_;
+};
+
+// Delayed tasks for an event loop. Tasks may be posted and cancelled from
+// any thread, but only the event loop thread may run them.
+//
+// The event loop should call PrepareToWait() to get its poll timeout, and
+// FinishWait() after waking up. If a timer is posted that expires before the
+// loop was going to wake up, the delegate's NotifyTask() is called.
+class TimerQueue : public ke::RefcountedThreadsafe<TimerQueue>
+{
+  friend class TimerImpl;
+
+ public:
+  TimerQueue(TaskQueue::Delegate *delegate);
+  ~TimerQueue();
+
+  PassRef<Timer> PostDelayedTask(Task *task, int64_t delayNs);
+
+  // Run at most one expired task, treating |now| as the current time.
+  // Returns whether a task was run.
+  bool ProcessNextTask(int64_t now);
+
+  // Return the timeout to wait for, in nanoseconds, or kNoTimeout.
+  int64_t PrepareToWait();
+  void FinishWait();
+
+  // Discard all pending tasks. No more tasks may be posted afterward.
+  void Shutdown();
+
+ private:
+  bool cancel(TimerImpl *timer);
+
+ private:
+  Mutex lock_;
+  TaskQueue::Delegate *delegate_;
+  TimerWheel wheel_;
+  InlineList<TimerWheel::Entry> expired_;
+  int64_t wakeup_time_;
+  bool shutdown_;
+};
+
+} // namespace amio
+
+#endif // _include_amio_timers_h_
@@ -150,8 +150,13 @@ DevPollImpl::handleEvent(int fd)
   // If we're edge-triggered, remove this flag. It is fairly complex to add
   // the flag after we call the handler, since the user may have removed it.
   // Instead we just add it back immediately even if this means slightly more
-  // calls to write().
-  if (transport->flags() & kTransportET) {
+  // calls to write(). One-shot transports lose all of their events.
+  if (transport->flags() & kTransportOneShot) {
+    if (Ref<IOError> error = rm_events_locked(transport, kTransportEventMask)) {
+      reportError_locked(transport, error);
+      return;
+    }
+  } else if (transport->flags() & kTransportET) {
     if (Ref<IOError> error = rm_events_locked(transport, inFlag)) {
       reportError_locked(transport, error);
       return;
@@ -173,14 +178,14 @@ DevPollImpl::handleEvent(int fd)
 }
 
 PassRef<IOError>
-DevPollImpl::Poll(int timeoutMs)
+DevPollImpl::PollNs(int64_t timeoutNs)
 {
   AutoMaybeLock poll_lock(poll_lock_);
 
   struct dvpoll params;
   params.dp_fds = event_buffer_.get();
   params.dp_nfds = event_buffer_.length();
-  params.dp_timeout = timeoutMs;
+  params.dp_timeout = TimeoutToMs(timeoutNs);
 
   int nevents = AMIO_RETRY_IF_EINTR(ioctl(dp_, DP_POLL, &params));
   if (nevents == -1)
@@ -194,6 +199,7 @@ DevPollImpl::Poll(int timeoutMs)
     int slot = pe.fd;
     if (isFdChanged(slot))
       continue;
+    eventDispatched();
 
     // Handle errors first.
     if (pe.revents & POLLERR) {
@@ -32,7 +32,7 @@ class DevPollImpl : public PosixPoller
   ~DevPollImpl();
 
   PassRef<IOError> Initialize(size_t maxEventsPerPoll = 0);
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return false;
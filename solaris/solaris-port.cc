@@ -132,7 +132,10 @@ PortImpl::handleEvent(size_t slot)
     return;
 
   // If edge-triggered, we don't want to re-arm later, so take the flag off.
-  if (transport->flags() & kTransportET)
+  // One-shot transports stay disarmed until the user asks for more events.
+  if (transport->flags() & kTransportOneShot)
+    transport->flags() &= ~kTransportEventMask;
+  else if (transport->flags() & kTransportET)
     transport->flags() &= ~outFlag;
 
   // Port is no longer armed after port_get().
@@ -156,6 +159,8 @@ PortImpl::handleEvent(size_t slot)
   // Don't re-arm if the fd changed or the port is already re-armed.
   if (isFdChanged(slot) || (transport->flags() & kTransportArmed))
     return;
+  if (transport->flags() & kTransportOneShot)
+    return;
 
   // Note: we rely on change_events_locked() not checking prior flags.
   if (Ref<IOError> error = change_events_locked(transport, transport->flags() & kTransportEventMask))
@@ -163,15 +168,10 @@ PortImpl::handleEvent(size_t slot)
 }
 
 PassRef<IOError>
-PortImpl::Poll(int timeoutMs)
+PortImpl::PollNs(int64_t timeoutNs)
 {
   timespec_t timeout;
-  timespec_t *timeoutp = nullptr;
-  if (timeoutMs != kNoTimeout) {
-    timeout.tv_sec = timeoutMs / 1000;
-    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
-    timeoutp = &timeout;
-  }
+  timespec_t *timeoutp = TimeoutToTimespec(timeoutNs, &timeout);
 
   // Note: no poll lock, we're concurrent.
   MultiPollBuffer<port_event_t>::Use use(event_buffers_);
@@ -201,6 +201,7 @@ PortImpl::Poll(int timeoutMs)
     if (isFdChanged(slot))
       continue;
     assert(int(event.portev_object) == fds_[slot].transport->fd());
+    eventDispatched();
 
     int events = event.portev_events;
     if (events & POLLHUP) {
@@ -35,7 +35,7 @@ class PortImpl : public PosixPoller
   ~PortImpl();
 
   PassRef<IOError> Initialize(size_t maxEventsPerPoll = 0);
-  PassRef<IOError> Poll(int timeoutMs) override;
+  PassRef<IOError> PollNs(int64_t timeoutNs) override;
   void Shutdown() override;
   bool SupportsEdgeTriggering() override {
     return false;
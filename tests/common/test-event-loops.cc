@@ -10,7 +10,9 @@
 #include <amio.h>
 #include <amio-net.h>
 #include <amio-eventloop.h>
+#include <amio-time.h>
 #include <am-thread-utils.h>
+#include <am-vector.h>
 #include "../testing.h"
 
 using namespace ke;
@@ -54,6 +56,196 @@ class RemoteQuit : public Task
   EventLoopForIO *loop_;
 };
 
+class RecordTask : public Task
+{
+ public:
+  RecordTask(Vector<int> *log, int id, EventLoop *quit = nullptr)
+   : log_(log),
+     id_(id),
+     quit_(quit)
+  {}
+  ~RecordTask() {
+    log_->append(-id_);
+  }
+
+  void Run() override {
+    log_->append(id_);
+    if (quit_)
+      quit_->PostQuit();
+  }
+
+ private:
+  Vector<int> *log_;
+  int id_;
+  EventLoop *quit_;
+};
+
+class PostDelayedQuit : public IRunnable
+{
+ public:
+  PostDelayedQuit(EventLoop *loop, Vector<int> *log)
+   : loop_(loop),
+     log_(log)
+  {}
+
+  void Run() override {
+    timer_ = loop_->PostDelayedTask(new RecordTask(log_, 1, loop_), kNanosecondsPerMillisecond);
+  }
+
+ private:
+  EventLoop *loop_;
+  Vector<int> *log_;
+  Ref<Timer> timer_;
+};
+
+class StartThread : public Task
+{
+ public:
+  StartThread(IRunnable *runnable, AutoPtr<Thread> *thread)
+   : runnable_(runnable),
+     thread_(thread)
+  {}
+
+  void Run() override {
+    *thread_ = new Thread(runnable_);
+  }
+
+ private:
+  IRunnable *runnable_;
+  AutoPtr<Thread> *thread_;
+};
+
+struct CountState
+{
+  Mutex lock;
+  size_t count;
+  size_t total;
+  EventLoop *loop;
+};
+
+class CountTask : public Task
+{
+ public:
+  CountTask(CountState *state)
+   : state_(state)
+  {}
+
+  void Run() override {
+    AutoLock lock(&state_->lock);
+    if (++state_->count == state_->total)
+      state_->loop->PostQuit();
+  }
+
+ private:
+  CountState *state_;
+};
+
+class PostManyTasks : public IRunnable
+{
+ public:
+  PostManyTasks(CountState *state, size_t count)
+   : state_(state),
+     count_(count)
+  {}
+
+  void Run() override {
+    for (size_t i = 0; i < count_; i++)
+      state_->loop->PostTask(new CountTask(state_));
+  }
+
+ private:
+  CountState *state_;
+  size_t count_;
+};
+
+// Keeps the task queue non-empty until it has run |total| times.
+class FloodTask : public Task
+{
+ public:
+  FloodTask(EventLoop *loop, size_t *count, size_t total, bool quit = true)
+   : loop_(loop),
+     count_(count),
+     total_(total),
+     quit_(quit)
+  {}
+
+  void Run() override {
+    if (++*count_ < total_)
+      loop_->PostTask(new FloodTask(loop_, count_, total_, quit_));
+    else if (quit_)
+      loop_->PostQuit();
+  }
+
+ private:
+  EventLoop *loop_;
+  size_t *count_;
+  size_t total_;
+  bool quit_;
+};
+
+class IterationRecorder : public LoopObserver
+{
+ public:
+  IterationRecorder()
+   : iterations(0),
+     max_tasks(0),
+     events(0),
+     nonblocking_with_events(0)
+  {}
+
+  void OnLoopIteration(const LoopIterationStats &stats) override {
+    iterations++;
+    events += stats.events;
+    max_tasks = ke::Max(max_tasks, stats.tasks + stats.timers);
+    if (!stats.waited && stats.events)
+      nonblocking_with_events++;
+  }
+
+  size_t iterations;
+  size_t max_tasks;
+  size_t events;
+  size_t nonblocking_with_events;
+};
+
+#if defined(KE_POSIX)
+// Detaches its transport and quits the loop on the first write event.
+class DetachOnWrite
+ : public StatusListener,
+   public ke::Refcounted<DetachOnWrite>
+{
+ public:
+  DetachOnWrite(Ref<EventLoopForIO> loop, Ref<Transport> transport)
+   : loop_(loop),
+     transport_(transport),
+     nevents(0),
+     nattached(0)
+  {}
+
+  KE_IMPL_REFCOUNTING(DetachOnWrite);
+
+  void OnWriteReady() override {
+    nevents++;
+    nattached = loop_->NumTransports();
+    loop_->Detach(transport_);
+    EventLoop *evq = loop_;
+    evq->PostQuit();
+  }
+
+  void clear() {
+    loop_ = nullptr;
+    transport_ = nullptr;
+  }
+
+ private:
+  Ref<EventLoopForIO> loop_;
+  Ref<Transport> transport_;
+
+ public:
+  unsigned nevents;
+  size_t nattached;
+};
+#endif
+
 class TestEventLoops
  : public Test,
    public ke::Refcounted<TestEventLoops>,
@@ -66,7 +258,9 @@ class TestEventLoops
  public:
   TestEventLoops()
    : Test("event-loops"),
-     nevents_(0)
+     nevents_(0),
+     flood_count_(nullptr),
+     flood_at_first_event_(0)
   {}
 
   KE_IMPL_REFCOUNTING(TestEventLoops);
@@ -95,20 +289,401 @@ class TestEventLoops
     return true;
   }
 
+  bool test_delayed_tasks() {
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+
+    // Tasks log their id when run, and the negated id when freed.
+    Vector<int> log;
+    int64_t start = HighResolutionTimer::Counter();
+    Ref<Timer> t1 = loop->PostDelayedTask(new RecordTask(&log, 1, loop), 30 * kNanosecondsPerMillisecond);
+    Ref<Timer> t2 = loop->PostDelayedTask(new RecordTask(&log, 2), 10 * kNanosecondsPerMillisecond);
+    Ref<Timer> t3 = loop->PostDelayedTask(new RecordTask(&log, 3), 20 * kNanosecondsPerMillisecond);
+    Ref<Timer> t4 = loop->PostDelayedTask(new RecordTask(&log, 4), 0);
+    if (!check(t1 && t2 && t3 && t4, "post delayed tasks"))
+      return false;
+
+    if (!check(t3->Cancel(), "cancel pending timer"))
+      return false;
+    if (!check(!t3->IsPending() && !t3->Cancel(), "timer is no longer pending"))
+      return false;
+
+    loop->Loop();
+    int64_t elapsed = HighResolutionTimer::Counter() - start;
+
+    static const int kExpected[] = { -3, 4, -4, 2, -2, 1, -1 };
+    bool matches = log.length() == sizeof(kExpected) / sizeof(kExpected[0]);
+    for (size_t i = 0; matches && i < log.length(); i++)
+      matches = (log[i] == kExpected[i]);
+    if (!check(matches, "tasks ran in deadline order")) {
+      for (size_t i = 0; i < log.length(); i++)
+        print_actual("%d", log[i]);
+      return false;
+    }
+    if (!check(elapsed >= 30 * kNanosecondsPerMillisecond, "waited for the last timer"))
+      return false;
+    if (!check(!t1->IsPending() && !t1->Cancel(), "cannot cancel a timer that ran"))
+      return false;
+
+    // Timers still pending when the loop is destroyed are discarded.
+    Ref<Timer> t5 = loop->PostDelayedTask(new RecordTask(&log, 5), kNanosecondsPerSecond);
+    loop = nullptr;
+    if (!check(!t5->IsPending() && log.back() == -5, "shutdown discarded pending timer"))
+      return false;
+
+    // Posting to a loop that has been shut down frees the task.
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+    static_cast<EventLoop *>(loop.get())->Shutdown();
+    Ref<Timer> t6 = loop->PostDelayedTask(new RecordTask(&log, 6), 0);
+    if (!check(!t6 && log.back() == -6, "post after shutdown freed the task"))
+      return false;
+    return true;
+  }
+
+  bool test_remote_delayed_task() {
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+
+    // The loop has nothing to wait for, so it blocks indefinitely. A timer
+    // posted from another thread must wake it up.
+    Vector<int> log;
+    AutoPtr<Thread> thread;
+    PostDelayedQuit poster(loop, &log);
+    loop->PostTask(new StartThread(&poster, &thread));
+    loop->Loop();
+    if (thread)
+      thread->Join();
+
+    if (!check(log.length() >= 1 && log[0] == 1, "remote timer woke up the loop"))
+      return false;
+    return true;
+  }
+
+  bool test_remote_posts() {
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+
+    // Several threads race to post tasks while the loop alternates between
+    // running them and going to sleep. If a wakeup is ever lost, the loop
+    // hangs.
+    static const size_t kThreads = 4;
+    static const size_t kTasksPerThread = 20000;
+
+    CountState state;
+    state.count = 0;
+    state.total = kThreads * kTasksPerThread;
+    state.loop = loop;
+
+    PostManyTasks poster(&state, kTasksPerThread);
+    AutoPtr<Thread> threads[kThreads];
+    for (size_t i = 0; i < kThreads; i++) {
+      threads[i] = new Thread(&poster);
+      if (!check(threads[i]->Succeeded(), "start posting thread"))
+        return false;
+    }
+
+    loop->Loop();
+    for (size_t i = 0; i < kThreads; i++)
+      threads[i]->Join();
+
+    if (!check(state.count == state.total, "all remote tasks ran")) {
+      print_actual("%d", int(state.count));
+      return false;
+    }
+    return true;
+  }
+
+  bool test_priorities() {
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+
+    // The idle task must wait for the whole flood, even though the flood
+    // spans many iterations. The urgent task jumps ahead of it.
+    static const size_t kFloodSize = 500;
+    size_t count = 0;
+    size_t idle_at = 0;
+    size_t urgent_at = kFloodSize;
+    EventLoop *loopp = loop;
+    loop->PostTask([&count, &idle_at, loopp]() -> void {
+      idle_at = count;
+      loopp->PostQuit();
+    }, TaskPriority::Idle);
+    loop->PostTask(new FloodTask(loop, &count, kFloodSize, false));
+    loop->PostTask([&count, &urgent_at]() -> void {
+      urgent_at = count;
+    }, TaskPriority::Urgent);
+    loop->Loop();
+
+    if (!check(urgent_at == 0, "urgent task ran first"))
+      return false;
+    if (!check(idle_at == kFloodSize, "idle task waited for the flood")) {
+      print_actual("%d", int(idle_at));
+      return false;
+    }
+    return true;
+  }
+
+  bool test_loop_group() {
+    EventLoopGroupOptions options;
+    options.numLoops = 3;
+    options.pinThreads = true;
+
+    Ref<EventLoopGroup> group;
+    if (!check_error(EventLoopGroup::Create(&group, options), "create loop group"))
+      return false;
+    if (!check(group->NumLoops() == 3, "group has 3 loops"))
+      return false;
+
+    bool in_order = true;
+    for (size_t i = 0; i < 6; i++) {
+      Ref<EventLoopForIO> loop = group->Next();
+      in_order &= (loop == group->GetLoop(i % 3));
+    }
+    if (!check(in_order, "round-robin visits each loop in turn"))
+      return false;
+
+    // Every loop should be running on its own thread.
+    Ref<EventLoopForIO> main;
+    if (!check_error(EventLoopForIO::Create(&main, nullptr), "create main loop"))
+      return false;
+
+    CountState state;
+    state.count = 0;
+    state.total = group->NumLoops();
+    state.loop = main;
+    for (size_t i = 0; i < group->NumLoops(); i++)
+      group->GetLoop(i)->PostTask(new CountTask(&state));
+    main->Loop();
+    if (!check(state.count == state.total, "every loop ran a task"))
+      return false;
+
+    group->Shutdown();
+    if (!check(!group->Next(), "no loops after shutdown"))
+      return false;
+    return true;
+  }
+
+#if defined(KE_POSIX)
+  bool test_loop_group_least_loaded() {
+    EventLoopGroupOptions options;
+    options.numLoops = 2;
+    options.policy = EventLoopGroupOptions::Policy::LeastLoaded;
+
+    Ref<EventLoopGroup> group;
+    if (!check_error(EventLoopGroup::Create(&group, options), "create loop group"))
+      return false;
+
+    Ref<Transport> reader, writer;
+    if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+      return false;
+
+    Ref<EventLoopForIO> main;
+    if (!check_error(EventLoopForIO::Create(&main, nullptr), "create main loop"))
+      return false;
+
+    // Attach a transport to the first loop, from its own thread.
+    EventLoopForIO *busy = group->GetLoop(0);
+    EventLoopForIO *mainp = main;
+    Transport *transport = reader;
+    StatusListener *listener = this;
+    Ref<IOError> error;
+    busy->PostTask([busy, mainp, transport, listener, &error]() -> void {
+      error = busy->Attach(transport, listener, Events::Read, EventMode::Level);
+      mainp->PostQuit();
+    });
+    main->Loop();
+    if (!check_error(error, "attach to first loop"))
+      return false;
+
+    bool avoided = true;
+    for (size_t i = 0; i < 4; i++)
+      avoided &= (group->Next() != busy);
+    if (!check(avoided, "least-loaded avoids the busy loop"))
+      return false;
+
+    group->Shutdown();
+    return true;
+  }
+#endif
+
 #if defined(KE_POSIX)
+  bool test_task_batches() {
+    IterationRecorder recorder;
+
+    EventLoopOptions options;
+    options.maxTasksPerIteration = 16;
+    options.observer = &recorder;
+
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr, options), "create loop"))
+      return false;
+
+    // The write end of a pipe is always writable, so a level-triggered
+    // transport fires on every poll that gets to run.
+    Ref<Transport> reader, writer;
+    if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+      return false;
+    if (!check_error(loop->Attach(writer, this, Events::Write, EventMode::Level), "attach"))
+      return false;
+
+    static const size_t kFloodSize = 1000;
+    size_t count = 0;
+    nevents_ = 0;
+    flood_count_ = &count;
+    flood_at_first_event_ = 0;
+    loop->PostTask(new FloodTask(loop, &count, kFloodSize));
+    loop->Loop();
+    flood_count_ = nullptr;
+
+    if (!check(count == kFloodSize, "flood ran to completion"))
+      return false;
+    if (!check(nevents_ > 0 && flood_at_first_event_ < kFloodSize, "I/O ran during the flood"))
+      return false;
+    if (!check(recorder.max_tasks <= 16, "iterations ran at most 16 tasks")) {
+      print_actual("%d", int(recorder.max_tasks));
+      return false;
+    }
+    if (!check(recorder.iterations >= kFloodSize / 16, "flood took many iterations"))
+      return false;
+    if (!check(recorder.nonblocking_with_events > 0, "events were polled without blocking"))
+      return false;
+    return true;
+  }
+
+  bool test_direct_dispatch() {
+    IterationRecorder recorder;
+
+    EventLoopOptions options;
+    options.directDispatch = true;
+    options.observer = &recorder;
+
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr, options), "create loop"))
+      return false;
+
+    Ref<Transport> reader, writer;
+    if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+      return false;
+
+    Ref<DetachOnWrite> listener = new DetachOnWrite(loop, writer);
+    if (!check_error(loop->Attach(writer, listener, Events::Write, EventMode::Level), "attach"))
+      return false;
+    if (!check(loop->NumTransports() == 1, "one transport attached"))
+      return false;
+
+    // The write event quits the loop, and the iteration that handled it must
+    // not count as idle.
+    bool idle_ran = false;
+    loop->PostTask([&idle_ran]() -> void {
+      idle_ran = true;
+    }, TaskPriority::Idle);
+
+    loop->Loop();
+    listener->clear();
+
+    if (!check(listener->nevents == 1, "listener ran once"))
+      return false;
+    if (!check(listener->nattached == 1, "transport was attached during the callback"))
+      return false;
+    if (!check(loop->NumTransports() == 0, "transport was detached"))
+      return false;
+
+    // Listeners ran from inside the poller, but the event still counts.
+    if (!check(recorder.events == 1, "the listener's event was counted")) {
+      print_actual("%d", int(recorder.events));
+      return false;
+    }
+    if (!check(!idle_ran, "idle task did not run alongside I/O"))
+      return false;
+    return true;
+  }
+
   void OnWriteReady() override {
-    nevents_++;
+    if (!nevents_++ && flood_count_)
+      flood_at_first_event_ = *flood_count_;
   }
 #endif
 
+  bool test_loop_clock() {
+    Ref<EventLoopForIO> loop;
+    if (!check_error(EventLoopForIO::Create(&loop, nullptr), "create loop"))
+      return false;
+    EventLoop *evq = loop;
+
+    // Tasks in the same batch see the same time.
+    int64_t first = 0, second = 0;
+    evq->PostTask([&]() { first = evq->Now(); });
+    evq->PostTask([&]() { second = evq->Now(); });
+
+    // The clock is refreshed after the loop wakes up for a timer.
+    int64_t start = HighResolutionTimer::Counter();
+    int64_t fast_start = HighResolutionTimer::FastCounter();
+    int64_t woke = 0, fast_woke = 0;
+    evq->PostDelayedTask(NewTask([&]() {
+      woke = evq->Now();
+      fast_woke = HighResolutionTimer::FastCounter();
+      evq->PostQuit();
+    }), 20 * kNanosecondsPerMillisecond);
+    evq->Loop();
+    int64_t end = HighResolutionTimer::Counter();
+
+    if (!check(first && first == second, "tasks in a batch see the same time"))
+      return false;
+    if (!check(woke >= start + 20 * kNanosecondsPerMillisecond && woke <= end,
+               "clock was refreshed after waking"))
+    {
+      print_actual(KE_I64_FMT, woke - start);
+      return false;
+    }
+
+    // The fast counter should agree with the real clock within a few percent.
+    int64_t elapsed = woke - start;
+    int64_t fast_elapsed = fast_woke - fast_start;
+    if (!check(fast_elapsed >= elapsed - elapsed / 20 &&
+               fast_elapsed <= (end - start) + (end - start) / 20,
+               "fast counter tracks the clock"))
+    {
+      print_actual(KE_I64_FMT " vs " KE_I64_FMT, fast_elapsed, elapsed);
+      return false;
+    }
+    return true;
+  }
+
   bool Run() override {
     if (!test_basic())
       return false;
+    if (!test_loop_clock())
+      return false;
+    if (!test_delayed_tasks())
+      return false;
+    if (!test_remote_delayed_task())
+      return false;
+    if (!test_remote_posts())
+      return false;
+    if (!test_priorities())
+      return false;
+    if (!test_loop_group())
+      return false;
+#if defined(KE_POSIX)
+    if (!test_loop_group_least_loaded())
+      return false;
+    if (!test_task_batches())
+      return false;
+    if (!test_direct_dispatch())
+      return false;
+#endif
     return true;
   }
 
  private:
   unsigned nevents_;
+  size_t *flood_count_;
+  size_t flood_at_first_event_;
 };
 
 class SetupEventLoopTests
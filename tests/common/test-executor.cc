@@ -0,0 +1,398 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <amio.h>
+#include <amio-eventloop.h>
+#include <amio-executor.h>
+#include <amio-time.h>
+#include <am-thread-utils.h>
+#include <am-deque.h>
+#include <am-vector.h>
+#include "../testing.h"
+#if defined(_MSC_VER)
+# include <windows.h>
+#endif
+
+using namespace ke;
+using namespace amio;
+
+static thread_local bool sOnLoopThread = false;
+
+static inline long
+IncrementCounter(long *counter)
+{
+#if defined(_MSC_VER)
+  return InterlockedIncrement(counter);
+#else
+  return __atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+class ContinuationState
+{
+ public:
+  ContinuationState(EventLoop *loop, size_t total)
+   : loop(loop),
+     total(total),
+     finished(0),
+     off_thread(0)
+  {}
+
+  EventLoop *loop;
+  size_t total;
+  size_t finished;
+  size_t off_thread;
+};
+
+class ForkState
+{
+ public:
+  ForkState(Executor *executor, EventLoop *loop, long leaves)
+   : executor(executor),
+     loop(loop),
+     leaves(leaves),
+     done(0)
+  {}
+
+  Executor *executor;
+  EventLoop *loop;
+  long leaves;
+  long done;
+};
+
+// Submits two children until it reaches the bottom of the tree.
+class ForkTask : public Task
+{
+ public:
+  ForkTask(ForkState *state, int depth)
+   : state_(state),
+     depth_(depth)
+  {}
+
+  void Run() override {
+    if (depth_ > 0) {
+      state_->executor->Submit(new ForkTask(state_, depth_ - 1));
+      state_->executor->Submit(new ForkTask(state_, depth_ - 1));
+      return;
+    }
+    if (IncrementCounter(&state_->done) == state_->leaves)
+      state_->loop->PostQuit();
+  }
+
+ private:
+  ForkState *state_;
+  int depth_;
+};
+
+class TrackedTask : public Task
+{
+ public:
+  TrackedTask(bool *ran, bool *freed)
+   : ran_(ran),
+     freed_(freed)
+  {}
+  ~TrackedTask() {
+    *freed_ = true;
+  }
+
+  void Run() override {
+    *ran_ = true;
+  }
+
+ private:
+  bool *ran_;
+  bool *freed_;
+};
+
+class TestExecutor : public Test
+{
+ public:
+  TestExecutor()
+   : Test("executor")
+  {}
+
+  bool test_continuations(Executor *executor, EventLoop *loop) {
+    static const size_t kJobs = 100;
+    int64_t results[kJobs];
+
+    ContinuationState state(loop, kJobs);
+    for (size_t i = 0; i < kJobs; i++) {
+      int64_t *result = &results[i];
+      ContinuationState *statep = &state;
+      executor->Submit(
+        [result, i]() -> void {
+          int64_t sum = 0;
+          for (size_t n = 0; n <= i * 1000; n++)
+            sum += int64_t(n);
+          *result = sum;
+        },
+        loop,
+        [statep]() -> void {
+          if (!sOnLoopThread)
+            statep->off_thread++;
+          if (++statep->finished == statep->total)
+            statep->loop->PostQuit();
+        });
+    }
+
+    sOnLoopThread = true;
+    loop->Loop();
+    sOnLoopThread = false;
+
+    bool correct = true;
+    for (size_t i = 0; i < kJobs; i++) {
+      int64_t n = int64_t(i) * 1000;
+      correct &= (results[i] == n * (n + 1) / 2);
+    }
+    if (!check(state.finished == kJobs, "every continuation ran"))
+      return false;
+    if (!check(state.off_thread == 0, "continuations ran on the loop thread"))
+      return false;
+    if (!check(correct, "work computed the right results"))
+      return false;
+    return true;
+  }
+
+  bool test_nested(Executor *executor, EventLoop *loop) {
+    static const int kDepth = 10;
+    ForkState state(executor, loop, 1 << kDepth);
+    executor->Submit(new ForkTask(&state, kDepth));
+    loop->Loop();
+
+    if (!check(state.done == state.leaves, "nested work all ran"))
+      return false;
+    return true;
+  }
+
+  bool Run() override {
+    // Pool threads may still be posting to a loop after it quits, so the
+    // loops must outlive the executor.
+    Ref<EventLoopForIO> loop1, loop2, loop3;
+    if (!check_error(EventLoopForIO::Create(&loop1, nullptr), "create loop") ||
+        !check_error(EventLoopForIO::Create(&loop2, nullptr), "create loop") ||
+        !check_error(EventLoopForIO::Create(&loop3, nullptr), "create loop"))
+    {
+      return false;
+    }
+
+    Ref<Executor> executor;
+    if (!check_error(Executor::Create(&executor, 4), "create executor"))
+      return false;
+    if (!check(executor->NumThreads() == 4, "executor has 4 threads"))
+      return false;
+
+    if (!test_continuations(executor, loop1))
+      return false;
+    if (!test_nested(executor, loop2))
+      return false;
+
+    // Work submitted after shutdown is freed without running.
+    executor->Shutdown();
+
+    EventLoop *loop = loop3;
+    bool ran = false, freed = false;
+    bool cont_ran = false, cont_freed = false;
+    executor->Submit(new TrackedTask(&ran, &freed), loop, new TrackedTask(&cont_ran, &cont_freed));
+    if (!check(!ran && freed && !cont_ran && cont_freed, "work was discarded after shutdown"))
+      return false;
+    return true;
+  }
+};
+
+// Benchmark comparing the executor against a pool of threads sharing a single
+// locked queue. The workload is a set of fork-join trees, where every task
+// submits its children from a pool thread.
+class TestExecutorBench : public Test
+{
+  class Pool
+  {
+   public:
+    virtual ~Pool()
+    {}
+    virtual void Submit(Task *task) = 0;
+  };
+
+  class ExecutorPool : public Pool
+  {
+   public:
+    ExecutorPool(Executor *executor)
+     : executor_(executor)
+    {}
+    void Submit(Task *task) override {
+      executor_->Submit(task);
+    }
+
+   private:
+    Executor *executor_;
+  };
+
+  class SharedQueuePool
+   : public Pool,
+     public IRunnable
+  {
+   public:
+    SharedQueuePool(size_t nthreads)
+     : shutdown_(false)
+    {
+      for (size_t i = 0; i < nthreads; i++)
+        threads_.append(new Thread(this));
+    }
+    ~SharedQueuePool() {
+      {
+        AutoLock lock(&cv_);
+        shutdown_ = true;
+        cv_.NotifyAll();
+      }
+      for (size_t i = 0; i < threads_.length(); i++) {
+        threads_[i]->Join();
+        delete threads_[i];
+      }
+    }
+
+    void Submit(Task *task) override {
+      AutoLock lock(&cv_);
+      queue_.append(task);
+      cv_.Notify();
+    }
+
+    void Run() override {
+      AutoLock lock(&cv_);
+      while (true) {
+        if (queue_.empty()) {
+          if (shutdown_)
+            return;
+          cv_.Wait();
+          continue;
+        }
+
+        Task *task = queue_.popFrontCopy();
+        AutoUnlock unlock(&cv_);
+        task->Run();
+        task->DeleteMe();
+      }
+    }
+
+   private:
+    ConditionVariable cv_;
+    Deque<Task *> queue_;
+    Vector<Thread *> threads_;
+    bool shutdown_;
+  };
+
+  class Completion
+  {
+   public:
+    Completion(long leaves)
+     : leaves_(leaves),
+       done_(0),
+       finished_(false)
+    {}
+
+    void leaf() {
+      if (IncrementCounter(&done_) != leaves_)
+        return;
+      AutoLock lock(&cv_);
+      finished_ = true;
+      cv_.Notify();
+    }
+
+    // Wait for the flag rather than the count, so the completion isn't
+    // destroyed while the last leaf is still notifying.
+    void wait() {
+      AutoLock lock(&cv_);
+      while (!finished_)
+        cv_.Wait();
+    }
+
+   private:
+    ConditionVariable cv_;
+    long leaves_;
+    long done_;
+    bool finished_;
+  };
+
+  class TreeTask : public Task
+  {
+   public:
+    TreeTask(Pool *pool, Completion *completion, int depth)
+     : pool_(pool),
+       completion_(completion),
+       depth_(depth)
+    {}
+
+    void Run() override {
+      if (depth_ > 0) {
+        pool_->Submit(new TreeTask(pool_, completion_, depth_ - 1));
+        pool_->Submit(new TreeTask(pool_, completion_, depth_ - 1));
+        return;
+      }
+
+      // A little bit of real work per leaf.
+      volatile uint32_t x = 1;
+      for (size_t i = 0; i < 100; i++)
+        x = x * 1664525 + 1013904223;
+      completion_->leaf();
+    }
+
+   private:
+    Pool *pool_;
+    Completion *completion_;
+    int depth_;
+  };
+
+  static const size_t kThreads = 4;
+  static const size_t kTrees = 32;
+  static const int kDepth = 11;
+
+ public:
+  TestExecutorBench()
+   : Test("executor-bench")
+  {}
+
+  int64_t measure(Pool *pool) {
+    Completion completion(long(kTrees) << kDepth);
+    int64_t start = HighResolutionTimer::Counter();
+    for (size_t i = 0; i < kTrees; i++)
+      pool->Submit(new TreeTask(pool, &completion, kDepth));
+    completion.wait();
+    return HighResolutionTimer::Counter() - start;
+  }
+
+  bool Run() override {
+    size_t total = kTrees * ((size_t(2) << kDepth) - 1);
+
+    Ref<Executor> executor;
+    if (!check_error(Executor::Create(&executor, kThreads), "create executor"))
+      return false;
+
+    int64_t stealing, shared;
+    {
+      ExecutorPool pool(executor);
+      stealing = measure(&pool);
+    }
+    {
+      SharedQueuePool pool(kThreads);
+      shared = measure(&pool);
+    }
+
+    fprintf(stdout, "  %d tasks on %d threads: work-stealing %dns per task, shared queue %dns per task\n",
+            int(total), int(kThreads),
+            int(stealing / int64_t(total)), int(shared / int64_t(total)));
+    return true;
+  }
+};
+
+class SetupExecutorTests
+{
+ public:
+  SetupExecutorTests() {
+    Tests.append(new TestExecutor());
+    Tests.append(new TestExecutorBench());
+  }
+} sSetupExecutorTests;
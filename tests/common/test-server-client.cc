@@ -16,9 +16,11 @@ using namespace ke;
 using namespace amio;
 using namespace amio::net;
 
-TestServerClient::TestServerClient(CreatePoller_t constructor, const char *name)
+TestServerClient::TestServerClient(CreatePoller_t constructor, const char *name,
+                                   const net::ServerOptions &options)
  : Test(name),
-   constructor_(constructor)
+   constructor_(constructor),
+   options_(options)
 {
 }
 
@@ -99,7 +101,7 @@ TestServerClient::Run()
 
   Ref<ServerHelper> srv_helper = new ServerHelper();
   Ref<Server> server;
-  if (!check_error(Server::Create(&server, poller_, local, Protocol::TCP, srv_helper),
+  if (!check_error(Server::Create(&server, poller_, local, Protocol::TCP, srv_helper, options_),
                    "create tcp server on any port"))
   {
     return false;
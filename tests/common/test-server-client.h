@@ -19,12 +19,14 @@ namespace amio {
 class TestServerClient : public Test
 {
  public:
-  TestServerClient(CreatePoller_t constructor, const char *name);
+  TestServerClient(CreatePoller_t constructor, const char *name,
+                   const net::ServerOptions &options = net::ServerOptions());
 
   bool Run() override;
 
  private:
   CreatePoller_t constructor_;
+  net::ServerOptions options_;
   Ref<Poller> poller_;
 };
 
@@ -10,7 +10,9 @@
 #include <amio.h>
 #include <amio-net.h>
 #include <amio-eventloop.h>
+#include <amio-time.h>
 #include <am-thread-utils.h>
+#include <am-vector.h>
 #include "../testing.h"
 
 using namespace ke;
@@ -57,6 +59,55 @@ class ThreadRunner : public IRunnable
   TaskQueue *queue_;
 };
 
+class LogTask : public Task
+{
+ public:
+  LogTask(Vector<int> *log, int id)
+   : log_(log),
+     id_(id)
+  {}
+
+  void Run() override {
+    log_->append(id_);
+  }
+
+ private:
+  Vector<int> *log_;
+  int id_;
+};
+
+// Counts live copies, so tests can check that closures are destroyed.
+static int sLiveFunctors = 0;
+
+class CountedFunctor
+{
+ public:
+  CountedFunctor(size_t *ran, void **where)
+   : ran_(ran),
+     where_(where)
+  {
+    sLiveFunctors++;
+  }
+  CountedFunctor(const CountedFunctor &other)
+   : ran_(other.ran_),
+     where_(other.where_)
+  {
+    sLiveFunctors++;
+  }
+  ~CountedFunctor() {
+    sLiveFunctors--;
+  }
+
+  void operator ()() {
+    (*ran_)++;
+    *where_ = this;
+  }
+
+ private:
+  size_t *ran_;
+  void **where_;
+};
+
 class TestTasks
  : public Test,
    public TaskQueue::Delegate,
@@ -199,6 +250,119 @@ class TestTasks
     return true;
   }
 
+  bool test_closures() {
+    AutoPtr<TaskQueue> queue(TaskQueue::Create(this));
+
+    size_t ran = 0;
+    queue->PostTask([&ran]() -> void {
+      ran++;
+    });
+    char big[256] = {0};
+    queue->PostTask([&ran, big]() -> void {
+      ran += big[0] + 1;
+    });
+    if (!check(queue->ProcessTasks(nullptr, 0), "should process tasks"))
+      return false;
+    if (!check(ran == 2, "both closures should have run"))
+      return false;
+
+    // A small closure should land in a pooled slot, which the next one reuses.
+    void *first = nullptr;
+    void *second = nullptr;
+    queue->PostTask(CountedFunctor(&ran, &first));
+    queue->ProcessTasks(nullptr, 0);
+    queue->PostTask(CountedFunctor(&ran, &second));
+    queue->ProcessTasks(nullptr, 0);
+    if (!check(ran == 4, "counted closures should have run"))
+      return false;
+    if (!check(first && first == second, "closure slot should be reused"))
+      return false;
+    if (!check(sLiveFunctors == 0, "closures should have been destroyed"))
+      return false;
+
+    // Closures that never run are destroyed with the queue.
+    queue->PostTask(CountedFunctor(&ran, &first));
+    queue = nullptr;
+    if (!check(sLiveFunctors == 0, "pending closure should have been destroyed"))
+      return false;
+    return true;
+  }
+
+  bool test_priorities() {
+    AutoPtr<TaskQueue> queue(TaskQueue::Create(this));
+
+    Vector<int> log;
+    queue->PostTask(new LogTask(&log, 1));
+    queue->PostTask(new LogTask(&log, 5), TaskPriority::Idle);
+    queue->PostTask(new LogTask(&log, 2));
+    queue->PostTask(new LogTask(&log, 0), TaskPriority::Urgent);
+    queue->PostTask(new LogTask(&log, 6), TaskPriority::Idle);
+    queue->PostTask(new LogTask(&log, 3));
+
+    if (!check(queue->ProcessTasks(nullptr, 2), "should process tasks"))
+      return false;
+    if (!check(log.length() == 2 && log[0] == 0 && log[1] == 1, "urgent task ran first"))
+      return false;
+
+    queue->PostTask(new LogTask(&log, 4));
+    if (!check(queue->ProcessTasks(nullptr, 0), "should process tasks"))
+      return false;
+
+    bool ordered = log.length() == 7;
+    for (size_t i = 0; ordered && i < log.length(); i++)
+      ordered = (log[i] == int(i));
+    if (!check(ordered, "tasks ran in priority order")) {
+      for (size_t i = 0; i < log.length(); i++)
+        print_actual("%d", log[i]);
+      return false;
+    }
+    return true;
+  }
+
+  bool test_capacity() {
+    AutoPtr<TaskQueue> queue(TaskQueue::Create(this, 2));
+
+    Vector<int> log;
+    if (!check(queue->TryPostTask(new LogTask(&log, 0)), "first task should fit"))
+      return false;
+    if (!check(queue->TryPostTask(new LogTask(&log, 1), TaskPriority::Idle), "second task should fit"))
+      return false;
+
+    AutoPtr<Task> rejected(new LogTask(&log, 2));
+    if (!check(!queue->TryPostTask(rejected), "third task should be rejected"))
+      return false;
+
+    // PostTask() ignores the capacity.
+    queue->PostTask(new LogTask(&log, 3));
+
+    TaskQueueStats stats;
+    queue->GetStats(&stats);
+    if (!check(stats.depth == 3, "depth should be 3"))
+      return false;
+    if (!check(stats.highWaterMark == 3, "high-water mark should be 3"))
+      return false;
+    if (!check(stats.capacity == 2, "capacity should be 2"))
+      return false;
+
+    if (!check(queue->ProcessTasks(nullptr, 0), "should process tasks"))
+      return false;
+    if (!check(log.length() == 3, "three tasks should have run"))
+      return false;
+
+    queue->GetStats(&stats);
+    if (!check(stats.depth == 0, "depth should be 0"))
+      return false;
+    if (!check(stats.highWaterMark == 3, "high-water mark should stay 3"))
+      return false;
+
+    if (!check(queue->TryPostTask(rejected.take()), "task should fit after draining"))
+      return false;
+    queue->ProcessTasks(nullptr, 0);
+    if (!check(log.length() == 4 && log[3] == 2, "rejected task should run after reposting"))
+      return false;
+    return true;
+  }
+
   bool Run() override {
     if (!test_basic())
       return false;
@@ -206,6 +370,12 @@ class TestTasks
       return false;
     if (!test_threads())
       return false;
+    if (!test_closures())
+      return false;
+    if (!test_priorities())
+      return false;
+    if (!test_capacity())
+      return false;
     return true;
   }
 
@@ -214,10 +384,121 @@ class TestTasks
   size_t notifications;
 };
 
+// Benchmark for many threads posting to a single queue. Each task checks
+// that it runs in the order its thread posted it.
+class TestTaskContention
+ : public Test,
+   public TaskQueue::Delegate,
+   public ke::Refcounted<TestTaskContention>
+{
+  static const size_t kProducers = 8;
+  static const size_t kTasksPerProducer = 50000;
+
+  class SequencedTask : public Task
+  {
+   public:
+    SequencedTask(TestTaskContention *test, size_t producer, size_t seq)
+     : test_(test),
+       producer_(producer),
+       seq_(seq)
+    {}
+
+    void Run() override {
+      if (test_->next_seq_[producer_] != seq_)
+        test_->out_of_order_ = true;
+      test_->next_seq_[producer_] = seq_ + 1;
+      test_->ran_++;
+    }
+
+   private:
+    TestTaskContention *test_;
+    size_t producer_;
+    size_t seq_;
+  };
+
+  class Producer : public IRunnable
+  {
+   public:
+    Producer()
+     : test_(nullptr),
+       id_(0)
+    {}
+
+    void Run() override {
+      for (size_t i = 0; i < kTasksPerProducer; i++)
+        test_->queue_->PostTask(new SequencedTask(test_, id_, i));
+    }
+
+    TestTaskContention *test_;
+    size_t id_;
+  };
+
+ public:
+  TestTaskContention()
+   : Test("task-queue-contention")
+  {}
+
+  KE_IMPL_REFCOUNTING(TestTaskContention);
+
+  void NotifyTask() override
+  {}
+  void NotifyQuit() override
+  {}
+
+  bool Run() override {
+    queue_ = TaskQueue::Create(this);
+    ran_ = 0;
+    out_of_order_ = false;
+
+    Producer producers[kProducers];
+    AutoPtr<Thread> threads[kProducers];
+    for (size_t i = 0; i < kProducers; i++) {
+      next_seq_[i] = 0;
+      producers[i].test_ = this;
+      producers[i].id_ = i;
+    }
+
+    int64_t start = HighResolutionTimer::Counter();
+    for (size_t i = 0; i < kProducers; i++) {
+      threads[i] = new Thread(&producers[i]);
+      if (!check(threads[i]->Succeeded(), "start producer thread"))
+        return false;
+    }
+
+    // Spin on the queue, so we measure the queue itself rather than wakeups.
+    size_t total = kProducers * kTasksPerProducer;
+    while (ran_ < total)
+      queue_->ProcessTasks();
+
+    int64_t elapsed = HighResolutionTimer::Counter() - start;
+    for (size_t i = 0; i < kProducers; i++)
+      threads[i]->Join();
+
+    fprintf(stdout, "  %d tasks from %d threads in %dms (%dns per task)\n",
+            int(total), int(kProducers), int(elapsed / kNanosecondsPerMillisecond),
+            int(elapsed / int64_t(total)));
+
+    if (!check(!out_of_order_, "tasks from each thread ran in order"))
+      return false;
+    if (!check(!queue_->ProcessNextTask(), "queue should be empty"))
+      return false;
+
+    queue_ = nullptr;
+    return true;
+  }
+
+ private:
+  AutoPtr<TaskQueue> queue_;
+  size_t next_seq_[kProducers];
+  size_t ran_;
+  bool out_of_order_;
+};
+
 class SetupTaskTests
 {
  public:
   SetupTaskTests() {
     Tests.append(new TestTasks());
+    Tests.append(new TestTaskContention());
   }
 } sSetupTaskTests;
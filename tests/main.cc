@@ -42,6 +42,8 @@ int main(int argc, char **argv)
   else
     printf("Timer resolution: " KE_I64_FMT "ms\n", res / kNanosecondsPerMillisecond);
   printf("Time: " KE_I64_FMT "\n", HighResolutionTimer::Counter());
+  if (HighResolutionTimer::HasFastCounter())
+    printf("Fast counter: TSC\n");
 
   bool ok = true;
   for (size_t i = 0; i < Tests.length(); i++) {
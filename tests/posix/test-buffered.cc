@@ -0,0 +1,288 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <amio.h>
+#include <amio-buffered.h>
+#include <sys/socket.h>
+#include "../testing.h"
+
+using namespace ke;
+using namespace amio;
+
+class BufferedRecorder
+ : public BufferedListener,
+   public ke::Refcounted<BufferedRecorder>
+{
+ public:
+  BufferedRecorder()
+   : consume(false),
+     ndata(0),
+     ndrained(0),
+     nclosed(0)
+  {}
+
+  KE_IMPL_REFCOUNTING(BufferedRecorder);
+
+  void OnData() override {
+    ndata++;
+    if (!consume)
+      return;
+
+    char buffer[4096];
+    while (size_t count = transport->Read(buffer, sizeof(buffer)))
+      append(buffer, count);
+  }
+  void append(const char *buffer, size_t count) {
+    for (size_t i = 0; i < count; i++)
+      received.append(buffer[i]);
+  }
+  void OnDrained() override {
+    ndrained++;
+  }
+  void OnClosed(Ref<IOError> error) override {
+    nclosed++;
+    closeError = error;
+  }
+
+ public:
+  Ref<BufferedTransport> transport;
+  bool consume;
+  unsigned ndata;
+  unsigned ndrained;
+  unsigned nclosed;
+  Ref<IOError> closeError;
+  Vector<char> received;
+};
+
+class TestBuffered : public Test
+{
+ public:
+  TestBuffered()
+   : Test("buffered-transport")
+  {}
+
+  bool test_options() {
+    Ref<Poller> poller;
+    if (!check_error(PollerFactory::Create(&poller), "create poller"))
+      return false;
+
+    Ref<Transport> reader, writer;
+    if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+      return false;
+
+    BufferedTransportOptions options;
+    options.inputCapacity = 1024;
+    options.lowWatermark = 1024;
+
+    Ref<BufferedTransport> buffered;
+    Ref<IOError> error = BufferedTransport::Create(&buffered, poller, reader, new BufferedRecorder(), options);
+    if (!check(!!error, "low watermark must be below the high watermark"))
+      return false;
+    if (!check(!reader->Listener(), "reader should not be attached"))
+      return false;
+    return true;
+  }
+
+  bool test_stream() {
+    Ref<Poller> poller;
+    if (!check_error(PollerFactory::Create(&poller), "create poller"))
+      return false;
+
+    Ref<Transport> reader, writer;
+    if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+      return false;
+
+    BufferedTransportOptions options;
+    options.inputCapacity = 4096;
+    options.lowWatermark = 1024;
+
+    Ref<BufferedRecorder> in = new BufferedRecorder();
+    Ref<BufferedRecorder> out = new BufferedRecorder();
+    if (!check_error(BufferedTransport::Create(&in->transport, poller, reader, in, options), "wrap reader"))
+      return false;
+    if (!check_error(BufferedTransport::Create(&out->transport, poller, writer, out), "wrap writer"))
+      return false;
+
+    // Write far more than the pipe can hold, in odd-sized pieces so blocks
+    // get partially filled and partially flushed.
+    static const size_t kTotal = 256 * 1024;
+    Vector<char> sent;
+    for (size_t i = 0; i < kTotal; i++)
+      sent.append(char(i % 251));
+    Ref<IOError> error;
+    for (size_t i = 0; i < kTotal && !error; i += 1000)
+      error = out->transport->Write(&sent[i], ke::Min(size_t(1000), kTotal - i));
+    if (!check_error(error, "write"))
+      return false;
+    if (!check(out->transport->PendingOutput() > 0, "output should be queued"))
+      return false;
+
+    // The reader doesn't consume anything, so it should stop at the high
+    // watermark no matter how many times we poll.
+    for (size_t i = 0; i < 5; i++) {
+      if (!check_error(poller->Poll(0), "poll"))
+        return false;
+    }
+    if (!check(in->transport->Available() == options.inputCapacity,
+               "reader should pause at the high watermark, has %d bytes",
+               int(in->transport->Available())))
+    {
+      return false;
+    }
+    if (!check(out->ndrained == 0, "output should not have drained"))
+      return false;
+
+    // Consuming input resumes reading, and everything should get through.
+    in->consume = true;
+    char buffer[4096];
+    size_t count = in->transport->Read(buffer, sizeof(buffer));
+    in->append(buffer, count);
+
+    for (size_t i = 0; i < 1000 && (out->ndrained == 0 || in->received.length() < kTotal); i++) {
+      if (!check_error(poller->Poll(1000), "poll"))
+        return false;
+    }
+    if (!check(out->ndrained == 1, "output should drain once, drained %d times", out->ndrained))
+      return false;
+    if (!check(out->transport->PendingOutput() == 0, "no output should be pending"))
+      return false;
+    if (!check(in->received.length() == kTotal, "should receive %d bytes, got %d",
+               int(kTotal), int(in->received.length())))
+    {
+      return false;
+    }
+    size_t mismatch = 0;
+    while (mismatch < kTotal && in->received[mismatch] == sent[mismatch])
+      mismatch++;
+    if (!check(mismatch == kTotal, "received bytes should match, first mismatch at %d", int(mismatch)))
+      return false;
+
+    // Once drained, the writer shouldn't be woken up again.
+    if (!check_error(poller->Poll(0), "poll"))
+      return false;
+    if (!check(out->ndrained == 1, "writer should stop listening for writes"))
+      return false;
+
+    // Closing the writer should close the reader.
+    out->transport->Close();
+    if (!check(out->nclosed == 0, "closing should not notify"))
+      return false;
+    for (size_t i = 0; i < 10 && !in->nclosed; i++) {
+      if (!check_error(poller->Poll(1000), "poll"))
+        return false;
+    }
+    if (!check(in->nclosed == 1, "reader should be closed"))
+      return false;
+    if (!check(!in->closeError, "reader should close without error"))
+      return false;
+    if (!check(in->transport->Closed(), "reader should report closed"))
+      return false;
+    if (!check(!!out->transport->Write("x", 1), "writing after close should fail"))
+      return false;
+
+    in->transport = nullptr;
+    out->transport = nullptr;
+    return true;
+  }
+
+  bool test_half_close() {
+    Ref<Poller> poller;
+    if (!check_error(PollerFactory::Create(&poller), "create poller"))
+      return false;
+
+    int fds[2];
+    if (!check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "create socket pair"))
+      return false;
+
+    Ref<Transport> local, peer;
+    if (!check_error(TransportFactory::CreateFromDescriptor(&local, fds[0]), "wrap local end"))
+      return false;
+    if (!check_error(TransportFactory::CreateFromDescriptor(&peer, fds[1]), "wrap peer end"))
+      return false;
+
+    Ref<BufferedRecorder> out = new BufferedRecorder();
+    if (!check_error(BufferedTransport::Create(&out->transport, poller, local, out), "wrap local end"))
+      return false;
+
+    // Queue more than the socket can hold, then have the peer stop sending.
+    static const size_t kTotal = 1024 * 1024;
+    Vector<char> sent;
+    for (size_t i = 0; i < kTotal; i++)
+      sent.append(char(i % 251));
+    if (!check_error(out->transport->Write(&sent[0], kTotal), "write"))
+      return false;
+    if (!check(out->transport->PendingOutput() > 0, "output should be queued"))
+      return false;
+    if (!check(shutdown(fds[1], SHUT_WR) == 0, "shut down the peer's write side"))
+      return false;
+
+    // The end of the stream must not cut off the output.
+    Vector<char> received;
+    bool peer_ended = false;
+    for (size_t i = 0; i < 1000 && !peer_ended; i++) {
+      if (!check_error(poller->Poll(1000), "poll"))
+        return false;
+
+      char buffer[4096];
+      while (true) {
+        IOResult r;
+        if (!check(peer->Read(&r, buffer, sizeof(buffer)), "peer read"))
+          return false;
+        if (r.ended)
+          peer_ended = true;
+        if (!r.completed || r.ended)
+          break;
+        for (size_t j = 0; j < r.bytes; j++)
+          received.append(buffer[j]);
+      }
+    }
+    if (!check(received.length() == kTotal, "should receive %d bytes, got %d",
+               int(kTotal), int(received.length())))
+    {
+      return false;
+    }
+    size_t mismatch = 0;
+    while (mismatch < kTotal && received[mismatch] == sent[mismatch])
+      mismatch++;
+    if (!check(mismatch == kTotal, "received bytes should match, first mismatch at %d", int(mismatch)))
+      return false;
+
+    // Once flushed, the transport closes without an error.
+    if (!check(out->nclosed == 1, "transport should be closed once"))
+      return false;
+    if (!check(!out->closeError, "transport should close without error"))
+      return false;
+    if (!check(out->ndrained == 1, "output should drain before closing"))
+      return false;
+    if (!check(out->transport->Closed(), "transport should report closed"))
+      return false;
+
+    out->transport = nullptr;
+    peer->Close();
+    return true;
+  }
+
+  bool Run() override {
+    if (!test_options())
+      return false;
+    if (!test_stream())
+      return false;
+    if (!test_half_close())
+      return false;
+    return true;
+  }
+};
+
+class SetupBufferedTests
+{
+ public:
+  SetupBufferedTests() {
+    Tests.append(new TestBuffered());
+  }
+} sSetupBufferedTests;
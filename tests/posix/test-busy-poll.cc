@@ -0,0 +1,204 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <amio.h>
+#include <amio-time.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "test-busy-poll.h"
+
+#if !defined(SO_BUSY_POLL)
+# define SO_BUSY_POLL 46
+#endif
+#if !defined(SO_PREFER_BUSY_POLL)
+# define SO_PREFER_BUSY_POLL 69
+#endif
+
+using namespace ke;
+using namespace amio;
+
+// The spin window starts at its maximum, and never shrinks below 1/32 of it.
+static const int64_t kMaxSpin = 64 * kNanosecondsPerMillisecond;
+static const int64_t kMinSpin = kMaxSpin / 32;
+
+TestBusyPoll::TestBusyPoll(const char *name)
+ : Test(name),
+   expirations_(0)
+{
+}
+
+void
+TestBusyPoll::OnReadReady()
+{
+  if (!timer_)
+    return;
+
+  uint64_t count;
+  IOResult r;
+  while (timer_->Read(&r, &count, sizeof(count)) && r.completed && r.bytes == sizeof(count))
+    expirations_ += count;
+}
+
+bool
+TestBusyPoll::test_socket_options()
+{
+  EpollOptions options;
+  options.socketBusyPollMicroseconds = 50;
+  options.preferBusyPoll = true;
+
+  Ref<Poller> poller;
+  if (!check_error(PollerFactory::CreateEpollImpl(&poller, options), "create poller"))
+    return false;
+
+  // Raising SO_BUSY_POLL needs CAP_NET_ADMIN, which the poller ignores.
+  int usecs = 50;
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  bool allowed = setsockopt(probe, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0;
+  int probe_error = errno;
+  close(probe);
+  if (!allowed && probe_error != EPERM) {
+    fprintf(stdout, "Skipping SO_BUSY_POLL test: %s\n", strerror(probe_error));
+    return true;
+  }
+
+  int fds[2];
+  if (!check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "create socket pair"))
+    return false;
+  close(fds[1]);
+
+  Ref<Transport> transport;
+  if (!check_error(TransportFactory::CreateFromDescriptor(&transport, fds[0]), "wrap socket")) {
+    close(fds[0]);
+    return false;
+  }
+
+  bool ok = check_error(poller->Attach(transport, this, Events::Read, EventMode::Level),
+                        "attach socket") &&
+            check_socket_options(fds[0], allowed);
+  transport->Close();
+  return ok;
+}
+
+bool
+TestBusyPoll::check_socket_options(int fd, bool allowed)
+{
+  int value = -1;
+  socklen_t len = sizeof(value);
+  if (!check(getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, &len) == 0, "get SO_BUSY_POLL"))
+    return false;
+  if (!allowed) {
+    if (!check(value == 0, "SO_BUSY_POLL should be unchanged without CAP_NET_ADMIN, got %d", value))
+      return false;
+    fprintf(stdout, "Skipping SO_PREFER_BUSY_POLL check: not permitted\n");
+    return true;
+  }
+  if (!check(value == 50, "SO_BUSY_POLL should be 50, got %d", value))
+    return false;
+
+  // SO_PREFER_BUSY_POLL needs Linux 5.11+.
+  value = -1;
+  len = sizeof(value);
+  if (getsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, &len) == 0) {
+    if (!check(value == 1, "SO_PREFER_BUSY_POLL should be set, got %d", value))
+      return false;
+  }
+  return true;
+}
+
+bool
+TestBusyPoll::arm(int fd, int64_t ns)
+{
+  struct itimerspec spec = {};
+  spec.it_value.tv_sec = ns / kNanosecondsPerSecond;
+  spec.it_value.tv_nsec = ns % kNanosecondsPerSecond;
+  return check(timerfd_settime(fd, 0, &spec, nullptr) == 0, "arm timer");
+}
+
+bool
+TestBusyPoll::check_window(Ref<Poller> poller, int64_t expected)
+{
+  int64_t window = poller->SpinWindowNs();
+  return check(window == expected, "spin window should be %dus, got %dus",
+               int(expected / kNanosecondsPerMicrosecond), int(window / kNanosecondsPerMicrosecond));
+}
+
+bool
+TestBusyPoll::test_spin_window()
+{
+  EpollOptions options;
+  options.spinMicroseconds = size_t(kMaxSpin / kNanosecondsPerMicrosecond);
+
+  Ref<Poller> poller;
+  if (!check_error(PollerFactory::CreateEpollImpl(&poller, options), "create poller"))
+    return false;
+
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (!check(fd != -1, "create timerfd"))
+    return false;
+  if (!check_error(TransportFactory::CreateFromDescriptor(&timer_, fd), "wrap timerfd")) {
+    close(fd);
+    return false;
+  }
+
+  bool ok = check_error(poller->Attach(timer_, this, Events::Read, EventMode::Level), "attach timerfd") &&
+            check_spin_window(poller, fd);
+  timer_->Close();
+  timer_ = nullptr;
+  return ok;
+}
+
+bool
+TestBusyPoll::check_spin_window(Ref<Poller> poller, int fd)
+{
+  if (!check_window(poller, kMaxSpin))
+    return false;
+
+  // With nothing to find, each spin halves the window, down to the floor.
+  int64_t expected = kMaxSpin;
+  for (size_t i = 0; i < 7; i++) {
+    if (!check_error(poller->Poll(1), "poll"))
+      return false;
+    expected = ke::Max(expected / 2, kMinSpin);
+    if (!check_window(poller, expected))
+      return false;
+  }
+
+  // A timer that fires partway through the spin is an event we'd otherwise
+  // have slept for, so the window doubles.
+  for (size_t i = 0; i < 3; i++) {
+    if (!arm(fd, kMinSpin / 4))
+      return false;
+    uint64_t expirations = expirations_;
+    if (!check_error(poller->Poll(1000), "poll"))
+      return false;
+    if (!check(expirations_ > expirations, "timer should fire"))
+      return false;
+    expected *= 2;
+    if (!check_window(poller, expected))
+      return false;
+  }
+
+  // Once events stop, it shrinks again.
+  if (!check_error(poller->Poll(1), "poll"))
+    return false;
+  return check_window(poller, expected / 2);
+}
+
+bool
+TestBusyPoll::Run()
+{
+  if (!test_socket_options())
+    return false;
+  if (!test_spin_window())
+    return false;
+  return true;
+}
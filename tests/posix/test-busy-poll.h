@@ -0,0 +1,52 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_test_posix_busy_poll_h_
+#define _include_amio_test_posix_busy_poll_h_
+
+#include <amio.h>
+#include "../testing.h"
+
+namespace amio {
+
+// Tests epoll busy polling: socket options, and the adaptive spin window.
+class TestBusyPoll
+ : public virtual StatusListener,
+   public virtual Test
+{
+ public:
+  TestBusyPoll(const char *name);
+
+  bool Run() override;
+  void AddRef() override {
+    Test::AddRef();
+  }
+  void Release() override {
+    Test::Release();
+  }
+
+  void OnReadReady() override;
+
+ private:
+  bool test_socket_options();
+  bool test_spin_window();
+
+  bool check_socket_options(int fd, bool allowed);
+  bool check_spin_window(Ref<Poller> poller, int fd);
+  bool check_window(Ref<Poller> poller, int64_t expected);
+  bool arm(int fd, int64_t ns);
+
+ private:
+  Ref<Transport> timer_;
+  uint64_t expirations_;
+};
+
+}
+
+#endif // _include_amio_test_posix_busy_poll_h_
@@ -0,0 +1,245 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <amio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "test-completion.h"
+
+using namespace ke;
+using namespace amio;
+
+namespace {
+
+// A listener that can't receive completions.
+class PlainListener
+ : public StatusListener,
+   public ke::Refcounted<PlainListener>
+{
+ public:
+  KE_IMPL_REFCOUNTING(PlainListener);
+};
+
+} // anonymous namespace
+
+TestCompletion::TestCompletion(CreatePoller_t ctor, const char *name)
+ : Test(name),
+   constructor_(ctor),
+   nreceived_(0),
+   got_hangup_(false)
+{
+}
+
+bool
+TestCompletion::setup()
+{
+  reset();
+
+  int fds[2];
+  if (!check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "create socket pair"))
+    return false;
+
+  Ref<IOError> error = TransportFactory::CreateFromDescriptor(&reader_, fds[0]);
+  if (!check_error(error, "create reader"))
+    return false;
+  error = TransportFactory::CreateFromDescriptor(&writer_, fds[1]);
+  if (!check_error(error, "create writer"))
+    return false;
+
+  error = poller_->Attach(reader_, this, Events::Read, EventMode::Completion);
+  if (!check_error(error, "attach reader in completion mode"))
+    return false;
+
+  nreceived_ = 0;
+  got_hangup_ = false;
+  got_error_ = nullptr;
+  return true;
+}
+
+void
+TestCompletion::reset()
+{
+  if (reader_)
+    reader_->Close();
+  if (writer_)
+    writer_->Close();
+  reader_ = nullptr;
+  writer_ = nullptr;
+}
+
+bool
+TestCompletion::Run()
+{
+  Ref<IOError> error = constructor_(&poller_);
+  if (!check_error(error, "create poller"))
+    return false;
+
+  if (!poller_->SupportsCompletionMode()) {
+    int fds[2];
+    if (!check(pipe(fds) == 0, "create pipe"))
+      return false;
+    Ref<Transport> transport;
+    if (!check_error(TransportFactory::CreateFromDescriptor(&transport, fds[0]), "create transport"))
+      return false;
+    AMIO_RETRY_IF_EINTR(close(fds[1]));
+
+    error = poller_->Attach(transport, this, Events::Read, EventMode::Completion);
+    if (!check(!!error, "attach should fail without completion support"))
+      return false;
+
+    fprintf(stdout, "Skipping completion tests: not supported\n");
+    return true;
+  }
+
+  if (!test_listener_type())
+    return false;
+  if (!test_recv())
+    return false;
+  if (!test_hangup())
+    return false;
+  if (!test_detach())
+    return false;
+
+  reset();
+  poller_ = nullptr;
+  return true;
+}
+
+bool
+TestCompletion::test_listener_type()
+{
+  AutoTestContext test("completion mode requires a CompletionListener");
+
+  int fds[2];
+  if (!check(pipe(fds) == 0, "create pipe"))
+    return false;
+  Ref<Transport> transport;
+  if (!check_error(TransportFactory::CreateFromDescriptor(&transport, fds[0]), "create transport"))
+    return false;
+  AMIO_RETRY_IF_EINTR(close(fds[1]));
+
+  Ref<StatusListener> plain = new PlainListener();
+  Ref<IOError> error = poller_->Attach(transport, plain, Events::Read, EventMode::Completion);
+  if (!check(!!error, "attaching a plain listener should fail"))
+    return false;
+  error = poller_->Attach(transport, plain, Events::Read, EventMode::Completion | EventMode::Proxy);
+  if (!check(!!error, "attaching a plain proxy listener should fail"))
+    return false;
+  if (!check(!transport->Listener(), "transport should not be attached"))
+    return false;
+  return true;
+}
+
+bool
+TestCompletion::test_recv()
+{
+  AutoTestContext test("receiving into provided buffers");
+  if (!setup())
+    return false;
+
+  const char *msg = "hello";
+  if (!write(msg, strlen(msg)))
+    return false;
+  if (!wait_for_bytes(strlen(msg)))
+    return false;
+  if (!check(memcmp(received_, msg, strlen(msg)) == 0, "got bytes"))
+    return false;
+
+  // Send more than a single buffer's worth. The kernel has to spread this
+  // across buffers, and may run out if the pool is small.
+  char big[200];
+  for (size_t i = 0; i < sizeof(big); i++)
+    big[i] = char('a' + (i % 26));
+
+  nreceived_ = 0;
+  if (!write(big, sizeof(big)))
+    return false;
+  if (!wait_for_bytes(sizeof(big)))
+    return false;
+  if (!check(memcmp(received_, big, sizeof(big)) == 0, "got all bytes in order"))
+    return false;
+  if (!check(!got_hangup_, "should not get hangup"))
+    return false;
+
+  return true;
+}
+
+bool
+TestCompletion::test_hangup()
+{
+  AutoTestContext test("hangup in completion mode");
+  if (!setup())
+    return false;
+
+  if (!write("x", 1))
+    return false;
+  writer_->Close();
+
+  for (size_t i = 0; i < 10 && !got_hangup_; i++) {
+    if (!check_error(poller_->Poll(kSafeTimeout), "poll after writer close"))
+      return false;
+  }
+  if (!check(nreceived_ == 1, "should have received data before hangup"))
+    return false;
+  if (!check(got_hangup_, "should have gotten hangup"))
+    return false;
+  if (!check(!got_error_, "hangup should be clean"))
+    return false;
+  if (!check(!reader_->Listener(), "reader should be detached"))
+    return false;
+
+  return true;
+}
+
+bool
+TestCompletion::test_detach()
+{
+  AutoTestContext test("detaching in completion mode");
+  if (!setup())
+    return false;
+
+  poller_->Detach(reader_);
+  if (!write("x", 1))
+    return false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "poll after detach"))
+    return false;
+  if (!check(nreceived_ == 0, "should not receive data after detach"))
+    return false;
+
+  // The data should still be there for a normal read.
+  char buffer[8];
+  IOResult r;
+  if (!check(reader_->Read(&r, buffer, sizeof(buffer)), "read from detached reader"))
+    return false;
+  if (!check(r.bytes == 1, "should read pending byte"))
+    return false;
+
+  return true;
+}
+
+bool
+TestCompletion::write(const char *msg, size_t len)
+{
+  IOResult r;
+  if (!check(writer_->Write(&r, msg, len), "write to socket"))
+    return false;
+  return check(r.bytes == len, "wrote all bytes");
+}
+
+bool
+TestCompletion::wait_for_bytes(size_t len)
+{
+  for (size_t i = 0; i < 10 && nreceived_ < len; i++) {
+    if (!check_error(poller_->Poll(kSafeTimeout), "poll for data"))
+      return false;
+  }
+  return check(nreceived_ == len, "received %d bytes", int(len));
+}
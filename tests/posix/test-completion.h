@@ -0,0 +1,69 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_test_posix_completion_h_
+#define _include_amio_test_posix_completion_h_
+
+#include <amio.h>
+#include <string.h>
+#include "../testing.h"
+
+namespace amio {
+
+class TestCompletion
+ : public virtual CompletionListener,
+   public virtual Test
+{
+ public:
+  TestCompletion(CreatePoller_t ctor, const char *name);
+
+  bool Run() override;
+  void AddRef() override {
+    Test::AddRef();
+  }
+  void Release() override {
+    Test::Release();
+  }
+
+  void OnRecv(const void *data, size_t length) override {
+    size_t ncopy = ke::Min(length, sizeof(received_) - nreceived_);
+    memcpy(received_ + nreceived_, data, ncopy);
+    nreceived_ += ncopy;
+  }
+  void OnHangup(Ref<IOError> error) override {
+    got_hangup_ = true;
+    got_error_ = error;
+  }
+
+ private:
+  bool setup();
+  void reset();
+
+  bool test_listener_type();
+  bool test_recv();
+  bool test_hangup();
+  bool test_detach();
+
+  bool write(const char *msg, size_t len);
+  bool wait_for_bytes(size_t len);
+
+ private:
+  CreatePoller_t constructor_;
+  Ref<Poller> poller_;
+  Ref<Transport> reader_;
+  Ref<Transport> writer_;
+  char received_[256];
+  size_t nreceived_;
+  Ref<IOError> got_error_;
+  bool got_hangup_;
+};
+
+}
+
+#endif // _include_amio_test_posix_completion_h_
@@ -0,0 +1,189 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#include <amio.h>
+#include <unistd.h>
+#include "test-concurrency.h"
+#include <am-thread-utils.h>
+
+using namespace ke;
+using namespace amio;
+
+static const size_t kNumPipes = 8;
+static const size_t kNumThreads = 4;
+static const size_t kEventsPerPipe = 20;
+
+TestConcurrency::TestConcurrency(CreatePoller_t ctor, const char *name)
+ : Test(name),
+   constructor_(ctor)
+{
+}
+
+namespace {
+
+struct SharedState
+{
+  SharedState()
+   : inflight(0),
+     max_inflight(0),
+     overlapped(false),
+     closed(0)
+  {
+    lock = new Mutex();
+  }
+
+  bool done() {
+    AutoLock l(lock);
+    return closed == kNumPipes;
+  }
+
+  AutoPtr<Mutex> lock;
+  size_t inflight;
+  size_t max_inflight;
+  bool overlapped;
+  size_t closed;
+};
+
+// Each pipe has one byte of unread data, and is attached level-triggered,
+// so every Poll() would report it if it weren't being dispatched already.
+class PipeListener
+ : public StatusListener,
+   public ke::Refcounted<PipeListener>
+{
+ public:
+  PipeListener(SharedState *state)
+   : state_(state),
+     busy_(false),
+     count_(0)
+  {}
+
+  void AddRef() override {
+    ke::Refcounted<PipeListener>::AddRef();
+  }
+  void Release() override {
+    ke::Refcounted<PipeListener>::Release();
+  }
+
+  void OnReadReady() override {
+    {
+      AutoLock l(state_->lock);
+      if (busy_)
+        state_->overlapped = true;
+      busy_ = true;
+      state_->inflight++;
+      state_->max_inflight = ke::Max(state_->max_inflight, state_->inflight);
+    }
+
+    // Give other threads a chance to pick up the same transport.
+    usleep(200);
+
+    bool close = false;
+    {
+      AutoLock l(state_->lock);
+      busy_ = false;
+      state_->inflight--;
+      if (++count_ == kEventsPerPipe) {
+        state_->closed++;
+        close = true;
+      }
+    }
+
+    // Detach while other threads may still have events for this transport.
+    if (close)
+      reader->Close();
+  }
+
+  Ref<Transport> reader;
+  Ref<Transport> writer;
+
+ private:
+  SharedState *state_;
+  bool busy_;
+  size_t count_;
+};
+
+class PollThread : public IRunnable
+{
+ public:
+  PollThread(Poller *poller, SharedState *state)
+   : poller_(poller),
+     state_(state)
+  {}
+
+  void Run() override {
+    while (!state_->done()) {
+      if (Ref<IOError> error = poller_->Poll(kSafeTimeout)) {
+        Error = error;
+        return;
+      }
+    }
+  }
+
+  Ref<IOError> Error;
+
+ private:
+  Poller *poller_;
+  SharedState *state_;
+};
+
+} // anonymous namespace
+
+bool
+TestConcurrency::Run()
+{
+  Ref<Poller> poller;
+  Ref<IOError> error = constructor_(&poller);
+  if (!check_error(error, "create poller"))
+    return false;
+  if (!check(poller->MaximumConcurrency() != 1, "poller is concurrent"))
+    return false;
+
+  SharedState state;
+  Ref<PipeListener> listeners[kNumPipes];
+  for (size_t i = 0; i < kNumPipes; i++) {
+    Ref<PipeListener> listener = new PipeListener(&state);
+    if (!check_error(TransportFactory::CreatePipe(&listener->reader, &listener->writer), "create pipe"))
+      return false;
+
+    IOResult r;
+    char c = 'x';
+    if (!check(listener->writer->Write(&r, &c, 1) && r.completed, "write to pipe"))
+      return false;
+
+    error = poller->Attach(listener->reader, listener, Events::Read, EventMode::Level);
+    if (!check_error(error, "attach pipe"))
+      return false;
+    listeners[i] = listener;
+  }
+
+  AutoPtr<PollThread> runners[kNumThreads];
+  AutoPtr<Thread> threads[kNumThreads];
+  for (size_t i = 0; i < kNumThreads; i++) {
+    runners[i] = new PollThread(poller, &state);
+    threads[i] = new Thread(runners[i], "poll thread");
+    if (!check(threads[i]->Succeeded(), "thread started"))
+      return false;
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads[i]->Join();
+    if (!check_error(runners[i]->Error, "Poll() on thread %d", int(i)))
+      ok = false;
+  }
+
+  for (size_t i = 0; i < kNumPipes; i++)
+    listeners[i]->writer->Close();
+
+  if (!check(!state.overlapped, "no transport was dispatched on two threads at once"))
+    ok = false;
+  if (!check(state.max_inflight > 1, "callbacks ran concurrently"))
+    ok = false;
+  return ok;
+}
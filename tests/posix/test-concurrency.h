@@ -0,0 +1,33 @@
+// vim: set ts=2 sw=2 tw=99 et:
+// 
+// Copyright (C) 2014 David Anderson
+// 
+// This file is part of the AlliedModders I/O Library.
+// 
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_test_posix_concurrency_h_
+#define _include_amio_test_posix_concurrency_h_
+
+#include <amio.h>
+#include "../testing.h"
+
+namespace amio {
+
+// Tests that a poller with MaximumConcurrency() != 1 can be polled from
+// several threads at once, without dispatching one transport to two threads.
+class TestConcurrency : public Test
+{
+ public:
+  TestConcurrency(CreatePoller_t ctor, const char *name);
+
+  bool Run() override;
+
+ private:
+  CreatePoller_t constructor_;
+};
+
+}
+
+#endif // _include_amio_test_posix_concurrency_h_
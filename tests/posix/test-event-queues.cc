@@ -15,6 +15,37 @@
 using namespace ke;
 using namespace amio;
 
+#if defined(KE_POSIX)
+// Detaches every transport in the list on its first event, including the one
+// being dispatched.
+class DetachAll
+ : public StatusListener,
+   public ke::Refcounted<DetachAll>
+{
+ public:
+  DetachAll(Ref<EventQueue> evq, Vector<Ref<Transport>> *transports)
+   : evq_(evq),
+     transports_(transports),
+     nevents(0)
+  {}
+
+  KE_IMPL_REFCOUNTING(DetachAll);
+
+  void OnWriteReady() override {
+    nevents++;
+    for (size_t i = 0; i < transports_->length(); i++)
+      evq_->Detach((*transports_)[i]);
+  }
+
+ private:
+  Ref<EventQueue> evq_;
+  Vector<Ref<Transport>> *transports_;
+
+ public:
+  unsigned nevents;
+};
+#endif
+
 class TestEventQueues
  : public Test,
    public ke::Refcounted<TestEventQueues>,
@@ -108,6 +139,44 @@ class TestEventQueues
   }
 
 #if defined(KE_POSIX)
+  bool test_detach_while_queued() {
+    Ref<Poller> poller;
+    if (!check_error(PollerFactory::Create(&poller), "create poller"))
+      return false;
+
+    Ref<EventQueue> evq(EventQueue::Create(poller));
+
+    Vector<Ref<Transport>> readers;
+    Vector<Ref<Transport>> writers;
+    Ref<DetachAll> listener = new DetachAll(evq, &writers);
+    for (size_t i = 0; i < 3; i++) {
+      Ref<Transport> reader, writer;
+      if (!check_error(TransportFactory::CreatePipe(&reader, &writer), "create pipe"))
+        return false;
+      readers.append(reader);
+      writers.append(writer);
+      if (!check_error(evq->Attach(writer, listener, Events::Write, EventMode::Level), "attach writer"))
+        return false;
+    }
+
+    // The first event detaches everything, so the other queued events must
+    // be dropped.
+    if (!check_error(poller->Poll(), "poll"))
+      return false;
+    if (!check(evq->DispatchEvents(), "dispatch should process events"))
+      return false;
+    if (!check(listener->nevents == 1, "should get 1 event, got %d", listener->nevents))
+      return false;
+
+    if (!check_error(poller->Poll(0), "poll"))
+      return false;
+    if (!check(!evq->DispatchEvents(), "nothing left to dispatch"))
+      return false;
+
+    evq->Shutdown();
+    return true;
+  }
+
   void OnWriteReady() override {
     nevents_++;
   }
@@ -116,6 +185,10 @@ class TestEventQueues
   bool Run() override {
     if (!test_basic())
       return false;
+#if defined(KE_POSIX)
+    if (!test_detach_while_queued())
+      return false;
+#endif
     return true;
   }
 
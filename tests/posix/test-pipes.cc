@@ -8,12 +8,42 @@
 // License, version 3 or higher. For more information, see LICENSE.txt
 //
 #include <amio.h>
+#include <amio-time.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "test-pipes.h"
 
 using namespace ke;
 using namespace amio;
 
+namespace {
+
+class ReadCounter
+ : public StatusListener,
+   public ke::Refcounted<ReadCounter>
+{
+ public:
+  ReadCounter()
+   : reads(0)
+  {}
+
+  void AddRef() override {
+    ke::Refcounted<ReadCounter>::AddRef();
+  }
+  void Release() override {
+    ke::Refcounted<ReadCounter>::Release();
+  }
+
+  void OnReadReady() override {
+    reads++;
+  }
+
+  size_t reads;
+};
+
+} // anonymous namespace
+
 TestPipes::TestPipes(CreatePoller_t ctor, const char *name)
  : Test(name),
    constructor_(ctor)
@@ -62,6 +92,12 @@ TestPipes::Run()
 
   if (!test_read_write())
     return false;
+  if (!test_vectored())
+    return false;
+  if (!test_sendfile())
+    return false;
+  if (!test_splice())
+    return false;
   if (!test_poll_write_close())
     return false;
   if (!test_poll_read_close())
@@ -70,6 +106,16 @@ TestPipes::Run()
     return false;
   if (!test_edge_triggering())
     return false;
+  if (!test_one_shot())
+    return false;
+  if (!test_change_toggling())
+    return false;
+  if (!test_ns_timeout())
+    return false;
+  if (!test_many_pipes())
+    return false;
+  if (!test_move_to_other_poller())
+    return false;
 
   reset();
   poller_ = nullptr;
@@ -168,6 +214,221 @@ TestPipes::test_edge_triggering()
   return true;
 }
 
+bool
+TestPipes::test_one_shot()
+{
+  AutoTestContext test("one-shot events");
+  if (!setup(EventMode::OneShot))
+    return false;
+
+  if (!check_error(poller_->Poll(), "initial poll"))
+    return false;
+  if (!check(got_write_, "should receive initial write"))
+    return false;
+
+  // The writer is still writable, but it has been disarmed.
+  got_write_ = false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "second poll"))
+    return false;
+  if (!check(!got_write_, "should not receive second write"))
+    return false;
+
+  if (!write("a", 1))
+    return false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "third poll"))
+    return false;
+  if (!check(got_read_, "should have gotten read"))
+    return false;
+
+  // We haven't read the byte, but the reader has been disarmed.
+  got_read_ = false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "fourth poll"))
+    return false;
+  if (!check(!got_read_, "should not have gotten read"))
+    return false;
+
+  // Re-arm.
+  if (!check_error(poller_->AddEvents(reader_, Events::Read), "re-arm reader"))
+    return false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "fifth poll"))
+    return false;
+  if (!check(got_read_, "should have gotten read after re-arming"))
+    return false;
+
+  got_read_ = false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "sixth poll"))
+    return false;
+  if (!check(!got_read_, "should not have gotten read"))
+    return false;
+
+  // Re-attaching in another mode should not leave the transport one-shot.
+  poller_->Detach(reader_);
+  if (!check_error(poller_->Attach(reader_, this, Events::Read, EventMode::Level), "re-attach reader"))
+    return false;
+  for (size_t i = 0; i < 3; i++) {
+    got_read_ = false;
+    if (!check_error(poller_->Poll(kSafeTimeout), "poll after re-attach"))
+      return false;
+    if (!check(got_read_, "should get read %d after re-attaching", int(i + 1)))
+      return false;
+  }
+
+  return true;
+}
+
+bool
+TestPipes::test_change_toggling()
+{
+  AutoTestContext test("toggling events between polls");
+  if (!setup(EventMode::Level))
+    return false;
+
+  // Some pollers defer changes until the next Poll(), so make sure only the
+  // final state of each round counts.
+  for (size_t i = 0; i < 3; i++) {
+    if (!check_error(poller_->RemoveEvents(writer_, Events::Write), "remove write"))
+      return false;
+    if (!check_error(poller_->AddEvents(writer_, Events::Write), "add write"))
+      return false;
+  }
+  if (!check_error(poller_->RemoveEvents(writer_, Events::Write), "remove write"))
+    return false;
+
+  if (!check_error(poller_->Poll(kSafeTimeout), "first poll"))
+    return false;
+  if (!check(!got_write_, "should not receive write"))
+    return false;
+
+  for (size_t i = 0; i < 3; i++) {
+    if (!check_error(poller_->AddEvents(writer_, Events::Write), "add write"))
+      return false;
+    if (!check_error(poller_->RemoveEvents(writer_, Events::Write), "remove write"))
+      return false;
+  }
+  if (!check_error(poller_->ChangeEvents(writer_, Events::Write), "change to write"))
+    return false;
+
+  if (!check_error(poller_->Poll(kSafeTimeout), "second poll"))
+    return false;
+  if (!check(got_write_, "should receive write"))
+    return false;
+
+  // Detaching with a change outstanding should drop the change.
+  if (!check_error(poller_->RemoveEvents(writer_, Events::Write), "remove write"))
+    return false;
+  poller_->Detach(writer_);
+  writer_ = nullptr;
+
+  got_write_ = false;
+  if (!check_error(poller_->Poll(kSafeTimeout), "third poll"))
+    return false;
+  if (!check(!got_write_, "should not receive write"))
+    return false;
+
+  return true;
+}
+
+bool
+TestPipes::test_ns_timeout()
+{
+  AutoTestContext test("nanosecond timeouts");
+  if (!setup(EventMode::Level))
+    return false;
+  if (!check_error(poller_->RemoveEvents(writer_, Events::Write), "remove write"))
+    return false;
+
+  // Nothing is ready, so we should sleep for at least the timeout. Not much
+  // more, either, but that's too timing-sensitive to test for.
+  static const int64_t kTimeout = 250 * kNanosecondsPerMicrosecond;
+  for (size_t i = 0; i < 3; i++) {
+    int64_t start = HighResolutionTimer::Counter();
+    if (!check_error(poller_->PollNs(kTimeout), "poll with timeout"))
+      return false;
+    int64_t elapsed = HighResolutionTimer::Counter() - start;
+    if (!check(elapsed >= kTimeout, "waited at least 250us")) {
+      print_actual("%dns", int(elapsed));
+      return false;
+    }
+  }
+
+  if (!check_error(poller_->PollNs(0), "poll with no timeout"))
+    return false;
+  if (!check(!got_read_ && !got_write_, "should not get events"))
+    return false;
+
+  return true;
+}
+
+bool
+TestPipes::test_many_pipes()
+{
+  AutoTestContext test("many pipes");
+  reset();
+
+  // Enough descriptors to span several words of an fd_set.
+  static const size_t kNumPipes = 80;
+  Ref<Transport> readers[kNumPipes];
+  Ref<Transport> writers[kNumPipes];
+  Ref<ReadCounter> counters[kNumPipes];
+  Ref<IOError> error;
+  for (size_t i = 0; i < kNumPipes && !error; i++) {
+    error = TransportFactory::CreatePipe(&readers[i], &writers[i]);
+    if (!error) {
+      counters[i] = new ReadCounter();
+      error = poller_->Attach(readers[i], counters[i], Events::Read, EventMode::Level);
+    }
+  }
+  bool ok = check_error(error, "create and attach %d pipes", int(kNumPipes));
+
+  static const size_t kReady[] = { 0, 31, 63, 64, kNumPipes - 1 };
+  static const size_t kNumReady = sizeof(kReady) / sizeof(kReady[0]);
+  for (size_t i = 0; ok && i < kNumReady; i++) {
+    IOResult r;
+    ok = check(writers[kReady[i]]->Write(&r, "a", 1) && r.bytes == 1, "write to pipe %d",
+               int(kReady[i]));
+  }
+
+  // The second round detaches two out of every three pipes first, leaving
+  // holes behind in pollers that keep a dense array of descriptors.
+  for (size_t round = 0; ok && round < 2; round++) {
+    if (round == 1) {
+      for (size_t i = 0; i < kNumPipes; i++) {
+        counters[i]->reads = 0;
+        if (i % 3 != 0) {
+          poller_->Detach(readers[i]);
+          readers[i] = nullptr;
+        }
+      }
+    }
+
+    if (!check_error(poller_->Poll(0), "poll (round %d)", int(round))) {
+      ok = false;
+      break;
+    }
+
+    int mismatch = -1;
+    for (size_t i = 0; i < kNumPipes && mismatch == -1; i++) {
+      size_t expected = 0;
+      for (size_t j = 0; j < kNumReady; j++) {
+        if (kReady[j] == i && readers[i])
+          expected = 1;
+      }
+      if (counters[i]->reads != expected)
+        mismatch = int(i);
+    }
+    if (!check(mismatch == -1, "only written, attached pipes should be readable")) {
+      print_actual("pipe %d had %d reads", mismatch, int(counters[mismatch]->reads));
+      ok = false;
+    }
+  }
+
+  for (size_t i = 0; i < kNumPipes; i++) {
+    if (readers[i])
+      poller_->Detach(readers[i]);
+  }
+  return ok;
+}
+
 bool
 TestPipes::test_read_write()
 {
@@ -283,6 +544,211 @@ TestPipes::test_poll_read_close()
   return true;
 }
 
+bool
+TestPipes::test_vectored()
+{
+  AutoTestContext test("vectored reading and writing");
+  if (!setup(EventMode::ETS))
+    return false;
+
+  if (!check_error(poller_->Poll(), "initial poll"))
+    return false;
+  if (!check(got_write_, "should receive write"))
+    return false;
+
+  // A header and payload go out in one call.
+  char header[] = "head:";
+  char payload[] = "payload";
+  struct iovec out[2];
+  out[0].iov_base = header;
+  out[0].iov_len = 5;
+  out[1].iov_base = payload;
+  out[1].iov_len = 7;
+
+  IOResult r;
+  if (!check(writer_->WriteV(&r, out, 2), "writev to pipe"))
+    return false;
+  if (!check(r.completed && r.bytes == 12, "wrote both buffers"))
+    return false;
+
+  // Read it back, split at a different point.
+  if (!wait_for_read())
+    return false;
+
+  char first[3], second[16];
+  struct iovec in[2];
+  in[0].iov_base = first;
+  in[0].iov_len = sizeof(first);
+  in[1].iov_base = second;
+  in[1].iov_len = sizeof(second);
+  if (!check(reader_->ReadV(&r, in, 2), "readv from pipe"))
+    return false;
+  if (!check(r.completed && r.bytes == 12, "read both buffers"))
+    return false;
+  if (!check(memcmp(first, "hea", 3) == 0 && memcmp(second, "d:payload", 9) == 0, "got bytes"))
+    return false;
+
+  // Fill the pipe. Once a write would block, it's reported as incomplete and
+  // the next write event must arrive once the pipe drains.
+  static char chunk[4096];
+  struct iovec fill[4];
+  for (size_t i = 0; i < 4; i++) {
+    fill[i].iov_base = chunk;
+    fill[i].iov_len = sizeof(chunk);
+  }
+  size_t nwritten = 0;
+  while (true) {
+    if (!check(writer_->WriteV(&r, fill, 4), "fill pipe"))
+      return false;
+    if (!r.completed)
+      break;
+    nwritten += r.bytes;
+  }
+
+  got_write_ = false;
+  size_t nread = 0;
+  while (nread < nwritten) {
+    if (!check(reader_->ReadV(&r, fill, 4), "drain pipe"))
+      return false;
+    if (!r.completed) {
+      got_read_ = false;
+      if (!wait_for_read())
+        return false;
+      continue;
+    }
+    nread += r.bytes;
+  }
+  if (!wait_for_write())
+    return false;
+  return true;
+}
+
+bool
+TestPipes::test_sendfile()
+{
+  AutoTestContext test("sendfile");
+  if (!setup(EventMode::Level))
+    return false;
+
+  char path[] = "/tmp/amio-sendfile-XXXXXX";
+  int fd = mkstemp(path);
+  if (!check(fd != -1, "create temporary file"))
+    return false;
+  unlink(path);
+
+  bool ok = check(::write(fd, "0123456789", 10) == 10, "fill temporary file");
+
+  // Send from the middle; the file's own offset must not matter.
+  IOResult r;
+  if (ok)
+    ok = check(writer_->SendFile(&r, fd, 3, 4), "sendfile to pipe") &&
+         check(r.completed && r.bytes == 4, "sent 4 bytes, got %d", int(r.bytes));
+  if (ok)
+    ok = check(writer_->SendFile(&r, fd, 10, 4), "sendfile past the end") &&
+         check(r.completed && r.ended && r.bytes == 0, "should report end of file");
+  close(fd);
+  if (!ok)
+    return false;
+
+  if (!wait_for_read())
+    return false;
+
+  char buffer[16];
+  if (!check(reader_->Read(&r, buffer, sizeof(buffer)), "read from pipe"))
+    return false;
+  if (!check(r.bytes == 4 && memcmp(buffer, "3456", 4) == 0, "got bytes"))
+    return false;
+  return true;
+}
+
+bool
+TestPipes::test_splice()
+{
+#if defined(__linux__)
+  AutoTestContext test("splice");
+  if (!setup(EventMode::Level))
+    return false;
+
+  Ref<Transport> source, sink;
+  if (!check_error(TransportFactory::CreatePipe(&source, &sink), "create source pipe"))
+    return false;
+
+  // Nothing to move yet, so this should block on the source.
+  IOResult r;
+  if (!check(writer_->Splice(&r, source, 64), "splice from empty pipe"))
+    return false;
+  if (!check(!r.completed, "splice should block"))
+    return false;
+
+  if (!check(sink->Write(&r, "spliced", 7) && r.bytes == 7, "write to source pipe"))
+    return false;
+  if (!check(writer_->Splice(&r, source, 64), "splice between pipes"))
+    return false;
+  if (!check(r.completed && r.bytes == 7, "spliced 7 bytes, got %d", int(r.bytes)))
+    return false;
+
+  if (!wait_for_read())
+    return false;
+
+  char buffer[16];
+  if (!check(reader_->Read(&r, buffer, sizeof(buffer)), "read from pipe"))
+    return false;
+  if (!check(r.bytes == 7 && memcmp(buffer, "spliced", 7) == 0, "got bytes"))
+    return false;
+
+  // Once the source is closed, splice reports end-of-stream.
+  sink->Close();
+  if (!check(writer_->Splice(&r, source, 64), "splice from closed pipe"))
+    return false;
+  if (!check(r.completed && r.ended, "should report end of stream"))
+    return false;
+#endif
+  return true;
+}
+
+bool
+TestPipes::test_move_to_other_poller()
+{
+  AutoTestContext test("moving a transport with a pending change");
+  if (!setup(EventMode::Level))
+    return false;
+
+  Ref<Poller> other;
+  if (!check_error(constructor_(&other), "create second poller"))
+    return false;
+
+  // Queue a change, then move the reader to the other poller and change it
+  // there before the first poller has flushed.
+  if (!check_error(poller_->RemoveEvents(reader_, Events::Read), "remove reader events"))
+    return false;
+  poller_->Detach(reader_);
+  if (!check_error(other->Attach(reader_, this, Events::None, EventMode::Level), "attach to second poller"))
+    return false;
+  if (!check_error(other->AddEvents(reader_, Events::Read), "add reader events"))
+    return false;
+
+  // The first poller must leave the reader alone.
+  got_hangup_ = false;
+  if (!check_error(poller_->Poll(0), "poll first poller"))
+    return false;
+  if (!check(!got_hangup_, "should not get hangup"))
+    return false;
+  if (!check(!!reader_->Listener(), "reader should still be attached"))
+    return false;
+
+  if (!write("a", 1))
+    return false;
+  got_read_ = false;
+  if (!check_error(other->Poll(kSafeTimeout), "poll second poller"))
+    return false;
+  if (!check(got_read_, "second poller should report the read"))
+    return false;
+
+  other->Detach(reader_);
+  reader_ = nullptr;
+  return true;
+}
+
 bool
 TestPipes::write(const char *msg, size_t len)
 {
@@ -46,10 +46,18 @@ class TestPipes
   void reset();
 
   bool test_read_write();
+  bool test_vectored();
+  bool test_sendfile();
+  bool test_splice();
   bool test_poll_write_close();
   bool test_poll_read_close();
   bool test_sticky();
   bool test_edge_triggering();
+  bool test_one_shot();
+  bool test_change_toggling();
+  bool test_ns_timeout();
+  bool test_many_pipes();
+  bool test_move_to_other_poller();
 
   bool wait_for_read();
   bool wait_for_write();
@@ -0,0 +1,56 @@
+// vim: set ts=2 sw=2 tw=99 et:
+//
+// Copyright (C) 2014 David Anderson
+//
+// This file is part of the AlliedModders I/O Library.
+//
+// The AlliedModders I/O library is licensed under the GNU General Public
+// License, version 3 or higher. For more information, see LICENSE.txt
+//
+#ifndef _include_amio_test_posix_zerocopy_h_
+#define _include_amio_test_posix_zerocopy_h_
+
+#include <amio.h>
+#include "../testing.h"
+
+namespace amio {
+
+class TestZeroCopy
+ : public virtual StatusListener,
+   public virtual Test
+{
+ public:
+  TestZeroCopy(CreatePoller_t ctor, const char *name);
+
+  bool Run() override;
+  void AddRef() override {
+    Test::AddRef();
+  }
+  void Release() override {
+    Test::Release();
+  }
+
+  void OnHangup(Ref<IOError> error) override {
+    got_hangup_ = true;
+  }
+  void OnZeroCopyComplete(uint32_t first, uint32_t last, bool copied) override;
+
+ private:
+  bool test_not_enabled();
+  bool test_send();
+  bool test_event_queue();
+
+  bool connect_loopback(int *server, int *client);
+
+ private:
+  CreatePoller_t constructor_;
+  Ref<Poller> poller_;
+  bool got_hangup_;
+  bool in_order_;
+  uint32_t next_id_;
+  unsigned ncompletions_;
+};
+
+}
+
+#endif // _include_amio_test_posix_zerocopy_h_
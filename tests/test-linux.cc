@@ -8,8 +8,12 @@
 // License, version 3 or higher. For more information, see LICENSE.txt
 //
 #include <amio.h>
+#include "posix/test-busy-poll.h"
+#include "posix/test-completion.h"
+#include "posix/test-concurrency.h"
 #include "posix/test-pipes.h"
 #include "posix/test-threading.h"
+#include "posix/test-zerocopy.h"
 #include "common/test-server-client.h"
 
 using namespace ke;
@@ -21,6 +25,39 @@ create_epoll(Ref<Poller> *outp)
   return PollerFactory::CreateEpollImpl(outp);
 }
 
+static PassRef<IOError>
+create_concurrent_epoll(Ref<Poller> *outp)
+{
+  return PollerFactory::CreateConcurrentEpollImpl(outp);
+}
+
+static PassRef<IOError>
+create_busy_epoll(Ref<Poller> *outp)
+{
+  EpollOptions options;
+  options.spinMicroseconds = 50;
+  options.socketBusyPollMicroseconds = 50;
+  options.preferBusyPoll = true;
+  return PollerFactory::CreateEpollImpl(outp, options);
+}
+
+static PassRef<IOError>
+create_io_uring(Ref<Poller> *outp)
+{
+  return PollerFactory::CreateIoUringImpl(outp);
+}
+
+static PassRef<IOError>
+create_io_uring_small_buffers(Ref<Poller> *outp)
+{
+  // Small enough that receives span buffers and exhaust the pool.
+  IoUringOptions options;
+  options.recvBufferCount = 2;
+  options.recvBufferSize = 16;
+  options.fixedFiles = 1;
+  return PollerFactory::CreateIoUringImpl(outp, options);
+}
+
 void
 ke::SetupTests()
 {
@@ -35,4 +72,38 @@ ke::SetupTests()
   Tests.append(new TestThreading(PollerFactory::CreateSelectImpl, "select-threaded"));
   Tests.append(new TestThreading(PollerFactory::CreatePollImpl, "poll-threaded"));
   Tests.append(new TestThreading(create_epoll, "epoll-threaded"));
+  Tests.append(new TestCompletion(create_epoll, "epoll-completion"));
+
+  Tests.append(new TestZeroCopy(PollerFactory::CreateSelectImpl, "select-zerocopy"));
+  Tests.append(new TestZeroCopy(PollerFactory::CreatePollImpl, "poll-zerocopy"));
+  Tests.append(new TestZeroCopy(create_epoll, "epoll-zerocopy"));
+
+  Tests.append(new TestPipes(create_concurrent_epoll, "epoll-concurrent-pipe"));
+  Tests.append(new TestServerClient(create_concurrent_epoll, "epoll-concurrent-server-client"));
+  Tests.append(new TestThreading(create_concurrent_epoll, "epoll-concurrent-threaded"));
+  Tests.append(new TestConcurrency(create_concurrent_epoll, "epoll-concurrency"));
+
+  Tests.append(new TestPipes(create_busy_epoll, "epoll-busy-pipe"));
+  Tests.append(new TestServerClient(create_busy_epoll, "epoll-busy-server-client"));
+  Tests.append(new TestBusyPoll("epoll-busy-poll"));
+
+  // io_uring needs a recent kernel, so only test it if it's available.
+  Ref<Poller> poller;
+  if (Ref<IOError> error = create_io_uring(&poller)) {
+    fprintf(stdout, "Skipping io_uring tests: %s\n", error->Message());
+    return;
+  }
+  poller = nullptr;
+
+  Tests.append(new TestPipes(create_io_uring, "io_uring-pipe"));
+  Tests.append(new TestServerClient(create_io_uring, "io_uring-server-client"));
+
+  net::ServerOptions accept_options;
+  accept_options.acceptInDispatcher = true;
+  Tests.append(new TestServerClient(create_io_uring, "io_uring-server-client-accept", accept_options));
+
+  Tests.append(new TestThreading(create_io_uring, "io_uring-threaded"));
+  Tests.append(new TestCompletion(create_io_uring, "io_uring-completion"));
+  Tests.append(new TestCompletion(create_io_uring_small_buffers, "io_uring-completion-small"));
+  Tests.append(new TestZeroCopy(create_io_uring, "io_uring-zerocopy"));
 }
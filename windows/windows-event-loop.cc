@@ -8,6 +8,9 @@
 // License, version 3 or higher. For more information, see LICENSE.txt
 //
 #include "windows-event-loop.h"
+#include "../shared/shared-task-batch.h"
+#include <amio-time.h>
+#include <limits.h>
 #include <stdio.h>
 
 using namespace ke;
@@ -15,27 +18,45 @@ using namespace amio;
 
 PassRef<IOError>
 EventLoopForIO::Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller)
+{
+  return Create(outp, poller, EventLoopOptions());
+}
+
+PassRef<IOError>
+EventLoopForIO::Create(Ref<EventLoopForIO> *outp, Ref<Poller> poller,
+                       const EventLoopOptions &options)
 {
   if (!poller) {
     if (Ref<IOError> error = PollerFactory::Create(&poller))
       return error;
   }
 
-  *outp = new WindowsEventLoopForIO(poller);
+  *outp = new WindowsEventLoopForIO(poller, options);
   return nullptr;
 }
 
-WindowsEventLoopForIO::WindowsEventLoopForIO(Ref<Poller> poller)
+WindowsEventLoopForIO::WindowsEventLoopForIO(Ref<Poller> poller, const EventLoopOptions &options)
  : poller_(poller),
-   tasks_(this),
+   options_(options),
+   tasks_(this, options.taskQueueCapacity),
+   timers_(new TimerQueue(this)),
    wakeup_(new Wakeup()),
-   received_wakeup_(false)
+   received_wakeup_(false),
+   now_(HighResolutionTimer::Counter())
+{
+}
+
+WindowsEventLoopForIO::~WindowsEventLoopForIO()
 {
+  Shutdown();
 }
 
 void
 WindowsEventLoopForIO::Shutdown()
 {
+  // The timer queue is kept, since once shut down it frees any delayed
+  // tasks that are still posted.
+  timers_->Shutdown();
   wakeup_ = nullptr;
   poller_ = nullptr;
 }
@@ -86,6 +107,30 @@ WindowsEventLoopForIO::PostTask(Task *task)
   tasks_.PostTask(task);
 }
 
+void
+WindowsEventLoopForIO::PostTask(Task *task, TaskPriority priority)
+{
+  tasks_.PostTask(task, priority);
+}
+
+bool
+WindowsEventLoopForIO::TryPostTask(Task *task, TaskPriority priority)
+{
+  return tasks_.TryPostTask(task, priority);
+}
+
+void
+WindowsEventLoopForIO::GetTaskQueueStats(TaskQueueStats *stats)
+{
+  tasks_.GetStats(stats);
+}
+
+PassRef<Timer>
+WindowsEventLoopForIO::PostDelayedTask(Task *task, int64_t delayNs)
+{
+  return timers_->PostDelayedTask(task, delayNs);
+}
+
 void
 WindowsEventLoopForIO::PostQuit()
 {
@@ -101,19 +146,46 @@ WindowsEventLoopForIO::ShouldQuit()
 void
 WindowsEventLoopForIO::Loop()
 {
+  now_ = HighResolutionTimer::Counter();
   while (!ShouldQuit()) {
-    if (tasks_.ProcessNextTask())
-      continue;
+    LoopIterationStats stats;
+
+    // If the batch was cut short, check for I/O without blocking.
+    bool more = RunTaskBatch(&tasks_, timers_, options_, now_, &stats);
+    if (ShouldQuit())
+      break;
 
     received_wakeup_ = false;
 
-    if (Ref<IOError> error = poller_->PollOne()) {
+    Ref<IOError> error;
+    if (more) {
+      error = poller_->PollOne(0);
+    } else {
+      // IOCP only takes milliseconds, so round up to avoid waking early.
+      int timeoutMs = kNoTimeout;
+      int64_t timeoutNs = timers_->PrepareToWait();
+      if (tasks_.HasIdleTasks()) {
+        timeoutMs = 0;
+      } else if (timeoutNs != kNoTimeout) {
+        int64_t ms = (timeoutNs + kNanosecondsPerMillisecond - 1) / kNanosecondsPerMillisecond;
+        timeoutMs = int(ke::Min(ms, int64_t(INT_MAX)));
+      }
+      stats.waited = (timeoutMs != 0);
+      error = poller_->PollOne(timeoutMs);
+      timers_->FinishWait();
+    }
+    now_ = HighResolutionTimer::Counter();
+
+    if (error) {
       fprintf(stderr, "Could not poll: %s\n", error->Message());
-      continue;
+    } else if (!more && !tasks_.HasPendingTasks()) {
+      // Events are delivered from inside the poller here, so we can't tell
+      // whether there were any; idle tasks run whenever the queue is empty.
+      RunIdleBatch(&tasks_, options_, &stats);
     }
 
-    if (received_wakeup_)
-      continue;
+    if (options_.observer)
+      options_.observer->OnLoopIteration(stats);
   }
 }
 
@@ -13,6 +13,7 @@
 #include <amio.h>
 #include <amio-eventloop.h>
 #include "../shared/shared-task-queue.h"
+#include "../shared/shared-timers.h"
 
 namespace amio {
 
@@ -24,7 +25,8 @@ class WindowsEventLoopForIO
    public RefcountedThreadsafe<WindowsEventLoopForIO>
 {
  public:
-  WindowsEventLoopForIO(Ref<Poller> poller);
+  WindowsEventLoopForIO(Ref<Poller> poller, const EventLoopOptions &options);
+  ~WindowsEventLoopForIO();
 
   KE_IMPL_REFCOUNTING_TS(WindowsEventLoopForIO);
 
@@ -32,8 +34,16 @@ class WindowsEventLoopForIO
 
   PassRef<IOError> Attach(Ref<Transport> transport, Ref<IOListener> listener) override;
 
+  using EventLoop::PostTask;
   void PostTask(Task *task) override;
+  void PostTask(Task *task, TaskPriority priority) override;
+  bool TryPostTask(Task *task, TaskPriority priority) override;
+  void GetTaskQueueStats(TaskQueueStats *stats) override;
+  PassRef<Timer> PostDelayedTask(Task *task, int64_t delayNs) override;
   void PostQuit() override;
+  int64_t Now() override {
+    return now_;
+  }
   bool ShouldQuit() override;
   void Loop() override;
   void Shutdown() override;
@@ -59,9 +69,14 @@ class WindowsEventLoopForIO
 
  private:
   Ref<Poller> poller_;
+  EventLoopOptions options_;
   TaskQueueImpl tasks_;
+  Ref<TimerQueue> timers_;
   Ref<Wakeup> wakeup_;
   bool received_wakeup_;
+
+  // The loop's cached clock, updated once per iteration after polling.
+  int64_t now_;
 };
 
 } // namespace amio
@@ -415,7 +415,7 @@ Server::Create(Ref<Server> *outp,
                Ref<IODispatcher> poller,
                Ref<Address> address, Protocol protocol,
                Ref<Server::Listener> listener,
-               unsigned backlog)
+               const ServerOptions &options)
 {
   switch (protocol) {
     case Protocol::TCP:
@@ -424,8 +424,7 @@ Server::Create(Ref<Server> *outp,
     default:
       return eUnsupportedProtocol;
   }
-  if (!backlog)
-    backlog = SOMAXCONN;
+  unsigned backlog = options.backlog ? options.backlog : SOMAXCONN;
 
   Ref<SocketTransport> transport;
   if (Ref<IOError> error = SocketForAddress(&transport, address->Family(), protocol))
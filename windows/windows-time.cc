@@ -123,3 +123,16 @@ HighResolutionTimer::Counter()
 
   return lv.QuadPart / sMicrosecondsPerTick;
 }
+
+// QueryPerformanceCounter() already uses the TSC where it is reliable.
+int64_t
+HighResolutionTimer::FastCounter()
+{
+  return Counter();
+}
+
+bool
+HighResolutionTimer::HasFastCounter()
+{
+  return false;
+}